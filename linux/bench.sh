@@ -0,0 +1,168 @@
+#!/bin/sh
+# Benchmark of the analysis paths of offline on synthetic runs
+#   ./bench.sh        measure, compare with the golden references
+#   ./bench.sh -g     measure, (re)write the golden references first
+# For every size of SIZES a run bench/gen_<size>.dat is generated once by
+# ngdrvgen from the histograms of MODEL (same seed, same file), then
+# analysed with every path of PATHS. Events/s, MB/s and peak RSS (from the
+# -P report of offline) are appended to bench/results.csv, and every output
+# is compared with bench/golden/gen_<size>.root by hstcmp (TOL_LUT for -l).
+# The golden references are the output of the first path; keep them to
+# check that later versions still give the same histograms.
+# The run of the first size is also put through round trips of the formats
+# (pipe, --first/--count with the .idx, -j 1 vs -j N, .ngz, skim, gates,
+# short events),
+# each of which must give the same histograms as the plain analysis.
+# The default size is small enough for every "make bench"; the large runs
+# are opt-in, e.g.  SIZES="1G 10G 100G" NPROC=8 ./bench.sh
+
+SIZES=${SIZES:-16M}
+SEED=${SEED:-1}
+NPROC=${NPROC:-$(nproc)}
+MODEL=${MODEL:-$(ls hst/*.root)}
+TOL_LUT=${TOL_LUT:-1e-3}
+CHECKS=${CHECKS:-1}
+# name:options, one path per line (cache last: the others must not find a .soa)
+PATHS=${PATHS:-"serial:
+read:-r
+threads:-j $NPROC
+simd:-k auto -j $NPROC
+lut:-l use -j $NPROC
+cache-build:-c -j $NPROC
+cache:-c -j $NPROC"}
+
+golden=0
+[ "$1" = "-g" ] && golden=1
+
+mkdir -p bench/golden bench/out
+csv=bench/results.csv
+[ -f $csv ] || echo "date,version,run,bytes,path,options,events,loop_s,events_per_s,mb_per_s,maxrss_kb,golden" > $csv
+version=$(git describe --always --dirty 2>/dev/null || echo unknown)
+
+# value of key in a -P report
+val(){ sed -n "s/.*\"$1\": \([-0-9.e+]*\).*/\1/p" "$2" | head -1; }
+
+# check name status: print the result of a round trip, count the failures
+nfail=0
+check(){
+  if [ "$2" = 0 ]; then r=ok; else r=FAIL; nfail=$((nfail+1)); fi
+  printf "%-10s check %-8s %s\n" $run $1 $r
+}
+# same name ref out [hstcmp options]: the histograms of out are those of ref
+same(){
+  ./hstcmp $4 $2 $3 > $3.cmp 2>&1
+  s=$?
+  [ $s = 0 ] || cat $3.cmp
+  check $1 $s
+}
+
+# Round trips of the formats on run $dat, against its plain analysis
+checks(){
+  c=bench/out/${run}_check
+  ./offline -P $c.json $dat bench $c.root > $c.log 2>&1 || { check plain 1; return; }
+  # a pipe, read as it comes
+  cat $dat | ./offline - bench ${c}_pipe.root > ${c}_pipe.log 2>&1
+  same pipe $c.root ${c}_pipe.root
+  # -j N, chunks of the mmap: the Philox dithers depend on the event index only
+  ./offline -j $NPROC $dat bench ${c}_j.root > ${c}_j.log 2>&1
+  same threads $c.root ${c}_j.root
+  # --first/--count: the .idx with mmap and -j, with read(), and skipped in a stream
+  n=$(val events $c.json)
+  range="--first $((n/3)) --count $((n/3))"
+  rm -f $dat.idx
+  ./offline -j $NPROC $range $dat bench ${c}_idx.root > ${c}_idx.log 2>&1
+  ./offline -r $range $dat bench ${c}_idxr.root > ${c}_idxr.log 2>&1
+  cat $dat | ./offline $range - bench ${c}_idxs.root > ${c}_idxs.log 2>&1
+  ./hstcmp ${c}_idx.root ${c}_idxr.root > ${c}_idxr.cmp 2>&1 &&
+    ./hstcmp ${c}_idx.root ${c}_idxs.root > ${c}_idxs.cmp 2>&1
+  s=$?
+  [ $s = 0 ] || cat ${c}_idxr.cmp ${c}_idxs.cmp
+  check index $s
+  rm -f $dat.idx
+  # .ngz: compress, analyse as it is, expand back to the same bytes
+  if [ ! -x ./ngzconv ]; then
+    printf "%-10s check %-8s %s\n" $run ngz "skipped (no ngzconv)"
+  else
+    ./ngzconv -j $NPROC $dat $c.ngz > ${c}_ngz.log 2>&1
+    ./offline -j $NPROC $c.ngz bench ${c}_ngz.root >> ${c}_ngz.log 2>&1
+    if grep -q "not supported" ${c}_ngz.log; then
+      printf "%-10s check %-8s %s\n" $run ngz "skipped (offline built without USE_NGZ)"
+    else
+      same ngz $c.root ${c}_ngz.root
+      ./ngzconv -x -j $NPROC $c.ngz $c.dat >> ${c}_ngz.log 2>&1 && cmp -s $dat $c.dat
+      check ngz-x $?
+    fi
+    rm -f $c.ngz $c.dat
+  fi
+  # skim of every event, read back as a run
+  ./offline -x "tdc=-1:" $dat bench ${c}_skim.root > ${c}_skim.log 2>&1
+  ./offline ${c}_skim.skm bench ${c}_skimr.root > ${c}_skimr.log 2>&1
+  same skim $c.root ${c}_skimr.root
+  # skim by a gate, read back: the spectra behind that gate are all kept
+  ./offline -G gates.list -x neutron $dat bench ${c}_gate.root > ${c}_gate.log 2>&1
+  ./offline -G gates.list ${c}_gate.skm bench ${c}_gater.root > ${c}_gater.log 2>&1
+  same gates ${c}_gate.root ${c}_gater.root "-n hEx,hExSmear,hQDCn,hTDCQDCn,hTOFQDCn"
+  rm -f ${c}_skim.skm ${c}_gate.skm
+  # short events (every 10th has one word): the words past their end are those
+  # of the event before, with mmap, read(), a pipe and the column cache alike
+  sdat=bench/${run}_short.dat
+  ./ngdrvgen -n 100000 -x 10 -S $SEED -j $NPROC $sdat $MODEL > ${c}_short.log 2>&1
+  ./offline $sdat bench ${c}_short.root >> ${c}_short.log 2>&1
+  ./offline -r $sdat bench ${c}_shortr.root >> ${c}_short.log 2>&1
+  cat $sdat | ./offline - bench ${c}_shortp.root >> ${c}_short.log 2>&1
+  ./offline -c $sdat bench ${c}_shortc.root >> ${c}_short.log 2>&1
+  s=0
+  for o in r p c; do
+    ./hstcmp ${c}_short.root ${c}_short$o.root > ${c}_short$o.cmp 2>&1 || { s=1; cat ${c}_short$o.cmp; }
+  done
+  check short $s
+  rm -f $sdat $sdat.soa $sdat.idx
+}
+
+echo "start benchmark ($version, $NPROC threads)"
+for size in $SIZES; do
+  run=gen_$size
+  dat=bench/$run.dat
+  gold=bench/golden/$run.root
+  if [ ! -f $dat ]; then
+    ./ngdrvgen -s $size -S $SEED -j $NPROC $dat $MODEL || exit 1
+  fi
+  rm -f $dat.soa
+  first=1
+  echo "$PATHS" | while IFS=: read name opts; do
+    [ -z "$name" ] && continue
+    out=bench/out/${run}_$name
+    ./offline $opts -P $out.json $dat bench $out.root > $out.log 2>&1
+    if [ $? -ne 0 ] || [ ! -f $out.json ]; then
+      echo "$run $name : offline failed, see $out.log"
+      continue
+    fi
+    if [ $first = 1 ] && [ $golden = 1 ]; then
+      cp $out.root $gold
+      echo "$run : golden reference $gold from $name"
+    fi
+    first=0
+    tol=0
+    case "$opts" in *-l*) tol=$TOL_LUT ;; esac
+    if [ ! -f $gold ]; then
+      check=none
+    elif ./hstcmp -t $tol $gold $out.root > $out.cmp; then
+      check=ok
+    else
+      check=FAIL
+      cat $out.cmp
+    fi
+    line="$(date +%FT%T),$version,$run,$(val bytes $out.json),$name,$opts,$(val events $out.json),$(val loop_s $out.json)"
+    line="$line,$(val events_per_s $out.json),$(val mb_per_s $out.json),$(val maxrss_kb $out.json),$check"
+    echo "$line" >> $csv
+    echo "$run $name $(val events_per_s $out.json) $(val mb_per_s $out.json) $(val maxrss_kb $out.json) $check" |
+      awk '{ printf "%-10s %-12s %8.3f Mevents/s %8.1f MB/s %8d kB  golden %s\n", $1, $2, $3/1e6, $4, $5, $6 }'
+  done
+  rm -f $dat.soa
+  if [ $CHECKS = 1 ]; then
+    checks
+    CHECKS=0
+  fi
+done
+echo "end benchmark, results in $csv"
+[ $nfail = 0 ] || { echo "$nfail round-trip checks failed"; exit 1; }
@@ -1,15 +1,5 @@
 echo "start shellscript"
-echo "Al"
-./offline dat/run0041.dat "Al"
-echo "Ti"
-./offline dat/run0042.dat "Ti"
-echo "Ag"
-./offline dat/run0043.dat "Ag"
-echo "Au"
-./offline dat/run0044.dat "Au"
-echo "Li"
-./offline dat/run0045.dat "Li"
-echo "empty target"
-./offline dat/run0046s.dat "empty"
+# Al, Ti, Ag, Au, Li and empty target, all in one process (see beamtime.list)
+./offline -b beamtime.list
 
 echo "end shellscript"
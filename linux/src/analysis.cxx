@@ -0,0 +1,730 @@
+//////////////////////////////////////////////////
+// Offline Analyzer for Physics Experiments III //
+//   the analysis: constants, histograms, cuts  //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <fstream>
+
+/* headers for ROOT */
+#include <TH1F.h>
+#include <TH2F.h>
+#include <TFile.h>
+#include <TRandom3.h>
+#include <TMath.h>
+#include <TROOT.h>
+
+#include "kinematics.h"
+#include "smear.h"
+#include "dither.h"
+#include "histo.h"
+#include "analysis.h"
+#include "profrun.h"
+#include "skim.h"
+#include "fitlist.h"
+#include "mcband.h"
+
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+thread_local TRandom3 rnd;
+TFile *hfile;
+
+// Dithering of the channels (+-0.5 ch)
+//   philox  : counter-based, a function of (run seed, event index, word) only,
+//             so results do not depend on threads or chunking (default, see dither.h)
+//   trandom3: rnd.Rndm(), drawn in the order the events are analysed
+bool dithphilox = true;
+unsigned long long runseed = 4357;
+thread_local long long evindex;   // index in the run of the event being analysed (set by the event loops)
+
+// Definitions of constants 
+// Useful link: https://physics.nist.gov/cuu/Constants/Table/allascii.txt
+Double_t   cc  = 0.299792458;  // Speed of light [m/ns]
+Double_t   mp  = 938.272013;   // Proton mass [MeV/c2]
+Double_t   mn  = 939.565346;   // Neutron mass [MeV/c2]
+Double_t   tp  = 48.81;        // kinetic energy of incident proton [MeV]
+Double_t   trf = 1.0/16.2344e6 * 1.0e9;       // RF period [ns]
+Double_t   fpl = (7507.0 + 2.0 + 50.8/2.0)/1000.0; // Distance from target to detector [m]
+// Double_t   fpl_err = 25.4 / 1000.0; // Uncertainty in fpl [m]
+Double_t   fpl_err = 0.0; // Uncertainty in fpl [m]
+Double_t   ch2ns = 1.0/22.2105; /*?*/   // Conversion factor from channel to nsec [ns/ch]
+Double_t   ch2ns_err = 0.01681 / (22.2105*22.2105); /*?*/ // Error of the conversion factor [ns/ch]
+Double_t   qthpsd = 900.0; // qdc software threshold for psd [ch]
+Double_t   qthex  = 0.0;/*?*/ // qdc software threshold for ex  [ch]
+Double_t   tdcg   = 980.0;    // TDC of the gamma peak, calibrates tof0 [ch]
+Double_t   psdsl  = 5.0 / 16.0, psdof = 12.5; // n-gamma line: qdct = psdsl * qdc + psdof
+
+// Spreads of the calibration for the Monte Carlo systematics (-t, see mcsys.h)
+Double_t   fpl_sys   = 25.4 / 1000.0;  // [m] (detector thickness, the fpl_err above)
+Double_t   ch2ns_sys = ch2ns_err;      // [ns/ch]
+Double_t   tdcg_sys  = 1.0; /*?*/      // gamma peak position [ch]
+Double_t   tp_sys    = 0.1; /*?*/      // [MeV]
+int        mctoys = 0;                 // -t : number of toys (0: off)
+MC_FUNC    mcfunc;
+
+// Detector groups (GROUP: see analysis.h)
+int       chmapw  = 4;         // payload words the groups use (highest + 1, set in anaconst)
+vector<GROUP> groups;
+
+// Graphical gates (-G, see gates.h and readgates()), bit k of a map is gates[k]
+vector<GATE> gates;
+thread_local const GROUP *grp;               // group being analysed (see hsel())
+
+// Declaration of Histograms
+// (HIST1/HIST2 stand for TH1F/TH2F while filling, see histo.h; the ROOT
+//  histograms get their contents in anaend)
+// (thread_local: with -j each worker fills its own copy, see hget()/hset())
+thread_local HIST1 *hTDC, *hQDC, *hQDCg, *hQDCn, *hQDCt;
+thread_local HIST2 *hQDC2, *hQDC2e, *hQDC2c;
+thread_local HIST2 *hTDCQDC, *hTDCQDCg, *hTDCQDCn;
+thread_local HIST2 *hTOFQDC, *hTOFQDCg, *hTOFQDCn;
+thread_local HIST1 *hEx;
+thread_local HIST1 *hExSmear;
+thread_local HISTMC *hExSys;   // hEx of every toy (-t only)
+bool      uselut = false;      // -l : kinematics from the lut of the group instead of the formulas
+
+// Smearing of hExSmear
+//   exact : erf over the bin edges, added straight into the bin arrays (default)
+//   cache : same, with kernels cached for quantised (ex, ex_err), see smear.h
+//   legacy: normalised Gaussian at each bin centre, one Fill per bin
+string smearmode = "exact";
+SMEAR_AXIS smearaxis;
+thread_local SMEAR_CACHE smearcache;
+string atom_name = "hoge";
+string saveFigPath = "img/";
+string targetname;            // target of the run being analysed
+
+// Histograms of one detector group: names end with sfx, titles start with pre
+void anabook(string sfx, string pre){
+  // ##### Histogram definitions ######
+  // QDC spectrum : full gate (all), full gate (gamma), full gate (neutron), tail gate
+  hTDC  = new HIST1((atom_name + "hTDC" + sfx).c_str() , "TDC" , 1848, 200., 2048.);
+
+  // QDC spectrum : full gate (all), full gate (gamma), full gate (neutron), tail gate
+  hQDC  = new HIST1(("hQDC" + sfx).c_str(), (pre + "QDC").c_str(), 2048, 0., 2048.); 
+  hQDCg = new HIST1(("hQDCg" + sfx).c_str(), (pre + "QDCg").c_str(), 2048, 0., 2048.);
+  hQDCn = new HIST1(("hQDCn" + sfx).c_str(), (pre + "QDCn").c_str(), 2048, 0., 2048.);
+  hQDCt = new HIST1(("QhQDCt" + sfx).c_str(), (pre + "QDCt").c_str(), 2048, 0., 2048.);
+  hQDC ->GetXaxis()->SetRangeUser(10.,2048.);
+  hQDCg->GetXaxis()->SetRangeUser(10.,2048.);
+  hQDCn->GetXaxis()->SetRangeUser(10.,2048.);
+  hQDCt->GetXaxis()->SetRangeUser(10.,2048.);
+
+  // QDC full vs. tail 2D : overall, zoomed, corrected
+  hQDC2  = new HIST2(("hQDC2" + sfx).c_str() , (pre + "QDC vs. QDCt").c_str()         ,  256, 0., 2048.,  512,    0., 2048.);
+  hQDC2e = new HIST2(("hQDC2e" + sfx).c_str(), (pre + "QDC vs. QDCt (zoomed)").c_str(),  400, 0.,  400.,  400,    0.,  400.);
+  hQDC2c = new HIST2(("hQDC2c" + sfx).c_str(), (pre + "QDC vs. QDCtc").c_str()        ,  256, 0., 2048.,  250, -250.,  250.);
+  hQDC2->GetXaxis()->SetTitle("QDC [-]");
+  hQDC2->GetYaxis()->SetTitle("count [-]");
+  hQDC2e->GetXaxis()->SetTitle("QDC [-]");
+  hQDC2e->GetYaxis()->SetTitle("count [-]");
+  hQDC2c->GetXaxis()->SetTitle("QDC [-]");
+  hQDC2c->GetYaxis()->SetTitle("count [-]");
+
+  // TDC vs. QDC : all, gamma, neutron
+  hTDCQDC  = new HIST2(("hTDCQDC" + sfx).c_str()  , (pre + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
+  hTDCQDCg = new HIST2(("hTDCQDCg" + sfx).c_str() , (pre + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
+  hTDCQDCn = new HIST2(("hTDCQDCn" + sfx).c_str() , (pre + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
+
+  hTDCQDC->GetXaxis()->SetTitle("TDC [ch]");
+  hTDCQDC->GetYaxis()->SetTitle("QDC [-]");
+  hTDCQDCg->GetXaxis()->SetTitle("TDC [ch]");
+  hTDCQDCg->GetYaxis()->SetTitle("QDC [-]");
+  hTDCQDCn->GetXaxis()->SetTitle("TDC [ch]");
+  hTDCQDCn->GetYaxis()->SetTitle("QDC [-]");
+
+  // TOF vs. QDC : all, gamma, neutron
+  hTOFQDC  = new HIST2(("hTOFQDC" + sfx).c_str()  , (pre + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
+  hTOFQDCg = new HIST2(("hTOFQDCg" + sfx).c_str() , (pre + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
+  hTOFQDCn = new HIST2(("hTOFQDCn" + sfx).c_str() , (pre + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
+
+  hTOFQDC->GetXaxis()->SetTitle("TOF [ns]");
+  hTOFQDC->GetYaxis()->SetTitle("QDC");
+  hTOFQDCg->GetXaxis()->SetTitle("TOF [ns]");
+  hTOFQDCg->GetYaxis()->SetTitle("QDC");
+  hTOFQDCn->GetXaxis()->SetTitle("TOF [ns]");
+  hTOFQDCn->GetYaxis()->SetTitle("QDC");
+
+
+  // Excitation energy
+  hEx = new HIST1(("hEx" + sfx).c_str(), (pre + "Ex").c_str() , 400, -10.0, 30.0);
+  hEx->GetXaxis()->SetTitle("Energy [MeV]");
+  hEx->GetYaxis()->SetTitle("Count [-]");
+  hExSmear = new HIST1(("hExSmear" + sfx).c_str(), (pre + "Ex").c_str() , 400, -10.0, 30.0);
+  hExSmear->GetXaxis()->SetTitle("Energy [MeV]");
+  hExSmear->GetYaxis()->SetTitle("Count [-]");
+  hExSmear->Sumw2();
+  smearaxis.nb     = hExSmear->GetNbinsX();
+  smearaxis.xmin   = hExSmear->xmin;
+  smearaxis.bw     = hExSmear->GetBinWidth(1);
+  smearaxis.nsigma = 6;
+}
+
+
+// The histograms of the current group (see the plumbing below the banner)
+vector<HIST*> hcurset();
+
+int anainit(string hstFileName){
+  // anainit is executed ONCE at the beginning of the program
+  PROF_SCOPE ps(profon ? profget() : 0, PROF_INIT);
+
+  // ##### Open the output histogram file #####
+  hfile = new TFile(hstFileName.c_str(),"RECREATE","ROOT Histogram File");
+
+  // ##### Run constants #####
+  anaconst();
+  gateinit();
+
+  // ##### Histograms of every detector group #####
+  hgrp.clear();
+  for (size_t g=0; g<groups.size(); g++) {
+    if (g == 0) anabook("", atom_name);
+    else        anabook("_" + groups[g].name, atom_name + groups[g].name + " ");
+    hExSys = mctoys > 0 ? new HISTMC(groups[g].toys, mcfunc, *hEx) : 0;
+    hgrp.push_back(hcurset());
+  }
+  hsel(0);
+
+  return 0;
+}
+
+
+// Gaussian smearing of one neutron event into hExSmear (see smearmode)
+void smearfill(Double_t ex, Double_t ex_err){
+  if (smearmode == "legacy") {
+    const int    Nsigma = 6;
+    const int    nb = hExSmear->GetNbinsX();
+    const double bw = hExSmear->GetBinWidth(1);
+    int bmin = hExSmear->FindFixBin(ex - Nsigma*ex_err);
+    int bmax = hExSmear->FindFixBin(ex + Nsigma*ex_err);
+    bmin = std::max(bmin, 1);
+    bmax = std::min(bmax, nb);
+
+    // 規格化済みガウス（TMath::Gaus(..., norm=true)）×bin幅 を重みとして Fill
+    for (int b = bmin; b <= bmax; ++b) {
+      double xc  = hExSmear->GetBinCenter(b);
+      double pdf = TMath::Gaus(xc, ex, ex_err, /*norm=*/true);
+      double w   = pdf * bw;
+      hExSmear->Fill(xc, w);
+    }
+    return;
+  }
+  if (smearmode == "cache") smear_cached(smearcache, smearaxis, hExSmear->GetArray(), hExSmear->GetSumw2Array(), ex, ex_err);
+  else                      smear_exact(smearaxis, hExSmear->GetArray(), hExSmear->GetSumw2Array(), ex, ex_err);
+  hExSmear->SetEntries(hExSmear->GetEntries() + 1);
+}
+
+int anagroup(const GROUP &G, const unsigned short *anabuff);
+
+int anaexec(int event_size, const unsigned short *anabuff){
+  // anaexec is executed for each event: every detector group is analysed
+  if (skimon) skimopen(1, &evindex, anabuff, 0);
+  for (size_t g=0; g<groups.size(); g++) {
+    hsel(g);
+    anagroup(groups[g], anabuff);
+  }
+  if (skimon) skimclose();
+  return 0;
+}
+
+void anakin(const GROUP &G, Double_t tdc, Double_t &tofr, Double_t &tof, Double_t &ex, Double_t &ex_err){
+  // anakin calculates TOF and the excitation energy of one event of the detector G
+  // TOF calculation (tof0: see anaconst)
+  tofr = - tdc *G.ch2ns + G.tof0 ;  // tofr = tof - RF*n
+  tof  = tofr + trf; // corrected for RF cycles
+
+  // Neutron and excitation energy 
+  Double_t betan  = (G.fpl / tof) / cc ; /*?*/   // beta  of neutron
+  Double_t gamman = 1.0 / sqrt(1.0 - betan * betan); /*?*/   // gamma of neutron
+  Double_t tn = mn * gamman - mn; /*?*/       // kinetic energy of neutron
+  ex = tp - tn; /*?*/       // excitation energy
+
+  // calc uncertainty in TOF due to tdc channel uncertainty
+  
+  // TOF uncertainty propagation
+  Double_t tof_err  = sqrt( pow(tdc * G.ch2ns_err, 2) + pow(G.tof0_err, 2) );
+  
+  // Neutron energy uncertainty propagation
+  Double_t betan_err = sqrt( pow( (G.fpl / (cc * tof * tof)) * tof_err , 2) + pow( (1.0 / (cc * tof)) * G.fpl_err , 2) );
+  Double_t gamman_err = betan / pow(1.0 - betan * betan, 3.0/2.0) * betan_err;
+  Double_t tn_err = mn * gamman_err; // assuming no uncertainty in mn
+  ex_err = tn_err; // assuming no uncertainty in tp
+}
+
+int anagroup(const GROUP &G, const unsigned short *anabuff){
+  // anagroup analyses the detector G of one event
+
+  Double_t tdc,qdc,qdct;
+  // Rename from circuit channels to physical variables
+  //   tdc  : Trf-Tdet [ch]
+  //   qdc  : Charge (full gate) [ch]
+  //   qdct : Charge (tail gate) [ch]
+  // (words of the group: [ Group A ] 0, 2, 3  [ Group B ] 1, 4, 5)
+  tdc  = anabuff[G.tdc ] + dither(G.tdc );
+  qdc  = anabuff[G.qdc ] + dither(G.qdc );
+  qdct = anabuff[G.qdct] + dither(G.qdct);
+  proflap(PROF_DECODE);
+
+  Double_t tofr, tof, ex, ex_err;
+  if (skimkin) {
+    // computed when the skim was written
+    const Double_t *k = skimkin + SKM_NKIN*(&G - &groups[0]);
+    proflap(PROF_KIN);
+    return anafill(tdc, qdc, qdct, k[0], k[1], k[2], k[3]);
+  }
+  if (uselut) {
+    kin_lut(*G.lut, G.kconst, 1, &tdc, &tofr, &tof, &ex, &ex_err);
+    proflap(PROF_KIN);
+    return anafill(tdc, qdc, qdct, tofr, tof, ex, ex_err);
+  }
+
+  anakin(G, tdc, tofr, tof, ex, ex_err);
+  proflap(PROF_KIN);
+
+  return anafill(tdc, qdc, qdct, tofr, tof, ex, ex_err);
+}
+
+
+// The cuts of group G for one event (anafill, and the queries of -D)
+void anacuts(const GROUP &G, Double_t tdc, Double_t qdc, Double_t qdct,
+             Double_t &qdctc, uint32_t &gbits, Bool_t &is_undefined_line, Bool_t &fNeutron, Bool_t &fGamma){
+  // n-gamma separation
+  qdctc = qdct - (G.psdsl * qdc + G.psdof); /* threshold whether the particle is Neutron or not*/
+  // gates (-G): the bits of all gates the event is inside of, one lookup per plane;
+  // gates named line, neutron, gamma replace the straight lines
+  gbits = 0;
+  if (G.gmap[GATE_QDC2])   gbits |= gatebits(*G.gmap[GATE_QDC2], qdc, qdct);
+  if (G.gmap[GATE_TDCQDC]) gbits |= gatebits(*G.gmap[GATE_TDCQDC], tdc, qdc);
+  is_undefined_line = G.gline ? (gbits & G.gline) != 0 : qdc - (3.0 * tdc - 1500.0) > 0.0; // flag to remove the undefined line peak.
+  Bool_t psdn = G.gneut ? (gbits & G.gneut) != 0 : qdctc>0.0;
+  Bool_t psdg = G.ggam  ? (gbits & G.ggam ) != 0 : qdctc<0.0;
+  fNeutron = qdc>G.qthpsd && psdn && is_undefined_line; // fNeutron=true for neutron events
+  fGamma   = qdc>G.qthpsd && psdg && is_undefined_line; // fGamma  =true for gamma   events
+}
+
+int anafill(Double_t tdc, Double_t qdc, Double_t qdct,
+            Double_t tofr, Double_t tof, Double_t ex, Double_t ex_err){
+  // anafill applies the cuts of the group grp and fills its histograms for one event
+
+  Double_t qdctc;  // Charge (tail gate) corrected for PSD [ch]
+  uint32_t gbits;
+  Bool_t is_undefined_line, fNeutron, fGamma;
+  anacuts(*grp, tdc, qdc, qdct, qdctc, gbits, is_undefined_line, fNeutron, fGamma);
+
+  if (profon) profcut(qdc>0.0, is_undefined_line, fNeutron, fGamma, qdc>qthex && fNeutron, gbits);
+  if (skimon) skimmark(tdc, qdc, qdct, qdctc, tofr, tof, ex, ex_err, fNeutron, fGamma, gbits);
+
+  // Fill in the histograms
+  if(! (qdc>0.0)) { proflap(PROF_FILL); return 0; }  // If qdc is not recorded, skip the event.
+
+  hTDC ->Fill(tdc );
+  hQDC ->Fill(qdc );
+  hQDCt->Fill(qdct);
+  if(fNeutron) hQDCn->Fill(qdc );
+  if(fGamma  ) hQDCg->Fill(qdc );
+
+  //  if(tdc<200. || tdc>2100.) return 0;
+
+  hQDC2 ->Fill(qdc, qdct);
+  hQDC2e->Fill(qdc, qdct);
+  hQDC2c->Fill(qdc, qdctc);
+
+  hTDCQDC->Fill(tdc,qdc);
+  if(fNeutron) hTDCQDCn->Fill(tdc,qdc);
+  if(fGamma  ) hTDCQDCg->Fill(tdc,qdc);
+
+  hTOFQDC->Fill(tofr,qdc);
+  if(fNeutron) hTOFQDCn->Fill(tof,qdc);
+  if(fGamma  ) hTOFQDCg->Fill(tof,qdc);
+
+  if(qdc>qthex && fNeutron) {
+    hEx->Fill(ex);
+    proflap(PROF_FILL);
+
+    smearfill(ex, ex_err);
+    proflap(PROF_SMEAR);
+    if (hExSys) {
+      hExSys->Fill(tdc);
+      proflap(PROF_TOYS);
+    }
+    return 0;
+  }
+
+  proflap(PROF_FILL);
+  return 0;
+}
+
+
+// anafill over a block of n events of the group grp (the column cache, see
+// colchunk): the cuts of all of them first, then one histogram after the
+// other over the events each one takes. Every histogram gets its events in
+// the same order as from anafill, so with the same contents.
+void anafillblk(int n, const Double_t *tdc, const Double_t *qdc, const Double_t *qdct,
+                const Double_t *tofr, const Double_t *tof, const Double_t *ex, const Double_t *ex_err){
+  static thread_local Double_t qdctc[fillblk];
+  static thread_local uint32_t gbits[fillblk];
+  static thread_local Bool_t   fline[fillblk], fn[fillblk], fg[fillblk];
+  static thread_local int      all[fillblk], neut[fillblk], gam[fillblk], exn[fillblk];
+  for (int j=0; j<n; j++) anacuts(*grp, tdc[j], qdc[j], qdct[j], qdctc[j], gbits[j], fline[j], fn[j], fg[j]);
+  if (profon)
+    for (int j=0; j<n; j++) profcut(qdc[j]>0.0, fline[j], fn[j], fg[j], qdc[j]>qthex && fn[j], gbits[j]);
+
+  // events with qdc recorded, and of those the neutrons, gammas and neutrons into hEx
+  int na = 0, nn = 0, ng = 0, nx = 0;
+  for (int j=0; j<n; j++) {
+    if (!(qdc[j]>0.0)) continue;
+    all[na++] = j;
+    if (fn[j]) neut[nn++] = j;
+    if (fg[j]) gam [ng++] = j;
+    if (qdc[j]>qthex && fn[j]) exn[nx++] = j;
+  }
+
+  for (int i=0; i<na; i++) hTDC ->Fill(tdc [all[i]]);
+  for (int i=0; i<na; i++) hQDC ->Fill(qdc [all[i]]);
+  for (int i=0; i<na; i++) hQDCt->Fill(qdct[all[i]]);
+  for (int i=0; i<nn; i++) hQDCn->Fill(qdc [neut[i]]);
+  for (int i=0; i<ng; i++) hQDCg->Fill(qdc [gam[i]]);
+
+  for (int i=0; i<na; i++) hQDC2 ->Fill(qdc[all[i]], qdct [all[i]]);
+  for (int i=0; i<na; i++) hQDC2e->Fill(qdc[all[i]], qdct [all[i]]);
+  for (int i=0; i<na; i++) hQDC2c->Fill(qdc[all[i]], qdctc[all[i]]);
+
+  for (int i=0; i<na; i++) hTDCQDC ->Fill(tdc[all[i]],  qdc[all[i]]);
+  for (int i=0; i<nn; i++) hTDCQDCn->Fill(tdc[neut[i]], qdc[neut[i]]);
+  for (int i=0; i<ng; i++) hTDCQDCg->Fill(tdc[gam[i]],  qdc[gam[i]]);
+
+  for (int i=0; i<na; i++) hTOFQDC ->Fill(tofr[all[i]], qdc[all[i]]);
+  for (int i=0; i<nn; i++) hTOFQDCn->Fill(tof[neut[i]], qdc[neut[i]]);
+  for (int i=0; i<ng; i++) hTOFQDCg->Fill(tof[gam[i]],  qdc[gam[i]]);
+
+  for (int i=0; i<nx; i++) hEx->Fill(ex[exn[i]]);
+  proflap(PROF_FILL);
+  for (int i=0; i<nx; i++) smearfill(ex[exn[i]], ex_err[exn[i]]);
+  proflap(PROF_SMEAR);
+  if (hExSys) {
+    for (int i=0; i<nx; i++) hExSys->Fill(tdc[exn[i]]);
+    proflap(PROF_TOYS);
+  }
+}
+
+int anaend(){
+  // anaend is executed ONCE at the end of the program
+  PROF_SCOPE ps(profon ? profget() : 0, PROF_WRITE);
+  
+  anaexport();
+  hfile->Write(); // Write the histograms into the output file
+  hEx->th->Print((saveFigPath + "/excitation.png").c_str());
+  if (!fitlines.empty()) fitcollect();
+  if (mctoys > 0) mcend();
+  return 0;
+}
+
+
+// ##### Groups, histogram sets and the parameter files #####
+
+// Dither of payload word ch of the current event (the block of 4 words of
+// the last call is kept, for the seed it was drawn with)
+Double_t dither(int ch){
+  if (!dithphilox) return rnd.Rndm()-0.5;
+  static thread_local long long ev = -1;
+  static thread_local int blk = -1;
+  static thread_local unsigned long long seed;
+  static thread_local uint32_t u[4];
+  if (ev != evindex || blk != ch/4 || seed != runseed) {
+    ev = evindex;  blk = ch/4;  seed = runseed;
+    uint32_t ctr[4] = { (uint32_t)ev, (uint32_t)((unsigned long long)ev >> 32), (uint32_t)blk, 0 };
+    philox4x32(ctr, runseed, u);
+  }
+  return dither_u2d(u[ch%4]);
+}
+
+// A group on words tdc, qdc, qdct with the default constants
+GROUP defgroup(string name, int tdc, int qdc, int qdct){
+  GROUP G = {};
+  G.name = name;  G.tdc = tdc;  G.qdc = qdc;  G.qdct = qdct;
+  G.ch2ns = ch2ns;  G.ch2ns_err = ch2ns_err;  G.fpl = fpl;  G.fpl_err = fpl_err;  G.tdcg = tdcg;
+  G.psdsl = psdsl;  G.psdof = psdof;  G.qthpsd = qthpsd;
+  G.fpl_sys = fpl_sys;  G.ch2ns_sys = ch2ns_sys;  G.tdcg_sys = tdcg_sys;
+  return G;
+}
+
+// Constants of a group derived from its calibration
+void groupconst(GROUP &G){
+  G.tof0     = G.fpl / cc + G.tdcg * G.ch2ns;   // constant term calibrated by gamma peak (i.e. L/C + TDC_gamma).
+  G.tof0_err = sqrt(pow(G.fpl_err / cc, 2) + pow(G.tdcg * G.ch2ns_err, 2));
+  KIN_CONST &k = G.kconst;
+  k.tof0 = G.tof0;  k.trf = trf;  k.ch2ns = G.ch2ns;  k.lc = G.fpl / cc;
+  k.mn = mn;  k.tp = tp;  k.ch2ns_err = G.ch2ns_err;
+  k.tof0_err2 = G.tof0_err * G.tof0_err;  k.lc_err = G.fpl_err / cc;
+  if (!G.lut) G.lut = new KIN_LUT;
+  kin_lutbuild(*G.lut, k);
+  if (mctoys > 0) {
+    const double sys[4] = { G.fpl_sys, G.ch2ns_sys, G.tdcg_sys, tp_sys };
+    if (!G.toys) G.toys = new MC_TOYS;
+    mc_draw(*G.toys, mctoys, runseed, &G - &groups[0], G.fpl, G.ch2ns, G.tdcg, tp, cc, trf, mn, sys);
+  }
+}
+
+void anaconst(){
+  // constants derived once per run from the definitions above, for every group
+  chmapw = 0;
+  for (GROUP &G : groups) {
+    chmapw = std::max(chmapw, std::max(G.tdc, std::max(G.qdc, G.qdct)) + 1);
+    groupconst(G);
+  }
+}
+
+// The histograms the pointers above point to, in a fixed order
+vector<HIST*> hcur(){
+  return { hTDC, hQDC, hQDCg, hQDCn, hQDCt,
+           hQDC2, hQDC2e, hQDC2c,
+           hTDCQDC, hTDCQDCg, hTDCQDCn,
+           hTOFQDC, hTOFQDCg, hTOFQDCn,
+           hEx, hExSmear };
+}
+const size_t hnum = 16;                   // histograms per group (+ hExSys with -t)
+
+// The set of the current group: the histograms above, then hExSys
+vector<HIST*> hcurset(){
+  vector<HIST*> h = hcur();
+  if (hExSys) h.push_back(hExSys);
+  return h;
+}
+
+// Histogram sets of the calling thread, one per detector group
+thread_local vector<vector<HIST*> > hgrp;
+
+// Point the histogram pointers at the set of group g
+void hselect(const vector<HIST*> &h){
+  int k=0;
+  hTDC    =(HIST1*)h[k++]; hQDC    =(HIST1*)h[k++]; hQDCg   =(HIST1*)h[k++]; hQDCn=(HIST1*)h[k++]; hQDCt=(HIST1*)h[k++];
+  hQDC2   =(HIST2*)h[k++]; hQDC2e  =(HIST2*)h[k++]; hQDC2c  =(HIST2*)h[k++];
+  hTDCQDC =(HIST2*)h[k++]; hTDCQDCg=(HIST2*)h[k++]; hTDCQDCn=(HIST2*)h[k++];
+  hTOFQDC =(HIST2*)h[k++]; hTOFQDCg=(HIST2*)h[k++]; hTOFQDCn=(HIST2*)h[k++];
+  hEx     =(HIST1*)h[k++]; hExSmear=(HIST1*)h[k++];
+  hExSys  = h.size() > hnum ? (HISTMC*)h[k++] : 0;
+}
+void hsel(size_t g){
+  hselect(hgrp[g]);
+  grp = &groups[g];
+}
+
+// Histograms of the calling thread (all groups), in a fixed order
+vector<HIST*> hget(){
+  vector<HIST*> h;
+  for (auto &s : hgrp) h.insert(h.end(), s.begin(), s.end());
+  return h;
+}
+
+// Let the calling thread fill the histograms h (same order as hget())
+void hset(const vector<HIST*> &h){
+  hgrp.clear();
+  size_t n = hnum + (mctoys > 0);
+  for (size_t k=0; k<h.size(); k+=n) hgrp.push_back(vector<HIST*>(h.begin()+k, h.begin()+k+n));
+  hsel(0);
+}
+
+// Rasterise the gates of every group once (gates.h); gates named line,
+// neutron and gamma take the place of the cuts of the same name in anafill
+void gateinit(){
+  for (GROUP &G : groups) {
+    for (int p=0; p<GATE_NPLANE; p++) {
+      if (G.gmap[p]) continue;
+      vector<const GATE*> g;
+      vector<int> bit;
+      for (size_t k=0; k<gates.size(); k++) {
+        const GATE &q = gates[k];
+        if (q.plane != p || (!q.group.empty() && q.group != G.name)) continue;
+        g.push_back(&q);
+        bit.push_back(k);
+        if (q.name == "line")    G.gline |= 1u << k;
+        if (q.name == "neutron") G.gneut |= 1u << k;
+        if (q.name == "gamma")   G.ggam  |= 1u << k;
+      }
+      if (g.empty()) continue;
+      G.gmap[p] = new GATE_MAP;
+      gatebuild(*G.gmap[p], g, bit);
+      cout << "Gates of group " << G.name << " on " << gate_plane[p] << ":";
+      for (const GATE *q : g) cout << " " << q->name;
+      cout << " (" << G.gmap[p]->cell.size()*4/1024 << " kB)\n";
+    }
+  }
+}
+
+// Private empty copies of the calling thread's histograms (no ROOT objects)
+vector<HIST*> hclone(){
+  vector<HIST*> h;
+  for (HIST *o : hget()) h.push_back(o->clone());
+  return h;
+}
+
+// Add the copies h into the calling thread's histograms and delete them
+void hmerge(vector<HIST*> &h){
+  vector<HIST*> dst = hget();
+  for (size_t k=0; k<h.size(); k++) {
+    dst[k]->add(*h[k]);
+    delete h[k];
+  }
+  h.clear();
+}
+
+// Copy the histograms filled so far into their ROOT histograms
+void anaexport(){
+  for (HIST *h : hget()) h->hexport();
+  for (size_t g=0; g<hgrp.size() && smearmode != "legacy"; g++) {
+    // bins were filled directly: recompute the statistics from the contents
+    hsel(g);
+    Double_t n = hExSmear->GetEntries();
+    hExSmear->th->ResetStats();
+    hExSmear->th->SetEntries(n);
+  }
+  if (!hgrp.empty()) hsel(0);
+}
+
+// Function the event loops call for every event (anaexec, anabatch or psdscan)
+int  (*anafunc)(int, const unsigned short *) = anaexec;
+// ... and once at the end of every chunk, for the ones buffering events
+void (*anaflush)() = 0;
+
+
+// Channel map (-g): one detector group per line,
+//   name tdc qdc qdct [key=value ...]
+// tdc, qdc, qdct are payload words (0..5); keys ch2ns, ch2ns_err, fpl,
+// fpl_err, tdcg, psdsl, psdof, qthpsd and the spreads of the toys of -t
+// fpl_sys, ch2ns_sys and tdcg_sys override the defaults of analysis.cxx.
+// '#' starts a comment.
+bool readchmap(string file){
+  ifstream fin(file.c_str());
+  if (!fin) {
+    cerr << "cannot open channel map " << file << "\n";
+    return false;
+  }
+  groups.clear();
+  string line;
+  for (int n=1; getline(fin, line); n++) {
+    line = line.substr(0, line.find('#'));
+    istringstream ss(line);
+    string name, kv;
+    int tdc, qdc, qdct;
+    if (!(ss >> name)) continue;
+    if (!(ss >> tdc >> qdc >> qdct) || std::min(tdc, std::min(qdc, qdct)) < 0 ||
+        std::max(tdc, std::max(qdc, qdct)) >= chmapnw) {
+      cerr << file << ":" << n << ": bad channels (words 0.." << chmapnw-1 << ")\n";
+      return false;
+    }
+    GROUP G = defgroup(name, tdc, qdc, qdct);
+    while (ss >> kv) {
+      size_t eq = kv.find('=');
+      string key = kv.substr(0, eq);
+      double v;
+      Double_t *dst = key == "ch2ns"   ? &G.ch2ns   : key == "ch2ns_err" ? &G.ch2ns_err :
+                      key == "fpl"     ? &G.fpl     : key == "fpl_err"   ? &G.fpl_err   :
+                      key == "tdcg"    ? &G.tdcg    : key == "psdsl"     ? &G.psdsl     :
+                      key == "psdof"   ? &G.psdof   : key == "qthpsd"    ? &G.qthpsd    :
+                      key == "fpl_sys" ? &G.fpl_sys : key == "ch2ns_sys" ? &G.ch2ns_sys :
+                      key == "tdcg_sys" ? &G.tdcg_sys : 0;
+      if (eq == string::npos || !dst || sscanf(kv.c_str() + eq + 1, "%lf", &v) != 1) {
+        cerr << file << ":" << n << ": bad setting " << kv << "\n";
+        return false;
+      }
+      *dst = v;
+    }
+    for (const GROUP &o : groups)
+      if (o.name == name) {
+        cerr << file << ":" << n << ": group " << name << " defined twice\n";
+        return false;
+      }
+    groups.push_back(G);
+  }
+  if (groups.empty()) {
+    cerr << "no groups in " << file << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Gates (-G): one polygon per line,
+//   name plane [group=G] x,y x,y x,y ...
+// plane qdc2 (x QDC, y QDCt) or tdcqdc (x TDC, y QDC), vertices in channels
+// (at least 3; a line starting with a vertex goes on with the gate before).
+// Without group= a gate applies to every group; a name may be given again
+// for another group.
+// '#' starts a comment.
+bool readgates(string file){
+  ifstream fin(file.c_str());
+  if (!fin) {
+    cerr << "cannot open gate list " << file << "\n";
+    return false;
+  }
+  string line, t;
+  for (int n=1; getline(fin, line); n++) {
+    line = line.substr(0, line.find('#'));
+    istringstream ss(line);
+    if (!(ss >> t)) continue;
+    double x, y;
+    char comma;
+    if (sscanf(t.c_str(), "%lf%c%lf", &x, &comma, &y) != 3 || comma != ',') {
+      // a new gate
+      GATE g;
+      g.name = t;
+      string plane;
+      if (!(ss >> plane)) plane = "";
+      g.plane = -1;
+      for (int p=0; p<GATE_NPLANE; p++) if (plane == gate_plane[p]) g.plane = p;
+      if (g.plane < 0) {
+        cerr << file << ":" << n << ": bad plane " << plane << " (qdc2 or tdcqdc)\n";
+        return false;
+      }
+      if (gates.size() == GATE_MAX) {
+        cerr << file << ":" << n << ": more than " << GATE_MAX << " gates\n";
+        return false;
+      }
+      gates.push_back(g);
+      if (!(ss >> t)) continue;
+    } else if (gates.empty()) {
+      cerr << file << ":" << n << ": vertex before the first gate\n";
+      return false;
+    }
+    GATE &g = gates.back();
+    do {
+      if (t.compare(0, 6, "group=") == 0) {
+        g.group = t.substr(6);
+        bool known = false;
+        for (const GROUP &G : groups) known |= G.name == g.group;
+        if (!known) {
+          cerr << file << ":" << n << ": no group " << g.group << "\n";
+          return false;
+        }
+      } else if (sscanf(t.c_str(), "%lf%c%lf", &x, &comma, &y) == 3 && comma == ',') {
+        g.x.push_back(x);
+        g.y.push_back(y);
+      } else {
+        cerr << file << ":" << n << ": bad vertex " << t << "\n";
+        return false;
+      }
+    } while (ss >> t);
+  }
+  for (size_t k=0; k<gates.size(); k++) {
+    const GATE &g = gates[k];
+    if (g.x.size() < 3) {
+      cerr << file << ": gate " << g.name << " has fewer than 3 vertices\n";
+      return false;
+    }
+    // a name may be given once per group
+    for (size_t i=0; i<k; i++)
+      if (gates[i].name == g.name && (gates[i].group.empty() || g.group.empty() || gates[i].group == g.group)) {
+        cerr << file << ": gate " << g.name << " defined twice for a group\n";
+        return false;
+      }
+  }
+  if (gates.empty()) {
+    cerr << "no gates in " << file << "\n";
+    return false;
+  }
+  return true;
+}
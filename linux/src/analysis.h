@@ -0,0 +1,108 @@
+/*
+  The analysis as the other units of offline see it
+  The run constants, the detector groups and gates, the histograms of the
+  calling thread, and the functions the event loops and the modes call.
+  All of it is defined in analysis.cxx.
+*/
+
+#ifndef __ANALYSIS_H__
+#define __ANALYSIS_H__
+
+#include <string>
+#include <vector>
+
+#include <TFile.h>
+#include <TRandom3.h>
+
+#include "kinematics.h"
+#include "histo.h"
+#include "mcsys.h"
+#include "gates.h"
+
+extern thread_local TRandom3 rnd;
+extern TFile *hfile;
+
+/* Dithering of the channels (philox or trandom3, see dither()) */
+extern bool               dithphilox;
+extern unsigned long long runseed;
+extern thread_local long long evindex;   /* index in the run of the event being analysed */
+Double_t dither(int ch);
+
+/* Constants */
+extern Double_t cc, mp, mn, tp, trf, fpl, fpl_err, ch2ns, ch2ns_err;
+extern Double_t qthpsd, qthex, tdcg, psdsl, psdof;
+extern Double_t fpl_sys, ch2ns_sys, tdcg_sys, tp_sys;   /* spreads of the toys (-t) */
+extern int      mctoys;
+extern MC_FUNC  mcfunc;
+
+/* Detector groups
+   A group is one detector: the payload words of its TDC, QDC and QDCt, its
+   calibration and its PSD cut (the constants above are the defaults). All
+   groups are analysed in the same pass, each into its own histogram set.
+   Without -g only Group A is analysed (see readchmap()). */
+const int chmapnw = 6;         /* payload words a group can use (those of the column cache) */
+extern int chmapw;             /* payload words the groups use (highest + 1, set in anaconst) */
+struct GROUP {
+  std::string name;
+  int       tdc, qdc, qdct;                  /* payload words */
+  Double_t  ch2ns, ch2ns_err, fpl, fpl_err, tdcg;
+  Double_t  psdsl, psdof, qthpsd;
+  Double_t  fpl_sys, ch2ns_sys, tdcg_sys;    /* spreads of the toys (-t) */
+  Double_t  tof0, tof0_err;                  /* constant term of TOF and its error [ns] (set in anaconst) */
+  KIN_CONST kconst;                          /* the constants for the batched kernels */
+  KIN_LUT  *lut;                             /* ex, ex_err per TDC channel (set in anaconst) */
+  MC_TOYS  *toys;                            /* calibration of the toys (set in anaconst with -t) */
+  GATE_MAP *gmap[GATE_NPLANE];               /* gates of the group on each plane (set in anainit with -G) */
+  uint32_t  gline, gneut, ggam;              /* bits of its gates named line, neutron, gamma */
+};
+extern std::vector<GROUP> groups;
+extern std::vector<GATE>  gates;             /* graphical gates (-G), bit k of a map is gates[k] */
+extern thread_local const GROUP *grp;        /* group being analysed (see hsel()) */
+
+GROUP defgroup(std::string name, int tdc, int qdc, int qdct);
+void  groupconst(GROUP &G);
+void  anaconst();
+void  gateinit();
+bool  readchmap(std::string file);
+bool  readgates(std::string file);
+
+/* Histograms of the calling thread, of the group selected with hsel() */
+extern thread_local HIST1 *hTDC, *hQDC, *hQDCg, *hQDCn, *hQDCt;
+extern thread_local HIST2 *hQDC2, *hQDC2e, *hQDC2c;
+extern thread_local HIST2 *hTDCQDC, *hTDCQDCg, *hTDCQDCn;
+extern thread_local HIST2 *hTOFQDC, *hTOFQDCg, *hTOFQDCn;
+extern thread_local HIST1 *hEx;
+extern thread_local HIST1 *hExSmear;
+extern thread_local HISTMC *hExSys;
+extern thread_local std::vector<std::vector<HIST*> > hgrp;   /* one set per group */
+extern bool        uselut;
+extern std::string smearmode;
+extern std::string atom_name, saveFigPath;
+extern std::string targetname;               /* target of the run being analysed */
+
+void hsel(size_t g);
+std::vector<HIST*> hget();
+void hset(const std::vector<HIST*> &h);
+std::vector<HIST*> hclone();
+void hmerge(std::vector<HIST*> &h);
+void anaexport();
+
+/* The analysis */
+int  anainit(std::string hstFileName);
+int  anaexec(int event_size, const unsigned short *anabuff);
+int  anaend();
+void anakin(const GROUP &G, Double_t tdc, Double_t &tofr, Double_t &tof, Double_t &ex, Double_t &ex_err);
+void anacuts(const GROUP &G, Double_t tdc, Double_t qdc, Double_t qdct,
+             Double_t &qdctc, uint32_t &gbits, Bool_t &is_undefined_line, Bool_t &fNeutron, Bool_t &fGamma);
+int  anafill(Double_t tdc, Double_t qdc, Double_t qdct,
+             Double_t tofr, Double_t tof, Double_t ex, Double_t ex_err);
+const int fillblk = 1024;      /* events of a block of anafillblk */
+void anafillblk(int n, const Double_t *tdc, const Double_t *qdc, const Double_t *qdct,
+                const Double_t *tofr, const Double_t *tof, const Double_t *ex, const Double_t *ex_err);
+
+/* Function the event loops call for every event (anaexec, anabatch, psdscan, ...)
+   and once at the end of every chunk, for the ones buffering events */
+extern int  (*anafunc)(int, const unsigned short *);
+extern void (*anaflush)();
+
+#endif /* __ANALYSIS_H__ */
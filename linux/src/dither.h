@@ -0,0 +1,67 @@
+/*
+  Counter-based dithering of the ADC/TDC channels
+  Philox4x32-10 (Salmon et al., SC'11, "Parallel random numbers: as easy as
+  1, 2, 3"): 10 rounds of a bijection of a 128-bit counter keyed by 64 bits.
+  The dither of payload word ch of event i of a run is lane ch%4 of
+      philox( counter = { i, i>>32, ch/4, 0 }, key = run seed )
+  mapped to (-0.5, 0.5). It depends on (seed, i, ch) only, not on which
+  thread analyses the event or in which order.
+*/
+
+#ifndef __DITHER_H__
+#define __DITHER_H__
+
+#include <stdint.h>
+
+#define PHILOX_M0  0xD2511F53u
+#define PHILOX_M1  0xCD9E8D57u
+#define PHILOX_W0  0x9E3779B9u
+#define PHILOX_W1  0xBB67AE85u
+
+inline void philox4x32(const uint32_t ctr[4], uint64_t seed, uint32_t out[4]){
+  uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+  uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+  for (int r=0; r<10; r++) {
+    uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+    uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+    c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;  c1 = (uint32_t)p1;
+    c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;  c3 = (uint32_t)p0;
+    k0 += PHILOX_W0;  k1 += PHILOX_W1;
+  }
+  out[0] = c0;  out[1] = c1;  out[2] = c2;  out[3] = c3;
+}
+
+/* 32 random bits -> (-0.5, 0.5), exact in double */
+inline double dither_u2d(uint32_t u){ return (u + 0.5) * (1.0/4294967296.0) - 0.5; }
+
+/* Dithers of words 4*blk .. 4*blk+3 of n events ev[]: one Philox block
+   per event. The rounds run on all events side by side so the loop
+   vectorises (vpmuludq does the 32x32->64 products). */
+inline void dither_batch(uint64_t seed, int n, const long long *ev, uint32_t blk,
+                         double *d0, double *d1, double *d2, double *d3){
+  const int nlane = 64;
+  uint32_t c0[nlane], c1[nlane], c2[nlane], c3[nlane];
+  for (int i0=0; i0<n; i0+=nlane) {
+    int m = n - i0 < nlane ? n - i0 : nlane;
+    for (int j=0; j<nlane; j++) {
+      uint64_t e = j < m ? (uint64_t)ev[i0+j] : 0;
+      c0[j] = (uint32_t)e;  c1[j] = (uint32_t)(e >> 32);  c2[j] = blk;  c3[j] = 0;
+    }
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for (int r=0; r<10; r++) {
+      for (int j=0; j<nlane; j++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0[j];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2[j];
+        c0[j] = (uint32_t)(p1 >> 32) ^ c1[j] ^ k0;  c1[j] = (uint32_t)p1;
+        c2[j] = (uint32_t)(p0 >> 32) ^ c3[j] ^ k1;  c3[j] = (uint32_t)p0;
+      }
+      k0 += PHILOX_W0;  k1 += PHILOX_W1;
+    }
+    for (int j=0; j<m; j++) {
+      d0[i0+j] = dither_u2d(c0[j]);  d1[i0+j] = dither_u2d(c1[j]);
+      d2[i0+j] = dither_u2d(c2[j]);  d3[i0+j] = dither_u2d(c3[j]);
+    }
+  }
+}
+
+#endif /* __DITHER_H__ */
@@ -0,0 +1,515 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: event loops                //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* headers for DAQ System */
+#include "ngdrvcommon.h"
+#include "dither.h"
+#include "analysis.h"
+#include "profrun.h"
+#include "skim.h"
+#include "kinbatch.h"
+#include "evloop.h"
+
+using namespace std;
+
+thread_local unsigned short buff[NGDRV_MAXEVLEN];
+
+// simple counter (no percentage for a pipe or the simulated device)
+void progress(long long i, long long sumbyte, long long inputFileSize){
+  if(i%1000==0) {
+    if (inputFileSize > 0) printf("\r Event:%lld (%4.1f%%)", i, sumbyte*100.0/inputFileSize); 
+    else                   printf("\r Event:%lld", i);
+    fflush(stdout);
+  }
+}
+
+// Corrupt framing skipped by the event loops (framing.h): added to the
+// counts of the run, over all threads
+mutex framelock;
+
+void framecount(FRAME_STATS &fs, const FRAME_STATS &st){
+  if (!st.nresync) return;
+  lock_guard<mutex> g(framelock);
+  frameadd(fs, st);
+}
+
+void framereport(const FRAME_STATS &fs){
+  if (!fs.nresync) return;
+  printf("Corrupt framing: resynchronised at %llu places, %llu bytes (about %llu events) skipped\n",
+         fs.nresync, fs.nbyte, fs.nevent);
+}
+
+// Bytes of the input of readloop put back by a resynchronisation
+vector<unsigned char> rdback;
+size_t rdpos = 0;
+
+// read() of n bytes, over short reads (pipes) and with the bytes put back
+// first; fewer only at the end of the data
+size_t readn(EVSRC &src, void *buf, size_t n){
+  size_t got = 0;
+  if (rdpos < rdback.size()) {
+    got = std::min(n, rdback.size() - rdpos);
+    memcpy(buf, &rdback[rdpos], got);
+    rdpos += got;
+  }
+  while (got < n) {
+    ssize_t r = evread(src, (char *)buf + got, n - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    got += r;
+  }
+  return got;
+}
+
+// Event loop with read(): 2 syscalls per event (nbyte header + payload into buff)
+// (the event loops hand every event to anafunc, see above), from any event
+// source (evsource.h: a data file, a pipe or the simulated device). src is skip events
+// before event first of the run; at most count events are analysed (all if
+// count < 0). A corrupt event (framing.h) is resynchronised over the data
+// read ahead from it, what follows the resynchronisation point is put back.
+long long readloop(EVSRC &src, long long inputFileSize, long long first, long long count, long long skip,
+                   FRAME_STATS &fs){
+  int nword;
+  unsigned short nbyte;
+  long long i=0, sumbyte=0;
+  FRAME_STATS st = {};
+  vector<unsigned char> win;  // read ahead from a corrupt event
+  profbegin();
+  while(i != count){
+    if (readn(src, &nbyte, 2) < 2 || nbyte == NGDRV_EOF) break;
+    size_t n = framelen(nbyte) ? readn(src, buff, nbyte-2) : 0;
+    bool tail = framelen(nbyte) && n < (size_t)nbyte-2;  // truncated: buff keeps the head of the event before
+    if (!tail && (!framelen(nbyte) || buff[nbyte/2-2] != NGDRV_DELIM)) {
+      win.assign((unsigned char *)&nbyte, (unsigned char *)&nbyte + 2);
+      win.insert(win.end(), (unsigned char *)buff, (unsigned char *)buff + n);
+      const unsigned char *q;
+      bool last = false;
+      while (!(q = framesync(win.data(), win.data() + win.size(), last, &st))) {
+        size_t w = win.size();
+        win.resize(w + 65536);
+        win.resize(w + readn(src, &win[w], 65536));
+        last = win.size() < w + 65536;
+      }
+      sumbyte += q - win.data();
+      vector<unsigned char> rest(q, (const unsigned char *)win.data() + win.size());
+      rest.insert(rest.end(), rdback.begin() + rdpos, rdback.end());
+      rdback.swap(rest);
+      rdpos = 0;
+      continue;
+    }
+    sumbyte+=nbyte;
+    if (skip > 0) {
+      skip--;
+      if (tail) break;
+      continue;
+    }
+    nword=(nbyte-2)/2 - 1;  // unused now
+    evindex = first + i;
+    proflap(PROF_READ);
+    anafunc(nword, buff);
+    i++;
+    progress(i, sumbyte, inputFileSize);
+    if (tail) break;
+  }
+  framecount(fs, st);
+  if (anaflush) anaflush();
+  return i;
+}
+
+// ##### Follow mode (-f) #####
+// Analyse a data file while the DAQ is still writing it: complete events are
+// analysed as they are appended, a partial one at the end waits for its rest.
+// Appends are waited for with inotify (polling with a backoff up to 100 ms
+// where inotify is not available). A snapshot of the histograms is written
+// at most period seconds after the first event it does not contain yet, so
+// period bounds the latency. Stops at NGDRV_EOF or on SIGINT/SIGTERM.
+volatile sig_atomic_t followstop = 0;
+void followsig(int){ followstop = 1; }
+
+// Write the histograms as they are now to path: into path.tmp, renamed over
+// path, so a reader never sees a partly written file
+void snapshot(string path){
+  anaexport();
+  TDirectory *cwd = gDirectory;
+  string tmp = path + ".tmp";
+  TFile *f = new TFile(tmp.c_str(), "RECREATE");
+  if (!f->IsZombie()) {
+    for (HIST *h : hget()) if (h->th) f->WriteTObject(h->th);
+    f->Close();
+  }
+  delete f;
+  cwd->cd();
+  if (rename(tmp.c_str(), path.c_str()) != 0) cerr << "cannot write " << path << "\n";
+}
+
+long long followloop(int fd, string datFile, string hstFileName, double period, FRAME_STATS &fs){
+  vector<unsigned char> buf(1<<22);  // bytes read but not analysed yet
+  size_t len = 0;
+  long long i = 0;
+  int nsnap = 0;
+  bool eof = false;
+  double due = -1;                   // when the next snapshot is due (<0: nothing new)
+  double backoff = 0.001;            // polling interval without inotify [s]
+  FRAME_STATS st = {};
+  int ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ino != -1 && inotify_add_watch(ino, datFile.c_str(), IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+    close(ino);
+    ino = -1;
+  }
+  signal(SIGINT,  followsig);
+  signal(SIGTERM, followsig);
+  profbegin();
+  cout << "Following " << datFile << " (" << (ino != -1 ? "inotify" : "polling")
+       << "), snapshots to " << hstFileName << " every " << period << " s\n";
+
+  while (!eof && !followstop) {
+    ssize_t n;
+    bool got = false;
+    while (len < buf.size() && (n = read(fd, &buf[len], buf.size()-len)) > 0) {
+      len += n;
+      got = true;
+    }
+    size_t p = 0;
+    unsigned short nbyte;
+    while (len - p >= 2) {
+      // resynchronise over corrupt bytes, as far as they are written
+      const unsigned char *b = buf.data(), *q = framesync(b + p, b + len, len == buf.size(), &st);
+      if (!q) break;
+      p = q - b;
+      if (len - p < 2) break;
+      memcpy(&nbyte, &buf[p], 2);
+      if (nbyte == NGDRV_EOF) { eof = true; break; }
+      if (len - p < nbyte) break;  // rest of the event not written yet
+      memcpy(buff, &buf[p+2], nbyte-2);
+      evindex = i;
+      proflap(PROF_READ);
+      anafunc((nbyte-2)/2 - 1, buff);
+      i++;
+      p += nbyte;
+    }
+    memmove(&buf[0], &buf[p], len - p);
+    len -= p;
+    if (p > 0 && due < 0) due = nowsec() + period;
+
+    if (due >= 0 && nowsec() >= due && !eof) {
+      if (anaflush) anaflush();
+      proflap(PROF_READ);
+      snapshot(hstFileName);
+      proflap(PROF_WRITE);
+      due = -1;
+      printf("\r Event:%lld  snapshot %d", i, ++nsnap);
+      fflush(stdout);
+    }
+    if (eof || got) {
+      backoff = 0.001;
+      continue;
+    }
+
+    // nothing new: wait for an append, but not past the next snapshot
+    double wait = due >= 0 ? std::max(0.0, due - nowsec()) : 1.0;
+    if (ino != -1) {
+      struct pollfd pfd = { ino, POLLIN, 0 };
+      if (poll(&pfd, 1, (int)ceil(std::min(wait, 1.0)*1000)) > 0) {
+        char ev[4096];
+        while (read(ino, ev, sizeof(ev)) > 0) ;
+      }
+    } else {
+      usleep((useconds_t)(std::min(wait, backoff)*1e6));
+      backoff = std::min(backoff*2, 0.1);
+    }
+  }
+  if (ino != -1) close(ino);
+  signal(SIGINT,  SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  framecount(fs, st);
+  if (anaflush) anaflush();
+  return i;
+}
+
+// Event loop over [p, end) of a mapped file: anafunc() gets pointers straight
+// into the mapping, no copy and no syscall per event. first is the index in
+// the run of the event at p. The framing is checked against the whole data
+// [base, base+inputFileSize) (framing.h): runs of valid events of one length
+// at a time, corrupt bytes are skipped to the next valid event.
+// An event shorter than the words the groups use (or at an odd address) goes
+// through buff as read() puts it there: over the previous event, whose words
+// it keeps past its end. At the start of a chunk there is no previous event
+// and those words are 0.
+long long mapchunk(const unsigned char *p, const unsigned char *end,
+                   const unsigned char *base, long long inputFileSize, bool counter,
+                   long long first, FRAME_STATS &fs){
+  long long i=0;
+  const unsigned char *prev = NULL;  // payload of the previous event
+  long long prevlen = 0;
+  bool inbuff = false;               // buff holds the previous event already
+  const unsigned full = 2*(chmapw+1);  // nbyte of an event with every word of the groups
+  const unsigned char *lim = base + inputFileSize;
+  FRAME_STATS st = {};
+  int nword;
+  unsigned short nbyte;
+  // put the event at p into buff over the previous one, as read() does
+  auto tobuff = [&](size_t len){
+    if (!inbuff) {
+      if (prev) memcpy(buff, prev, prevlen);
+      else      memset(buff, 0, full);
+    }
+    memcpy(buff, p+2, len);
+    inbuff = true;
+  };
+  profbegin();
+  while(end - p >= 2){
+    p = framesync(p, lim, true, &st);
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF) break;
+    nword=(nbyte-2)/2 - 1;  // unused now
+    if (lim - p < nbyte) {
+      // truncated tail: read() would have overwritten the head of buff
+      // (still holding the previous event) with what is left, do the same
+      tobuff(std::min(lim-(p+2), (long)sizeof(buff)));
+      evindex = first + i;
+      proflap(PROF_READ);
+      anafunc(nword, buff);
+      i++;
+      break;
+    }
+    size_t n = framerun(p, end, nbyte, 4096);
+    if (n == 0) break;
+    bool aligned = ((uintptr_t)(p+2) & 1) == 0;  // not after resynchronising at an odd byte
+    bool direct  = aligned && nbyte >= full;
+    for (size_t k=0; k<n; k++) {
+      evindex = first + i;
+      if (direct) {
+        proflap(PROF_READ);
+        anafunc(nword, (const unsigned short *)(p+2));
+        inbuff = false;
+      } else {
+        tobuff(nbyte-2);
+        proflap(PROF_READ);
+        anafunc(nword, buff);
+      }
+      prev = p+2; prevlen = nbyte-2;
+      p += nbyte;
+      i++;
+      if (counter) progress(i, p - base, inputFileSize);
+    }
+  }
+  framecount(fs, st);
+  if (anaflush) anaflush();
+  return i;
+}
+
+// One line about the event index of a run: where it comes from and, when
+// it was just built, the run statistics of the walk
+void idxreport(const IDX &x, string path, int how){
+  const IDX_HEADER &h = x.h;
+  cout << "Event index: " << path << " (" << h.nevent << " events"
+       << (how == 0 ? ")\n" : how == 1 ? ", built)\n" : ", built, cannot be written)\n");
+  if (how == 0) return;
+  cout << "  nbyte " << h.lenmin << " - " << h.lenmax << ", " << h.evend << " bytes of events";
+  if (h.skipped.nresync)
+    cout << ", corrupt framing at " << h.skipped.nresync << " places (" << h.skipped.nbyte << " bytes)";
+  if (h.truncated) cout << ", last event truncated";
+  cout << (h.eof < 0 ? ", no NGDRV_EOF\n" : "\n");
+}
+
+// Event loop over events [first, last) of the column cache: no framing.
+// The standard analysis (anaexec, anabatch) runs block by block straight on
+// the columns: dithers, kinematics (formulas, lut or -k kernel), cuts and
+// fills each over the whole block, with the same values as event by event.
+// Others (-s, -x, and -d trandom3 with more than one group, whose draws go
+// event by event) get event records transposed from the columns.
+long long colchunk(const SOA_CACHE &c, long long first, long long last,
+                   long long inputFileSize, bool counter){
+  const int nblk = fillblk;
+  static thread_local unsigned short ev[nblk][SOA_NCOL+1];
+  static thread_local long long evi[nblk];
+  static thread_local double dith[8][nblk];
+  static thread_local double tdc[nblk], qdc[nblk], qdct[nblk], tofr[nblk], tof[nblk], ex[nblk], ex_err[nblk];
+  bool batch = anafunc == anabatch;
+  bool cols  = (anafunc == anaexec || batch) && !skimon && (dithphilox || batch || groups.size() == 1);
+  profbegin();
+  for (long long i0=first; i0<last; i0+=nblk) {
+    int n = std::min<long long>(nblk, last-i0);
+    if (!cols) {
+      for (int k=0; k<SOA_NCOL; k++) {
+        const unsigned short *col = c.col[k] + i0;
+        for (int j=0; j<n; j++) ev[j][k] = col[j];
+      }
+      for (int j=0; j<n; j++) {
+        ev[j][SOA_NCOL] = NGDRV_DELIM;
+        evindex = i0+j;
+        proflap(PROF_READ);
+        anafunc(SOA_NCOL, ev[j]);
+      }
+    } else {
+      for (int j=0; j<n; j++) evi[j] = i0+j;
+      proflap(PROF_READ);
+      if (dithphilox) {
+        for (int k=0; k<chmapw; k+=4)
+          dither_batch(runseed, n, evi, k/4, dith[k], dith[k+1], dith[k+2], dith[k+3]);
+      }
+      for (size_t g=0; g<groups.size(); g++) {
+        const GROUP &G = groups[g];
+        hsel(g);
+        const unsigned short *ct = c.col[G.tdc] + i0, *cq = c.col[G.qdc] + i0, *cqt = c.col[G.qdct] + i0;
+        if (dithphilox) {
+          for (int j=0; j<n; j++) {
+            tdc[j] = ct[j] + dith[G.tdc][j];  qdc[j] = cq[j] + dith[G.qdc][j];  qdct[j] = cqt[j] + dith[G.qdct][j];
+          }
+        } else {
+          // -d trandom3: the draws of anaexec (one group) or anabatchflush
+          for (int j=0; j<n; j++) {
+            tdc[j] = ct[j] + rnd.Rndm()-0.5;  qdc[j] = cq[j] + rnd.Rndm()-0.5;  qdct[j] = cqt[j] + rnd.Rndm()-0.5;
+          }
+        }
+        proflap(PROF_DECODE);
+        if (uselut)     kin_lut(*G.lut, G.kconst, n, tdc, tofr, tof, ex, ex_err);
+        else if (batch) kinfunc(G.kconst, n, tdc, tofr, tof, ex, ex_err);
+        else for (int j=0; j<n; j++) anakin(G, tdc[j], tofr[j], tof[j], ex[j], ex_err[j]);
+        proflap(PROF_KIN);
+        anafillblk(n, tdc, qdc, qdct, tofr, tof, ex, ex_err);
+      }
+    }
+    long long i = (i0+n)/1000*1000;  // progress() prints every 1000 events
+    if (counter && i > i0) progress(i, c.off[(i-1)/c.stride], inputFileSize);
+  }
+  if (anaflush) anaflush();
+  return last - first;
+}
+
+// Event loop over events [first, last) of a skim (skimfile.h): event records
+// from its columns with the index of the event in the run, and with its
+// kinematics (skimkin) where they hold for this pass.
+long long skimchunk(const SKM_FILE &s, long long first, long long last, bool counter){
+  static thread_local unsigned short ev[SKM_NWORD+1];
+  const size_t ng = s.h.ngroup;
+  vector<double> kin(ng*SKM_NKIN);
+  bool reuse = skimmatch(s);
+  profbegin();
+  for (long long i=first; i<last; i++) {
+    for (int k=0; k<SKM_NWORD; k++) ev[k] = s.col[k][i];
+    ev[SKM_NWORD] = NGDRV_DELIM;
+    if (reuse) {
+      for (size_t g=0; g<ng; g++)
+        for (int j=0; j<SKM_NKIN; j++) kin[g*SKM_NKIN + j] = s.kin[g][j][i];
+      skimkin = kin.data();
+    }
+    evindex = s.ev[i];
+    proflap(PROF_READ);
+    anafunc(SKM_NWORD, ev);
+    if (counter) progress(i+1, i+1, s.h.nevent);
+  }
+  skimkin = 0;
+  if (anaflush) anaflush();
+  return last - first;
+}
+
+// Events [lo, hi) of a decompressed block whose first event is first
+long long ngzrange(const vector<unsigned char> &raw, long long first, long long lo, long long hi,
+                   FRAME_STATS &fs){
+  const unsigned char *p = raw.data(), *end = p + raw.size();
+  if (lo > first) p = idxwalk(p, end, lo - first);
+  else lo = first;
+  end = idxwalk(p, end, hi - lo);
+  return mapchunk(p, end, raw.data(), raw.size(), false, lo, fs);
+}
+
+// Block b of a compressed run, events [lo, hi) of it: decompressed into a
+// buffer of the thread, then analysed as the same events of the data file
+// would be.
+long long ngzchunk(const NGZ_FILE &z, size_t b, long long lo, long long hi, FRAME_STATS &fs){
+  static thread_local vector<unsigned char> raw;
+  const NGZ_BLOCK &k = z.blk[b];
+  if ((long long)(k.first + k.nevent) <= lo || k.first >= hi) return 0;
+  {
+    PROF_SCOPE t(profon ? profget() : NULL, PROF_READ);
+    if (!ngzunpack(z, b, raw)) {
+      cerr << "\ncorrupt block " << b << " (events " << z.blk[b].first << " - "
+           << z.blk[b].first + z.blk[b].nevent << "), skipped\n";
+      return 0;
+    }
+  }
+  return ngzrange(raw, k.first, lo, hi, fs);
+}
+
+// Serial event loop over events [lo, hi) of a compressed run: ndec threads
+// decompress the blocks ahead of the analysis (at most nslot of them) into
+// a ring of buffers, the calling thread analyses them in order.
+long long ngzloop(const NGZ_FILE &z, int ndec, long long lo, long long hi, FRAME_STATS &fs){
+  size_t b0 = 0, nb = z.h.nblock;
+  while (b0 < nb && (long long)(z.blk[b0].first + z.blk[b0].nevent) <= lo) b0++;
+  while (nb > b0 && z.blk[nb-1].first >= hi) nb--;
+  const size_t nslot = 2*ndec + 2;
+  vector<vector<unsigned char> > slot(nslot);
+  vector<long long> ready(nslot, -1);  // block held by a slot
+  vector<char> ok(nslot);
+  size_t next = b0, done = b0;         // next block to decompress, blocks analysed
+  mutex m;
+  condition_variable cv;
+
+  vector<thread> dec;
+  for (int d=0; d<ndec; d++) {
+    dec.emplace_back([&]{
+      unique_lock<mutex> g(m);
+      while (true) {
+        cv.wait(g, [&]{ return next >= nb || next < done + nslot; });
+        if (next >= nb) return;
+        size_t b = next++, s = b % nslot;  // the slot of block b - nslot, analysed
+        g.unlock();
+        bool good;
+        {
+          PROF_SCOPE t(profon ? profget() : NULL, PROF_READ);
+          good = ngzunpack(z, b, slot[s]);
+        }
+        g.lock();
+        ok[s] = good;
+        ready[s] = b;
+        cv.notify_all();
+      }
+    });
+  }
+
+  long long i = 0;
+  for (size_t b=b0; b<nb; b++) {
+    size_t s = b % nslot;
+    {
+      unique_lock<mutex> g(m);
+      cv.wait(g, [&]{ return ready[s] == (long long)b; });
+    }
+    if (ok[s]) {
+      i += ngzrange(slot[s], z.blk[b].first, lo, hi, fs);
+    } else {
+      cerr << "\ncorrupt block " << b << " (events " << z.blk[b].first << " - "
+           << z.blk[b].first + z.blk[b].nevent << "), skipped\n";
+    }
+    printf("\r Event:%lld (%4.1f%%)", i, (b+1-b0)*100.0/(nb-b0));
+    fflush(stdout);
+    lock_guard<mutex> g(m);
+    done = b+1;
+    cv.notify_all();
+  }
+  for (auto &t : dec) t.join();
+  return i;
+}
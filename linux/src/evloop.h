@@ -0,0 +1,37 @@
+/*
+  Event loops of offline
+  Every loop hands the events of its source to anafunc (analysis.h): a
+  stream with read() (readloop), a growing data file (followloop, -f), a
+  range of a mapped data file (mapchunk), of its column cache (colchunk),
+  of a skim (skimchunk) or a block of a compressed run (ngzchunk, ngzloop).
+  Corrupt framing they skip is added to fs, the counts of the run.
+*/
+
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <string>
+
+#include "framing.h"
+#include "evsource.h"
+#include "idxfile.h"
+#include "soacache.h"
+#include "ngzfile.h"
+#include "skimfile.h"
+
+void framereport(const FRAME_STATS &fs);
+void idxreport(const IDX &x, std::string path, int how);
+
+long long readloop(EVSRC &src, long long inputFileSize, long long first, long long count, long long skip,
+                   FRAME_STATS &fs);
+long long followloop(int fd, std::string datFile, std::string hstFileName, double period, FRAME_STATS &fs);
+long long mapchunk(const unsigned char *p, const unsigned char *end,
+                   const unsigned char *base, long long inputFileSize, bool counter,
+                   long long first, FRAME_STATS &fs);
+long long colchunk(const SOA_CACHE &c, long long first, long long last,
+                   long long inputFileSize, bool counter);
+long long skimchunk(const SKM_FILE &s, long long first, long long last, bool counter);
+long long ngzchunk(const NGZ_FILE &z, size_t b, long long lo, long long hi, FRAME_STATS &fs);
+long long ngzloop(const NGZ_FILE &z, int ndec, long long lo, long long hi, FRAME_STATS &fs);
+
+#endif /* __EVLOOP_H__ */
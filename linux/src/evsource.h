@@ -0,0 +1,366 @@
+/*
+  Event sources of offline
+  A source hands out the NGDRV byte stream (2-byte nbyte header, payload
+  words, NGDRV_DELIM, NGDRV_EOF at the end) with evread(), like read() on
+  the device, and answers the counting ioctls of the driver (ngdrvcommon.h)
+  with evioctl():
+    file  a data file (mapped by offline, see maprun)       [path]
+    pipe  a pipe, FIFO or character device, "-" for stdin   [path]
+          (ioctls go to the device, so the ngdrv driver itself is one)
+    sim   a simulated ngdrv device                          sim:key=value,...
+  The simulated device runs in a thread of its own. Triggers come at
+    rate   mean rate during the spill [Hz] (Poisson; k, M suffixes)
+    spill  on/off [ms]: triggers only in the first on ms of every on+off
+           (default: no spill structure)
+    burst  k events per trigger, back to back (default 1)
+  and every event goes into a buffer of
+    buf    bytes (k, M suffixes; default 256k)
+  as the driver puts a CC7700 readout into its buffer at the interrupt.
+  An event that does not fit, because the analysis has not read the buffer
+  empty enough, is lost and counted (NGDRV_IOC_INTLOS), as every event is
+  (NGDRV_IOC_INTCNT). Triggering starts at the first evread(). The events are
+    src    a data file, whose events are replayed in order and over again
+           (default: payload words of random 12-bit channels)
+  and the run ends with NGDRV_EOF (NGDRV_IOC_PUTEOF) after
+    n      events triggered (default 1M), or
+    t      seconds (if given)
+  seed (default 4357) fixes the trigger times and the random words, so two
+  runs see the same triggers; which of them are lost depends on the speed
+  of the analysis. evsimreport() prints the counts, the buffer high water
+  and the event rate the analysis keeps up with: events read over the time
+  it was not waiting for the buffer, the trigger rate above which events
+  are lost in a long enough run.
+*/
+
+#ifndef __EVSOURCE_H__
+#define __EVSOURCE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include "ngdrvcommon.h"
+#include "dither.h"
+#include "framing.h"
+
+#define EVSRC_FILE  0
+#define EVSRC_PIPE  1
+#define EVSRC_SIM   2
+
+#define EVSIM_TAG   0x6e677364u   /* counter word 3 of the draws of the device */
+
+inline double evnow(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+typedef struct EVSIM {
+  /* parameters */
+  double rate;
+  double spon, spoff;                /* spill [s], spoff = 0: continuous */
+  int    burst;
+  size_t cap;                        /* buffer [bytes] */
+  long long ntrig;                   /* events to trigger (if t = 0) */
+  double tmax;                       /* [s] */
+  unsigned long long seed;
+  std::string src;
+
+  /* events to replay: [off[k], off[k+1]) of ev */
+  std::vector<unsigned char> ev;
+  std::vector<size_t> off;
+
+  /* buffer: bytes [tail, head) of the stream, at ring[pos % cap] */
+  std::vector<unsigned char> ring;
+  std::atomic<unsigned long long> head, tail;
+  std::atomic<unsigned long long> intcnt, intlos, naccept;
+  std::atomic<bool> done, stop;
+  unsigned long long hiwater;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::thread dev;
+
+  /* consumer side */
+  double t0, t1;                     /* first trigger, NGDRV_EOF read */
+  double idle;                       /* [s] waiting for the buffer */
+} EVSIM;
+
+typedef struct EVSRC {
+  int type;
+  int fd;                            /* file, pipe */
+  long long nread;                   /* bytes handed out */
+  EVSIM *sim;
+} EVSRC;
+
+/* "250k" -> 250000 (k, M: powers of 1000, with b = true of 1024) */
+inline bool evnum(const char *s, double *v, bool b){
+  char *e;
+  *v = strtod(s, &e);
+  if (e == s) return false;
+  if (*e == 'k') { *v *= b ? 1024 : 1e3; e++; }
+  else if (*e == 'M') { *v *= b ? 1048576 : 1e6; e++; }
+  return !*e && *v >= 0;
+}
+
+/* Parameters of "sim:key=value,..." */
+inline bool evsimparse(EVSIM &s, const char *spec, std::string &err){
+  s.rate = 1e5;  s.spon = s.spoff = 0;  s.burst = 1;  s.cap = 256*1024;
+  s.ntrig = 1000000;  s.tmax = 0;  s.seed = 4357;
+  std::string a(spec);
+  size_t p = 0;
+  while (p < a.size()) {
+    size_t q = a.find(',', p);
+    if (q == std::string::npos) q = a.size();
+    std::string kv = a.substr(p, q - p), k = kv.substr(0, kv.find('='));
+    const char *v = kv.find('=') == std::string::npos ? "" : kv.c_str() + k.size() + 1;
+    double x = 0, y = 0;
+    bool ok = true;
+    if      (k == "rate")  ok = evnum(v, &s.rate, false) && s.rate > 0;
+    else if (k == "n")     { ok = evnum(v, &x, false) && x >= 1;  s.ntrig = (long long)x; }
+    else if (k == "t")     ok = evnum(v, &s.tmax, false) && s.tmax > 0;
+    else if (k == "burst") { ok = evnum(v, &x, false) && x >= 1;  s.burst = (int)x; }
+    else if (k == "buf")   { ok = evnum(v, &x, true) && x >= NGDRV_MAXEVLEN;  s.cap = (size_t)x; }
+    else if (k == "seed")  s.seed = strtoull(v, 0, 0);
+    else if (k == "src")   ok = *(s.src = v).c_str() != 0;
+    else if (k == "spill") {
+      ok = sscanf(v, "%lf/%lf", &x, &y) == 2 && x > 0 && y >= 0;
+      s.spon = x*1e-3;  s.spoff = y*1e-3;
+    }
+    else ok = false;
+    if (!ok) {
+      err = "bad " + kv + " (keys rate, n, t, spill, burst, buf, src, seed)";
+      return false;
+    }
+    p = q + 1;
+  }
+  return true;
+}
+
+/* The events of s.src, or 4096 random ones (6 words of 12 bits) */
+inline bool evsimevents(EVSIM &s, std::string &err){
+  s.ev.clear();
+  s.off.assign(1, 0);
+  if (s.src.empty()) {
+    for (uint32_t k=0; k<4096; k++) {
+      uint32_t ctr[4] = { k, 0, 0, EVSIM_TAG }, u[4];
+      philox4x32(ctr, s.seed, u);
+      unsigned short w[8] = { 16,
+        (unsigned short)(u[0] & 0xfff), (unsigned short)(u[0] >> 20), (unsigned short)(u[1] & 0xfff),
+        (unsigned short)(u[1] >> 20),   (unsigned short)(u[2] & 0xfff), (unsigned short)(u[2] >> 20),
+        NGDRV_DELIM };
+      s.ev.insert(s.ev.end(), (unsigned char *)w, (unsigned char *)w + 16);
+      s.off.push_back(s.ev.size());
+    }
+    return true;
+  }
+  FILE *fp = fopen(s.src.c_str(), "rb");
+  if (!fp) {
+    err = "cannot open " + s.src;
+    return false;
+  }
+  std::vector<unsigned char> raw;
+  unsigned char tmp[1<<16];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0 && raw.size() < (64u<<20)) raw.insert(raw.end(), tmp, tmp + n);
+  fclose(fp);
+  /* whole valid events only (framing.h), up to NGDRV_EOF */
+  const unsigned char *p = raw.data(), *end = p + raw.size();
+  unsigned short nbyte;
+  while (end - p >= 2) {
+    p = framesync(p, end, true, NULL);
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF || end - p < nbyte) break;
+    s.ev.insert(s.ev.end(), p, p + nbyte);
+    s.off.push_back(s.ev.size());
+    p += nbyte;
+  }
+  if (s.off.size() < 2) {
+    err = "no events in " + s.src;
+    return false;
+  }
+  return true;
+}
+
+/* Wall time [s from start] of beam-on time tau */
+inline double evsimwall(const EVSIM &s, double tau){
+  if (s.spoff <= 0) return tau;
+  double k = floor(tau / s.spon);
+  return k*(s.spon + s.spoff) + (tau - k*s.spon);
+}
+
+/* The device: triggers as they fall due, events into the buffer or lost */
+inline void evsimrun(EVSIM *s){
+  double t0 = evnow(), tau = 0;
+  const size_t nev = s->off.size() - 1;
+  long long k = 0;
+  size_t e = 0;
+  unsigned long long h = s->head;
+  while (!s->stop) {
+    double now = evnow() - t0, due;
+    if (s->tmax > 0 ? now >= s->tmax : k >= s->ntrig) break;
+    while ((due = evsimwall(*s, tau)) <= now && (s->tmax > 0 || k < s->ntrig)) {
+      for (int b=0; b<s->burst; b++) {
+        size_t len = s->off[e+1] - s->off[e];
+        unsigned long long used = h - s->tail.load(std::memory_order_acquire);
+        if (s->cap - used >= len) {
+          const unsigned char *src = &s->ev[s->off[e]];
+          size_t at = h % s->cap, n1 = std::min(len, s->cap - at);
+          memcpy(&s->ring[at], src, n1);
+          memcpy(&s->ring[0], src + n1, len - n1);
+          h += len;
+          s->hiwater = std::max(s->hiwater, used + len);
+          s->naccept++;
+        } else {
+          s->intlos++;
+        }
+        s->intcnt++;
+        e = e + 1 < nev ? e + 1 : 0;
+      }
+      k++;
+      uint32_t ctr[4] = { (uint32_t)k, (uint32_t)(k >> 32), 1, EVSIM_TAG }, u[4];
+      philox4x32(ctr, s->seed, u);
+      tau += -log((u[0] + 0.5) * (1.0/4294967296.0)) / s->rate;
+    }
+    s->head.store(h, std::memory_order_release);
+    s->cv.notify_one();
+    /* sleep to the next trigger, at most 1 ms */
+    double dt = std::min(due - (evnow() - t0), 1e-3);
+    if (dt > 20e-6) {
+      struct timespec ts = { 0, (long)(dt*1e9) };
+      nanosleep(&ts, NULL);
+    }
+  }
+  /* NGDRV_EOF, once there is room for it */
+  unsigned short eof = NGDRV_EOF;
+  while (s->cap - (h - s->tail.load(std::memory_order_acquire)) < 2) usleep(100);
+  s->ring[h % s->cap] = eof & 0xff;
+  s->ring[(h + 1) % s->cap] = eof >> 8;
+  s->head.store(h + 2, std::memory_order_release);
+  s->done = true;
+  s->cv.notify_one();
+}
+
+/* spec: "sim:..." (simulated device), "-" (stdin) or a path */
+inline bool evopen(EVSRC &s, const char *spec, std::string &err){
+  s.fd = -1;
+  s.nread = 0;
+  s.sim = NULL;
+  if (!strncmp(spec, "sim:", 4) || !strcmp(spec, "sim")) {
+    EVSIM *m = new EVSIM();
+    if (!evsimparse(*m, spec[3] ? spec + 4 : "", err) || !evsimevents(*m, err)) {
+      delete m;
+      return false;
+    }
+    m->ring.assign(m->cap, 0);
+    m->head = m->tail = 0;
+    m->intcnt = m->intlos = m->naccept = 0;
+    m->done = m->stop = false;
+    m->hiwater = 0;
+    m->idle = 0;
+    m->t0 = m->t1 = 0;
+    s.type = EVSRC_SIM;
+    s.sim = m;
+    return true;
+  }
+  s.fd = strcmp(spec, "-") ? open(spec, O_RDONLY) : dup(0);
+  if (s.fd == -1) {
+    err = std::string("cannot open ") + spec + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  fstat(s.fd, &st);
+  s.type = S_ISREG(st.st_mode) ? EVSRC_FILE : EVSRC_PIPE;
+  return true;
+}
+
+/* read() of at most n bytes; 0 at the end of the stream */
+inline ssize_t evread(EVSRC &s, void *buf, size_t n){
+  if (s.type != EVSRC_SIM) {
+    ssize_t r = read(s.fd, buf, n);
+    if (r > 0) s.nread += r;
+    return r;
+  }
+  EVSIM *m = s.sim;
+  if (!m->dev.joinable()) {
+    /* the first trigger comes when the analysis is ready to read */
+    m->t0 = evnow();
+    m->dev = std::thread(evsimrun, m);
+  }
+  unsigned long long t = m->tail.load(std::memory_order_relaxed), h;
+  while ((h = m->head.load(std::memory_order_acquire)) == t) {
+    if (m->done) return 0;
+    double w = evnow();
+    std::unique_lock<std::mutex> g(m->lock);
+    m->cv.wait_for(g, std::chrono::microseconds(200));
+    m->idle += evnow() - w;
+  }
+  size_t len = std::min<unsigned long long>(n, h - t), at = t % m->cap, n1 = std::min(len, m->cap - at);
+  memcpy(buf, &m->ring[at], n1);
+  memcpy((char *)buf + n1, &m->ring[0], len - n1);
+  m->tail.store(t + len, std::memory_order_release);
+  if (m->done && t + len == m->head) m->t1 = evnow();
+  s.nread += len;
+  return len;
+}
+
+/* The counting ioctls of the driver (to the device itself for a file or
+   pipe); -1 with errno ENOTTY for the others */
+inline int evioctl(EVSRC &s, unsigned long req, unsigned long *arg){
+  if (s.type != EVSRC_SIM) return ioctl(s.fd, req, arg);
+  EVSIM *m = s.sim;
+  switch (req) {
+  case NGDRV_IOC_INTCNT: *arg = m->intcnt; return 0;
+  case NGDRV_IOC_INTLOS: *arg = m->intlos; return 0;
+  case NGDRV_IOC_CLRCNT: m->intcnt = 0;  m->intlos = 0; return 0;
+  case NGDRV_IOC_PUTEOF: m->stop = true; return 0;
+  }
+  errno = ENOTTY;
+  return -1;
+}
+
+/* Triggers, losses and the event rate the analysis keeps up with */
+inline void evsimreport(EVSRC &s){
+  EVSIM *m = s.sim;
+  unsigned long cnt = 0, los = 0;
+  evioctl(s, NGDRV_IOC_INTCNT, &cnt);
+  evioctl(s, NGDRV_IOC_INTLOS, &los);
+  double run = (m->t1 > 0 ? m->t1 : evnow()) - m->t0, busy = run - m->idle;
+  printf("Simulated device: %lu events triggered in %.3f s (%.0f Hz), %lu lost (%.3f%%), buffer high water %llu of %zu bytes\n",
+         cnt, run, run > 0 ? cnt/run : 0.0, los, cnt ? 100.0*los/cnt : 0.0, m->hiwater, m->cap);
+  printf("  analysis busy %.3f s of it: keeps up with %.0f events/s\n",
+         busy, busy > 0 ? m->naccept/busy : 0.0);
+}
+
+inline void evclose(EVSRC &s){
+  if (s.sim && s.sim->dev.joinable()) {
+    s.sim->stop = true;
+    /* read the buffer empty, so the device can put NGDRV_EOF */
+    char tmp[4096];
+    while (evread(s, tmp, sizeof(tmp)) > 0) ;
+    s.sim->dev.join();
+  }
+  if (s.sim) {
+    delete s.sim;
+    s.sim = NULL;
+  }
+  if (s.fd != -1) close(s.fd);
+  s.fd = -1;
+}
+
+#endif /* __EVSOURCE_H__ */
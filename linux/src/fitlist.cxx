@@ -0,0 +1,238 @@
+////////////////////////////////////////////////////////
+// Offline Analyzer: peak fits of the Ex spectra (-e) //
+////////////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "analysis.h"
+#include "profrun.h"
+#include "fitlist.h"
+
+using namespace std;
+
+// ##### Peak fits of the Ex spectra (-e) #####
+// Fit list: one fit per line,
+//   target A Z hist lo hi [key=value ...]
+// hist (hEx or hExSmear), summed over the runs of target, is fitted over [lo, hi] MeV
+// with npeak Gaussians (default 1) on a polynomial background of bkg terms
+// (default 2, a straight line; 0 none), from every start of peakfit.h
+// (peak=x adds a start position). use is the peak, counted by mean from 1,
+// whose mean and error go into the table; group the detector group (default
+// the first). Ed, dRp and dRm fill the last three columns; without them the
+// values already in the table are kept. "csv path" sets the table, by
+// default the one main.py reads.
+// anaend adds the spectra of every run to those of its target; fitall fits
+// all of them from all their starts in parallel and replaces the rows of
+// their targets.
+struct FITJOB {
+  const FITLINE *line;
+  FIT_DATA  data;
+  int       nrun;             // runs summed into data
+  vector<vector<double> > start;
+  vector<FIT_RESULT> res;     // one per start
+};
+vector<FITLINE> fitlines;
+vector<FITJOB>  fitjobs;
+string fitcsv  = "../python_analysis/gaussian_fitting_auto.csv";
+string fitbase = "../python_analysis/gaussian_fitting.csv";   // hand-kept table, only read
+
+bool readfitlist(string file){
+  ifstream fin(file.c_str());
+  if (!fin) {
+    cerr << "cannot open fit list " << file << "\n";
+    return false;
+  }
+  string line;
+  for (int n=1; getline(fin, line); n++) {
+    line = line.substr(0, line.find('#'));
+    istringstream ss(line);
+    FITLINE L;
+    string kv;
+    if (!(ss >> L.target)) continue;
+    if (L.target == "csv") {
+      if (!(ss >> fitcsv)) {
+        cerr << file << ":" << n << ": csv needs a path\n";
+        return false;
+      }
+      continue;
+    }
+    L.model.npeak = 1;  L.model.nbkg = 2;  L.use = 1;
+    L.Ed = L.dRp = L.dRm = NAN;
+    if (!(ss >> L.A >> L.Z >> L.hist >> L.model.lo >> L.model.hi) ||
+        (L.hist != "hEx" && L.hist != "hExSmear") || !(L.model.lo < L.model.hi)) {
+      cerr << file << ":" << n << ": expected target A Z hEx|hExSmear lo hi\n";
+      return false;
+    }
+    while (ss >> kv) {
+      size_t eq = kv.find('=');
+      string key = kv.substr(0, eq), val = eq == string::npos ? "" : kv.substr(eq+1);
+      double v;
+      bool num = sscanf(val.c_str(), "%lf", &v) == 1;
+      if      (key == "npeak" && num && v >= 1 && v <= FIT_MAXPEAK) L.model.npeak = v;
+      else if (key == "bkg"   && num && v >= 0 && v <= FIT_MAXBKG)  L.model.nbkg  = v;
+      else if (key == "peak"  && num) L.model.seeds.push_back(v);
+      else if (key == "use"   && num && v >= 1) L.use = v;
+      else if (key == "group" && !val.empty()) L.group = val;
+      else if (key == "Ed"    && num) L.Ed  = v;
+      else if (key == "dRp"   && num) L.dRp = v;
+      else if (key == "dRm"   && num) L.dRm = v;
+      else {
+        cerr << file << ":" << n << ": bad setting " << kv << "\n";
+        return false;
+      }
+    }
+    if (L.use > L.model.npeak) {
+      cerr << file << ":" << n << ": use=" << L.use << " but npeak=" << L.model.npeak << "\n";
+      return false;
+    }
+    fitlines.push_back(L);
+  }
+  return true;
+}
+
+// Add the spectra the fit list has for the current target to those of the
+// runs of the target before (from anaend)
+void fitcollect(){
+  for (const FITLINE &L : fitlines) {
+    if (L.target != targetname) continue;
+    size_t g = 0;
+    while (!L.group.empty() && g < groups.size() && groups[g].name != L.group) g++;
+    if (g == groups.size()) {
+      cerr << "fit of " << L.target << ": no group " << L.group << "\n";
+      continue;
+    }
+    hsel(g);
+    HIST1 *h = L.hist == "hEx" ? hEx : hExSmear;
+    vector<double> cont(h->cnt.begin(), h->cnt.end());
+    FIT_DATA d = h->w.empty() ? fitdata(h->nb, h->xmin, h->xmax, cont.data(), 0, L.model.lo, L.model.hi)
+                              : fitdata(h->nb, h->xmin, h->xmax, h->GetArray(), h->GetSumw2Array(), L.model.lo, L.model.hi);
+    size_t j = 0;
+    while (j < fitjobs.size() && fitjobs[j].line != &L) j++;
+    if (j < fitjobs.size()) {
+      // the same histogram of another run: same bins
+      FITJOB &J = fitjobs[j];
+      for (size_t i=0; i<d.y.size(); i++) {
+        J.data.y[i]  += d.y[i];
+        J.data.e2[i] += d.e2[i];
+      }
+      J.nrun++;
+      continue;
+    }
+    FITJOB J;
+    J.line = &L;
+    J.data = d;
+    J.nrun = 1;
+    fitjobs.push_back(J);
+  }
+  if (!hgrp.empty()) hsel(0);
+}
+
+// Replace the rows of the fitted targets in the table (written through a
+// temporary file, renamed); rows of other targets stay as they are. A new
+// table starts as a copy of the hand-kept one, which is never written
+bool fitwrite(const vector<FIT_RESULT> &best){
+  vector<string> rows;
+  string line;
+  for (const string &f : {fitcsv, fitbase}) {
+    ifstream fin(f.c_str());
+    while (getline(fin, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (!line.empty()) rows.push_back(line);
+    }
+    if (!rows.empty()) break;
+  }
+  if (rows.empty()) rows.push_back("\xef\xbb\xbf,A,Z,mean,error,Ed,dR,dR");  // header as main.py skips it
+  for (size_t j=0; j<fitjobs.size(); j++) {
+    if (!best[j].ok) continue;
+    const FITLINE &L = *fitjobs[j].line;
+    size_t r = 1;
+    while (r < rows.size() && rows[r].substr(0, rows[r].find(',')) != L.target) r++;
+    // Ed, dR, dR: given, else kept from the table, else 0
+    vector<string> old;
+    if (r < rows.size()) {
+      istringstream ss(rows[r]);
+      string f;
+      while (getline(ss, f, ',')) old.push_back(f);
+    }
+    auto col = [&](double v, size_t k){
+      char b[32];
+      if (!std::isnan(v)) { snprintf(b, sizeof(b), "%g", v);  return string(b); }
+      return k < old.size() ? old[k] : string("0");
+    };
+    int k = L.use - 1;
+    char b[256];
+    snprintf(b, sizeof(b), "%s,%.10g,%d,%.6g,%.6g,", L.target.c_str(), L.A, L.Z, best[j].p[3*k+1], best[j].err[3*k+1]);
+    string row = b + col(L.Ed, 5) + "," + col(L.dRp, 6) + "," + col(L.dRm, 7);
+    if (r < rows.size()) rows[r] = row;
+    else                 rows.push_back(row);
+  }
+  string tmp = fitcsv + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "w");
+  if (!fp) return false;
+  for (const string &r : rows) fprintf(fp, "%s\n", r.c_str());
+  bool ok = fclose(fp) == 0 && rename(tmp.c_str(), fitcsv.c_str()) == 0;
+  if (!ok) remove(tmp.c_str());
+  return ok;
+}
+
+// Fit all collected spectra from all their starts with nthread threads,
+// print the best fits and write the table
+void fitall(int nthread){
+  if (fitjobs.empty()) {
+    cout << "Fits: no spectra of the targets in the fit list\n";
+    return;
+  }
+  vector<pair<size_t,size_t> > task;   // (job, start)
+  for (size_t j=0; j<fitjobs.size(); j++) {
+    FITJOB &J = fitjobs[j];
+    J.start = fitseeds(J.data, J.line->model);
+    J.res.resize(J.start.size());
+    for (size_t k=0; k<J.start.size(); k++) task.push_back(make_pair(j, k));
+  }
+  double t0 = nowsec();
+  atomic<size_t> next(0);
+  vector<thread> workers;
+  for (int w=0; w<nthread; w++) {
+    workers.emplace_back([&]{
+      PROF_SCOPE ps(profon ? profget() : 0, PROF_FIT);
+      size_t t;
+      while ((t = next++) < task.size()) {
+        FITJOB &J = fitjobs[task[t].first];
+        J.res[task[t].second] = fitlm(J.data, J.line->model, J.start[task[t].second].data());
+      }
+    });
+  }
+  for (auto &t : workers) t.join();
+
+  vector<FIT_RESULT> best;
+  for (const FITJOB &J : fitjobs) {
+    const FITLINE &L = *J.line;
+    const FIT_MODEL &m = L.model;
+    FIT_RESULT b = fitbest(J.res, m);
+    int nok = 0;
+    for (const FIT_RESULT &r : J.res) nok += r.ok;
+    best.push_back(b);
+    printf("Fit %s %s%s%s", L.target.c_str(), L.hist.c_str(), L.group.empty() ? "" : " of group ", L.group.c_str());
+    if (J.nrun > 1) printf(" (sum of %d runs)", J.nrun);
+    printf(" [%g, %g] MeV, %d peak(s) + %d bkg terms: ", m.lo, m.hi, m.npeak, m.nbkg);
+    if (!b.ok) {
+      printf("no valid fit from %zu starts\n", J.res.size());
+      continue;
+    }
+    printf("chi2/ndf = %.1f/%d, %d of %zu starts valid\n", b.chi2, b.ndf, nok, J.res.size());
+    for (int k=0; k<m.npeak; k++)
+      printf("  %c peak %d: mean = %.5f +- %.5f MeV, sigma = %.4f +- %.4f MeV, events = %.0f +- %.0f\n",
+             k == L.use-1 ? '*' : ' ', k+1, b.p[3*k+1], b.err[3*k+1], b.p[3*k+2], b.err[3*k+2], b.p[3*k], b.err[3*k]);
+  }
+  printf("Fits: %zu spectra, %zu starts in %.3f s, %d threads\n", fitjobs.size(), task.size(), nowsec() - t0, nthread);
+  if (fitwrite(best)) cout << "Fit table : " << fitcsv << "\n";
+  else                cerr << "cannot write " << fitcsv << "\n";
+}
@@ -0,0 +1,28 @@
+/*
+  Peak fits of the Ex spectra of offline (-e)
+  The fit list (see fit.list), the spectra of its targets copied by anaend,
+  and the fits of all of them at the end, written into the fit table.
+*/
+
+#ifndef __FITLIST_H__
+#define __FITLIST_H__
+
+#include <string>
+#include <vector>
+
+#include "peakfit.h"
+
+struct FITLINE {
+  std::string target, hist, group;
+  double   A;
+  int      Z, use;
+  FIT_MODEL model;
+  double   Ed, dRp, dRm;      /* NAN: keep the value in the table */
+};
+extern std::vector<FITLINE> fitlines;
+
+bool readfitlist(std::string file);
+void fitcollect();
+void fitall(int nthread);
+
+#endif /* __FITLIST_H__ */
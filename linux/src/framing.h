@@ -0,0 +1,193 @@
+/*
+  Validated framing of the NGDRV event stream
+  An event is valid if its nbyte (the first word, counting itself) is even
+  and in [4, NGDRV_MAXEVLEN], and its last word is NGDRV_DELIM. Payload
+  words are 12-bit, so NGDRV_DELIM never occurs inside an event.
+  framesync(p) is where a walk goes on from p: p itself if an event starts
+  there (valid, NGDRV_EOF, or running past the end of the data: the
+  truncated tail the event loops analyse as read() would), else the
+  resynchronisation point: the start q > p of the first valid event ending
+  at an NGDRV_DELIM that is followed by a valid event, NGDRV_EOF or the end
+  of the data (or NGDRV_EOF right after an NGDRV_DELIM). The skipped bytes
+  are counted in FRAME_STATS.
+  Every walk of the framing (event loops, event index, column cache,
+  ngzconv) goes through framesync, so they all see the same events.
+  The checks run at memory speed: framerun checks nbyte and NGDRV_DELIM of
+  a run of events of one length (16-byte events four at a time, as SSE2 or
+  AVX2 vectors), and the scan for NGDRV_DELIM compares 16 (SSE2) or 32
+  (AVX2) bytes at a time.
+*/
+
+#ifndef __FRAMING_H__
+#define __FRAMING_H__
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "ngdrvcommon.h"
+
+typedef struct FRAME_STATS {
+  unsigned long long nresync;    /* corrupt places resynchronised at */
+  unsigned long long nevent;     /* events lost there (estimated from the bytes, at least 1 each) */
+  unsigned long long nbyte;      /* bytes skipped */
+} FRAME_STATS;
+
+inline void frameadd(FRAME_STATS &a, const FRAME_STATS &b){
+  a.nresync += b.nresync;
+  a.nevent  += b.nevent;
+  a.nbyte   += b.nbyte;
+}
+
+inline bool framelen(unsigned nbyte){ return !(nbyte & 1) && nbyte >= 4 && nbyte <= NGDRV_MAXEVLEN; }
+
+/* The event at p: 1 it is valid (or NGDRV_EOF, or a truncated tail if
+   last), 0 it is not, -1 bytes after end are needed to tell (if !last) */
+inline int frameok(const unsigned char *p, const unsigned char *end, bool last){
+  unsigned short nbyte, delim;
+  if (end - p < 2) return last ? 1 : -1;
+  memcpy(&nbyte, p, 2);
+  if (nbyte == NGDRV_EOF) return 1;
+  if (!framelen(nbyte)) return 0;
+  if (end - p < nbyte) return last ? 1 : -1;
+  memcpy(&delim, p + nbyte - 2, 2);
+  return delim == NGDRV_DELIM;
+}
+
+/* First d in [p, end-1) with d[0..1] = NGDRV_DELIM (little endian), end if none */
+inline const unsigned char *framedelim_sse2(const unsigned char *p, const unsigned char *end){
+  const __m128i lo = _mm_set1_epi8(0x01), hi = _mm_set1_epi8((char)0x80);
+  for (; end - p >= 17; p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p), b = _mm_loadu_si128((const __m128i *)(p+1));
+    int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, lo), _mm_cmpeq_epi8(b, hi)));
+    if (m) return p + __builtin_ctz(m);
+  }
+  for (; end - p >= 2; p++)
+    if (p[0] == 0x01 && p[1] == 0x80) return p;
+  return end;
+}
+
+__attribute__((target("avx2")))
+inline const unsigned char *framedelim_avx2(const unsigned char *p, const unsigned char *end){
+  const __m256i lo = _mm256_set1_epi8(0x01), hi = _mm256_set1_epi8((char)0x80);
+  for (; end - p >= 33; p += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p), b = _mm256_loadu_si256((const __m256i *)(p+1));
+    unsigned m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, lo), _mm256_cmpeq_epi8(b, hi)));
+    if (m) return p + __builtin_ctz(m);
+  }
+  return framedelim_sse2(p, end);
+}
+
+/* Number of valid events of len bytes each from p, whole in [p, end), at most max */
+inline size_t framerun_sse2(const unsigned char *p, const unsigned char *end, unsigned len, size_t max){
+  size_t n = 0, avail = (end - p) / len;
+  if (avail > max) avail = max;
+  if (len == 16) {
+    // header and delimiter are words 0 and 7 of the vector
+    const __m128i want = _mm_setr_epi16(16, 0, 0, 0, 0, 0, 0, (short)NGDRV_DELIM);
+    for (; n + 4 <= avail; n += 4) {
+      const __m128i *v = (const __m128i *)(p + 16*n);
+      int m = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(v),   want)) &
+              _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(v+1), want)) &
+              _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(v+2), want)) &
+              _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(v+3), want));
+      if ((m & 0xc003) != 0xc003) break;
+    }
+  }
+  unsigned short nbyte, delim;
+  for (; n < avail; n++) {
+    memcpy(&nbyte, p + len*n, 2);
+    memcpy(&delim, p + len*n + len - 2, 2);
+    if (nbyte != len || delim != NGDRV_DELIM) break;
+  }
+  return n;
+}
+
+__attribute__((target("avx2")))
+inline size_t framerun_avx2(const unsigned char *p, const unsigned char *end, unsigned len, size_t max){
+  size_t n = 0, avail = (end - p) / len;
+  if (avail > max) avail = max;
+  if (len == 16) {
+    const __m256i want = _mm256_setr_epi16(16, 0, 0, 0, 0, 0, 0, (short)NGDRV_DELIM,
+                                           16, 0, 0, 0, 0, 0, 0, (short)NGDRV_DELIM);
+    for (; n + 4 <= avail; n += 4) {
+      const __m256i *v = (const __m256i *)(p + 16*n);
+      unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256(v),   want)) &
+                   _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256(v+1), want));
+      if ((m & 0xc003c003) != 0xc003c003) break;
+    }
+  }
+  return n + framerun_sse2(p + len*n, end, len, max - n);
+}
+
+/* the AVX2 versions where the CPU has it */
+inline bool frameavx2(){
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return avx2;
+}
+inline const unsigned char *framedelim(const unsigned char *p, const unsigned char *end){
+  return frameavx2() ? framedelim_avx2(p, end) : framedelim_sse2(p, end);
+}
+inline size_t framerun(const unsigned char *p, const unsigned char *end, unsigned len, size_t max){
+  return frameavx2() ? framerun_avx2(p, end, len, max) : framerun_sse2(p, end, len, max);
+}
+
+/* Where the walk goes on from p (see above); NULL if bytes after end are
+   needed to tell (only if !last). st (if not NULL) gets the skipped bytes.
+   For every NGDRV_DELIM d after p the candidates are the starts q in
+   (p, d] of an event ending at d (nbyte = d+2-q), earliest first, then
+   NGDRV_EOF or the end of the data right after d. */
+inline const unsigned char *framesync(const unsigned char *p, const unsigned char *end, bool last,
+                                      FRAME_STATS *st){
+  int ok = frameok(p, end, last);
+  if (ok) return ok > 0 ? p : NULL;
+  unsigned long long ndelim = 0;
+  unsigned nbyte = 0;
+  const unsigned char *d = p, *q = NULL;
+  while (!q && (d = framedelim(d, end)) != end) {
+    const unsigned char *q0 = d + 2 - p > NGDRV_MAXEVLEN ? d + 2 - NGDRV_MAXEVLEN : p + 1;
+    for (const unsigned char *c = q0; c + 4 <= d + 2 && !q; c++) {
+      unsigned short n, next;
+      memcpy(&n, c, 2);
+      if (n != d + 2 - c || !framelen(n)) continue;
+      int e = frameok(c + n, end, last);
+      if (e < 0) return NULL;
+      if (e == 0) continue;
+      // not right after an NGDRV_DELIM (the trailer may be what is corrupt):
+      // the next event must be as long, payload words of the event before
+      // must not pass for a short one
+      bool after = c - p >= 2 && c[-2] == 0x01 && c[-1] == 0x80;
+      if (!after && end - (c + n) >= 2) {
+        memcpy(&next, c + n, 2);
+        if (next != n && next != NGDRV_EOF) continue;
+      }
+      q = c;
+      nbyte = n;
+    }
+    if (q) break;
+    const unsigned char *c = d + 2;
+    unsigned short n;
+    if (end - c < 2) {
+      if (!last) return NULL;
+      q = end;
+      break;
+    }
+    memcpy(&n, c, 2);
+    if (n == NGDRV_EOF) { q = c; break; }
+    ndelim++;
+    d++;
+  }
+  if (!q) {
+    if (!last) return NULL;
+    q = end;
+  }
+  if (st) {
+    // events lost: as many as fit in the bytes, else the NGDRV_DELIM passed
+    unsigned long long nlost = nbyte ? (q - p + nbyte/2) / nbyte : ndelim;
+    st->nresync++;
+    st->nevent += nlost > 0 ? nlost : 1;
+    st->nbyte  += q - p;
+  }
+  return q;
+}
+
+#endif /* __FRAMING_H__ */
@@ -0,0 +1,108 @@
+/*
+  Graphical gates of offline (-G)
+  A gate is a polygon drawn on one of two planes of 12-bit channels:
+    qdc2    x = QDC, y = QDCt   (the plane of hQDC2)
+    tdcqdc  x = TDC, y = QDC    (the plane of hTDCQDC)
+  The gates of a plane are rasterised once into a map of 4096 x 4096
+  cells of 1 ch, centred on the channels: every cell holds the bits of
+  the gates its centre is inside of (even-odd rule, as TCutG::IsInside,
+  so a polygon may be concave or cross itself). An event is classified by
+  all the gates of a plane at once, with one lookup of its nearest cell.
+  The map has two levels: tiles of 64 x 64 cells, of which only the ones
+  an edge runs through keep their cells, the others one value for all.
+  A few gates then take well under 1 MB and the table of tiles (32 kB)
+  stays in cache.
+*/
+
+#ifndef __GATES_H__
+#define __GATES_H__
+
+#include <stdint.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define GATE_NCH     4096        /* channels of an axis (12 bits) */
+#define GATE_TSHIFT  6           /* tiles of 64 x 64 cells */
+#define GATE_TILE    (1 << GATE_TSHIFT)
+#define GATE_NT      (GATE_NCH >> GATE_TSHIFT)
+#define GATE_MAX     32          /* gates (bits of a cell) */
+
+#define GATE_QDC2    0
+#define GATE_TDCQDC  1
+#define GATE_NPLANE  2
+
+static const char *const gate_plane[GATE_NPLANE] = { "qdc2", "tdcqdc" };
+
+typedef struct GATE {
+  std::string name;
+  int         plane;
+  std::string group;             /* only this detector group ("": all) */
+  std::vector<double> x, y;      /* vertices [ch], closed from the last to the first */
+} GATE;
+
+typedef struct GATE_MAP {
+  uint32_t uni[GATE_NT*GATE_NT];   /* bits of the tiles without cells */
+  int32_t  tile[GATE_NT*GATE_NT];  /* -1, or the index of the cells of the tile in cell */
+  std::vector<uint32_t> cell;      /* GATE_TILE*GATE_TILE per tile, row by row */
+} GATE_MAP;
+
+/* nearest channel, within the axis */
+inline int gatech(double v){
+  int c = (int)floor(v + 0.5);
+  return c < 0 ? 0 : c >= GATE_NCH ? GATE_NCH-1 : c;
+}
+
+/* Bits of the gates of map m the point (x, y) [ch] is inside of */
+inline uint32_t gatebits(const GATE_MAP &m, double x, double y){
+  int cx = gatech(x), cy = gatech(y);
+  int t  = (cy >> GATE_TSHIFT)*GATE_NT + (cx >> GATE_TSHIFT);
+  int k  = m.tile[t];
+  if (k < 0) return m.uni[t];
+  return m.cell[((size_t)k << (2*GATE_TSHIFT)) + ((cy & (GATE_TILE-1)) << GATE_TSHIFT) + (cx & (GATE_TILE-1))];
+}
+
+/* OR bit into the cells of row y (from x = 0) whose centre is inside g */
+inline void gaterow(uint32_t *row, const GATE &g, double y, uint32_t bit, std::vector<double> &xs){
+  xs.clear();
+  size_t n = g.x.size();
+  for (size_t i=0, j=n-1; i<n; j=i++) {
+    if ((g.y[i] > y) == (g.y[j] > y)) continue;
+    xs.push_back(g.x[i] + (y - g.y[i]) * (g.x[j] - g.x[i]) / (g.y[j] - g.y[i]));
+  }
+  std::sort(xs.begin(), xs.end());
+  /* a centre c is inside if an odd number of crossings are right of it:
+     xs[2m] <= c < xs[2m+1] */
+  for (size_t k=0; k+1<xs.size(); k+=2) {
+    double lo = std::max(ceil(xs[k]), 0.0), hi = std::min(ceil(xs[k+1]), (double)GATE_NCH);
+    for (int c=(int)lo; c<(int)hi; c++) row[c] |= bit;
+  }
+}
+
+/* Rasterise gates g[k] (bit 1 << bit[k]) into m, a band of tile rows at a time */
+inline void gatebuild(GATE_MAP &m, const std::vector<const GATE*> &g, const std::vector<int> &bit){
+  std::vector<uint32_t> band((size_t)GATE_TILE*GATE_NCH);
+  std::vector<double> xs;
+  m.cell.clear();
+  for (int ty=0; ty<GATE_NT; ty++) {
+    std::fill(band.begin(), band.end(), 0);
+    for (int r=0; r<GATE_TILE; r++)
+      for (size_t k=0; k<g.size(); k++)
+        gaterow(&band[(size_t)r*GATE_NCH], *g[k], ty*GATE_TILE + r, 1u << bit[k], xs);
+    for (int tx=0; tx<GATE_NT; tx++) {
+      const uint32_t *c0 = &band[tx*GATE_TILE];
+      bool same = true;
+      for (int r=0; r<GATE_TILE && same; r++)
+        for (int c=0; c<GATE_TILE && same; c++) same = c0[(size_t)r*GATE_NCH + c] == c0[0];
+      int t = ty*GATE_NT + tx;
+      m.uni[t]  = c0[0];
+      m.tile[t] = -1;
+      if (same) continue;
+      m.tile[t] = m.cell.size() >> (2*GATE_TSHIFT);
+      for (int r=0; r<GATE_TILE; r++) m.cell.insert(m.cell.end(), c0 + (size_t)r*GATE_NCH, c0 + (size_t)r*GATE_NCH + GATE_TILE);
+    }
+  }
+}
+
+#endif /* __GATES_H__ */
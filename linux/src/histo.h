@@ -0,0 +1,221 @@
+/*
+  Fixed-binning histograms for the event loop
+  HIST1/HIST2 are built like the TH1F/TH2F they stand for (same name, title
+  and binning, same under/overflow cells) and are filled instead of them:
+  the bin as TAxis::FindFixBin computes it and an integer increment, plus
+  the sums ROOT keeps for the statistics. Weighted histograms (after
+  Sumw2()) keep double contents and sums of squares.
+  HIST2 planes of more than HIST_TILEMIN cells are stored as 32x32 tiles
+  allocated on their first fill, so mostly empty planes take memory and
+  cache only where there are events. A tile counts in 16 bits until one of
+  its cells passes 65535, then in 32 bits.
+  hexport() copies everything into the ROOT histogram; call it once, before
+  the histograms are written.
+*/
+
+#ifndef __HISTO_H__
+#define __HISTO_H__
+
+#include <TH1F.h>
+#include <TH2F.h>
+#include <vector>
+
+#define HIST_TILE     32        /* tile side [cells] */
+#define HIST_TILEMIN  65536     /* planes above this many cells are tiled */
+
+/* tag of the constructors clone() uses: an empty histogram with the
+   binning of another (HIST1/HIST2 are not copied otherwise) */
+struct HIST_BINNING {};
+
+struct HIST {
+  TH1   *th = 0;                /* ROOT histogram (NULL for private copies) */
+  double entries = 0;
+  double stats[7] = {0};        /* sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2, sumwxy */
+  virtual ~HIST(){}
+  virtual HIST *clone() const = 0;      /* empty copy with the same binning */
+  virtual void  add(const HIST &o) = 0;
+  virtual void  hexport() = 0;
+  TAxis  *GetXaxis(){ return th->GetXaxis(); }
+  TAxis  *GetYaxis(){ return th->GetYaxis(); }
+  double  GetEntries() const { return entries; }
+  void    SetEntries(double n){ entries = n; }
+};
+
+/* cell of x on an axis of nb bins from lo to hi, the same expression as
+   TAxis::FindFixBin; NaN goes to the overflow */
+inline int hbin(double x, int nb, double lo, double hi){
+  if (x < lo)    return 0;
+  if (!(x < hi)) return nb+1;
+  return 1 + (int)(nb*(x - lo)/(hi - lo));
+}
+
+struct HIST1 : HIST {
+  int    nb;
+  double xmin, xmax, scale;        /* scale = nb/(xmax-xmin), for the toys of mcsys.h */
+  std::vector<unsigned int> cnt;   /* unit fills, cells 0..nb+1 */
+  std::vector<double> w, w2;       /* weighted fills (after Sumw2()) */
+
+  HIST1(const char *name, const char *title, int nbx, double lo, double hi){
+    th = new TH1F(name, title, nbx, lo, hi);
+    init(nbx, lo, hi);
+  }
+  HIST1(const HIST1 &o, HIST_BINNING){
+    init(o.nb, o.xmin, o.xmax);
+    if (!o.w.empty()) Sumw2();
+  }
+  HIST1(const HIST1 &) = delete;
+  HIST1 &operator=(const HIST1 &) = delete;
+  void init(int nbx, double lo, double hi){
+    nb = nbx;  xmin = lo;  xmax = hi;  scale = nb/(hi - lo);
+    cnt.assign(nb+2, 0);
+  }
+  void Sumw2(){
+    if (th) th->Sumw2();
+    w.assign(cnt.begin(), cnt.end());
+    w2.assign(cnt.begin(), cnt.end());
+    cnt.clear();
+  }
+
+  inline void Fill(double x){
+    int b = hbin(x, nb, xmin, xmax);
+    entries++;
+    if (w.empty()) cnt[b]++;
+    else         { w[b] += 1.0;  w2[b] += 1.0; }
+    if (b == 0 || b > nb) return;
+    stats[0] += 1.0;  stats[1] += 1.0;  stats[2] += x;  stats[3] += x*x;
+  }
+  inline void Fill(double x, double wt){
+    if (w.empty()) Sumw2();
+    int b = hbin(x, nb, xmin, xmax);
+    entries++;
+    w[b] += wt;  w2[b] += wt*wt;
+    if (b == 0 || b > nb) return;
+    stats[0] += wt;  stats[1] += wt*wt;  stats[2] += wt*x;  stats[3] += wt*x*x;
+  }
+
+  /* contents and sums of squares, for filling the bins directly */
+  double *GetArray()           { return w.data(); }
+  double *GetSumw2Array()      { return w2.data(); }
+  int     GetNbinsX() const    { return nb; }
+  double  GetBinWidth(int) const { return (xmax - xmin)/nb; }
+  double  GetBinCenter(int b) const { return xmin + (b - 0.5)*(xmax - xmin)/nb; }
+  int     FindFixBin(double x) const { return hbin(x, nb, xmin, xmax); }
+
+  HIST *clone() const { return new HIST1(*this, HIST_BINNING()); }
+  void add(const HIST &h){
+    const HIST1 &o = (const HIST1 &)h;
+    for (size_t b=0; b<cnt.size(); b++) cnt[b] += o.cnt[b];
+    for (size_t b=0; b<w.size(); b++) { w[b] += o.w[b];  w2[b] += o.w2[b]; }
+    entries += o.entries;
+    for (int k=0; k<7; k++) stats[k] += o.stats[k];
+  }
+  void hexport(){
+    float *a = ((TH1F *)th)->GetArray();
+    if (w.empty()) {
+      for (int b=0; b<nb+2; b++) a[b] = cnt[b];
+    } else {
+      double *s = th->GetSumw2()->GetArray();
+      for (int b=0; b<nb+2; b++) { a[b] = w[b];  s[b] = w2[b]; }
+    }
+    th->PutStats(stats);
+    th->SetEntries(entries);
+  }
+};
+
+/* HIST_TILE^2 cells of a HIST2, 16 bits wide until a cell passes 65535 */
+struct HIST_TILE16 {
+  unsigned short *s = 0;
+  unsigned int   *w = 0;
+  bool empty() const { return !s && !w; }
+  unsigned int get(int c) const { return w ? w[c] : s ? s[c] : 0; }
+  void widen(){
+    w = new unsigned int[HIST_TILE*HIST_TILE]();
+    if (s) for (int c=0; c<HIST_TILE*HIST_TILE; c++) w[c] = s[c];
+    delete[] s;
+    s = 0;
+  }
+  inline void inc(int c){
+    if (w) { w[c]++;  return; }
+    if (!s) s = new unsigned short[HIST_TILE*HIST_TILE]();
+    if (++s[c] == 0) { s[c] = 65535;  widen();  w[c]++; }
+  }
+};
+
+struct HIST2 : HIST {
+  int    nbx, nby;
+  double xmin, xmax, ymin, ymax;
+  int    ncx;                      /* cells per row (nbx+2) */
+  int    ntx;                      /* tiles per row, 0 if not tiled */
+  std::vector<unsigned int> cnt;   /* all cells, if not tiled */
+  std::vector<HIST_TILE16>  tile;  /* empty until filled */
+
+  HIST2(const char *name, const char *title, int nx, double xlo, double xhi,
+        int ny, double ylo, double yhi){
+    th = new TH2F(name, title, nx, xlo, xhi, ny, ylo, yhi);
+    init(nx, xlo, xhi, ny, ylo, yhi);
+  }
+  HIST2(const HIST2 &o, HIST_BINNING){ init(o.nbx, o.xmin, o.xmax, o.nby, o.ymin, o.ymax); }
+  HIST2(const HIST2 &) = delete;               /* the tiles are owned */
+  HIST2 &operator=(const HIST2 &) = delete;
+  ~HIST2(){ for (HIST_TILE16 &t : tile) { delete[] t.s;  delete[] t.w; } }
+  void init(int nx, double xlo, double xhi, int ny, double ylo, double yhi){
+    nbx = nx;  xmin = xlo;  xmax = xhi;
+    nby = ny;  ymin = ylo;  ymax = yhi;
+    ncx = nbx + 2;
+    if ((long long)ncx * (nby+2) > HIST_TILEMIN) {
+      ntx = (ncx + HIST_TILE-1) / HIST_TILE;
+      tile.assign((size_t)ntx * ((nby+2 + HIST_TILE-1) / HIST_TILE), HIST_TILE16());
+    } else {
+      ntx = 0;
+      cnt.assign((size_t)ncx * (nby+2), 0);
+    }
+  }
+
+  inline unsigned int get(int bx, int by) const {
+    if (!ntx) return cnt[(size_t)by*ncx + bx];
+    return tile[(by/HIST_TILE)*ntx + bx/HIST_TILE].get((by%HIST_TILE)*HIST_TILE + bx%HIST_TILE);
+  }
+
+  inline void Fill(double x, double y){
+    int bx = hbin(x, nbx, xmin, xmax);
+    int by = hbin(y, nby, ymin, ymax);
+    entries++;
+    if (!ntx) cnt[(size_t)by*ncx + bx]++;
+    else      tile[(by/HIST_TILE)*ntx + bx/HIST_TILE].inc((by%HIST_TILE)*HIST_TILE + bx%HIST_TILE);
+    if (bx == 0 || bx > nbx || by == 0 || by > nby) return;
+    stats[0] += 1.0;  stats[1] += 1.0;
+    stats[2] += x;    stats[3] += x*x;
+    stats[4] += y;    stats[5] += y*y;  stats[6] += x*y;
+  }
+
+  HIST *clone() const { return new HIST2(*this, HIST_BINNING()); }
+  void add(const HIST &h){
+    const HIST2 &o = (const HIST2 &)h;
+    const int nc = HIST_TILE*HIST_TILE;
+    for (size_t c=0; c<cnt.size(); c++) cnt[c] += o.cnt[c];
+    for (size_t k=0; k<tile.size(); k++) {
+      const HIST_TILE16 &b = o.tile[k];
+      HIST_TILE16 &a = tile[k];
+      if (b.empty()) continue;
+      if (!a.w) {
+        bool wide = b.w != 0;
+        for (int c=0; c<nc && !wide; c++) wide = a.get(c) + b.s[c] > 65535;
+        if (wide) a.widen();
+        else if (!a.s) a.s = new unsigned short[nc]();
+      }
+      if (a.w) for (int c=0; c<nc; c++) a.w[c] += b.get(c);
+      else     for (int c=0; c<nc; c++) a.s[c] += b.s[c];
+    }
+    entries += o.entries;
+    for (int k=0; k<7; k++) stats[k] += o.stats[k];
+  }
+  void hexport(){
+    float *a = ((TH2F *)th)->GetArray();
+    for (int by=0; by<nby+2; by++)
+      for (int bx=0; bx<ncx; bx++) a[(size_t)by*ncx + bx] = get(bx, by);
+    th->PutStats(stats);
+    th->SetEntries(entries);
+  }
+};
+
+#endif /* __HISTO_H__ */
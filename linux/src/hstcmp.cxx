@@ -0,0 +1,98 @@
+//////////////////////////////////////////
+// Bin-by-bin comparison of hist files  //
+//////////////////////////////////////////
+
+// Every histogram of the reference must be in the other file with the same
+// binning and contents. With -t tol a histogram matches if
+//   sum |a - b|  <=  tol * sum |a|      (over all cells, under/overflow too)
+// so -t 0 (default) means identical contents and entries. -n compares only
+// the histograms named (e.g. those a skim keeps all events of).
+// Exit status: 0 all match, 1 some differ or are missing, 2 error.
+
+/* headers for standard I/O */
+#include <iostream>
+
+/* headers for ROOT */
+#include <TFile.h>
+#include <TH1.h>
+#include <TKey.h>
+#include <TList.h>
+
+#include <string>
+#include <math.h>
+#include <unistd.h>
+
+using namespace std;
+
+int main(int argc, char *argv[]){
+  double tol = 0;   // -t : relative tolerance
+  bool   quiet = false;  // -q : only the summary line
+  string only;           // -n : names, comma separated
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:qn:")) != -1) {
+    switch (opt) {
+    case 't': tol = atof(optarg); break;
+    case 'q': quiet = true; break;
+    case 'n': only = "," + string(optarg) + ","; break;
+    default:  argc = 0; break;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
+  // Usage
+  if (argc != 3) {
+    cout << "Usage: hstcmp [-t tol] [-q] [-n names] [reference hist file] [hist file]\n";
+    cout << "  -t tol : histograms match if sum|a-b| <= tol * sum|a| (default 0: identical)\n";
+    cout << "  -q     : print the summary line only\n";
+    cout << "  -n names : compare only these histograms (comma separated)\n";
+    exit(2);
+  }
+
+  TFile *fa = TFile::Open(argv[1]), *fb = TFile::Open(argv[2]);
+  if (!fa || !fb) {
+    cerr << "cannot open " << (fa ? argv[2] : argv[1]) << "\n";
+    return 2;
+  }
+
+  int nhist = 0, nbad = 0;
+  TIter next(fa->GetListOfKeys());
+  TKey *k;
+  while ((k = (TKey *)next())) {
+    if (!only.empty() && only.find("," + string(k->GetName()) + ",") == string::npos) continue;
+    TH1 *a = dynamic_cast<TH1 *>(k->ReadObj());
+    if (!a) continue;
+    nhist++;
+    TH1 *b = dynamic_cast<TH1 *>(fb->Get(k->GetName()));
+    if (!b) {
+      if (!quiet) printf("%-24s missing\n", k->GetName());
+      nbad++;
+      continue;
+    }
+    if (a->GetDimension() != b->GetDimension() || a->GetNcells() != b->GetNcells() ||
+        a->GetXaxis()->GetXmin() != b->GetXaxis()->GetXmin() || a->GetXaxis()->GetXmax() != b->GetXaxis()->GetXmax() ||
+        a->GetYaxis()->GetXmin() != b->GetYaxis()->GetXmin() || a->GetYaxis()->GetXmax() != b->GetYaxis()->GetXmax()) {
+      if (!quiet) printf("%-24s binned differently\n", k->GetName());
+      nbad++;
+      continue;
+    }
+    double l1 = 0, sum = 0, dmax = 0;
+    int cmax = -1;
+    for (int c=0; c<a->GetNcells(); c++) {
+      double va = a->GetBinContent(c), d = fabs(va - b->GetBinContent(c));
+      l1  += d;
+      sum += fabs(va);
+      if (d > dmax) { dmax = d; cmax = c; }
+    }
+    bool ok = tol > 0 ? l1 <= tol*sum : l1 == 0 && a->GetEntries() == b->GetEntries();
+    if (!ok) {
+      nbad++;
+      if (!quiet) printf("%-24s differs: sum|a-b|/sum|a| = %.3e, max |a-b| = %g (cell %d), entries %.0f / %.0f\n",
+                         k->GetName(), sum > 0 ? l1/sum : l1, dmax, cmax, a->GetEntries(), b->GetEntries());
+    }
+  }
+  printf("%s vs %s: %d histograms, %d differ%s\n", argv[1], argv[2], nhist, nbad,
+         tol > 0 ? (" (tolerance " + to_string(tol) + ")").c_str() : "");
+  return nbad ? 1 : 0;
+}
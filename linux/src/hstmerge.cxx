@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////
+// Weighted sum / difference of hist files       //
+///////////////////////////////////////////////////
+
+// out = sum_i w_i * file_i, histogram by histogram: every histogram of the
+// first file is summed over all files (same name and binning) and written
+// to the output before the next one is read, so at most one histogram per
+// thread is in memory, whatever the number of files.
+// The sum is a tree: each of the -j threads adds a fixed slice of the files
+// (read one at a time) into its own partial sum, then the partial sums are
+// added pairwise in log2(j) parallel rounds. Contents and sums of squares
+// are kept in double until the result is written; the order of the
+// additions depends on the file order and on -j, so results with another
+// order or -j can differ in the last bits (counts below 2^53 are exact).
+// Errors: sumw2 = sum_i w_i^2 * sumw2_i (contents for histograms without
+// Sumw2()); the result has Sumw2() if a weight is not 1 or an input has it.
+// Entries are |sum_i w_i * entries_i| as TH1::Add counts them, the
+// statistics are recomputed from the contents.
+// Weights are given as file*w, e.g. the empty target subtracted after
+// scaling by beam charge:
+//   hstmerge -o hst/Al_net.root hst/run0041.root hst/run0046s.root*-0.83
+// or as lines "file [weight]" of a list (-l).
+
+/* headers for standard I/O */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+/* headers for ROOT */
+#include <TFile.h>
+#include <TH1.h>
+#include <TKey.h>
+#include <TList.h>
+#include <TROOT.h>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+using namespace std;
+
+double nowsec(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+struct INPUT {
+  string path;
+  double w;
+  TFile *f;
+};
+
+// partial sum of one histogram
+struct ACC {
+  vector<double> c, w2;
+  double entries = 0;
+  bool   sumw2 = false;     // an input had Sumw2()
+  bool   bad = false;       // an input is missing it or binned differently
+  string why;
+};
+
+// "file*w" or "file"
+bool parseinput(string s, INPUT &in){
+  in.w = 1.0;
+  in.f = 0;
+  size_t star = s.rfind('*');
+  if (star != string::npos) {
+    char *e;
+    in.w = strtod(s.c_str() + star + 1, &e);
+    if (*e || e == s.c_str() + star + 1) return false;
+    s = s.substr(0, star);
+  }
+  in.path = s;
+  return !s.empty();
+}
+
+bool sameaxis(const TAxis *a, const TAxis *b){
+  return a->GetNbins() == b->GetNbins() && a->GetXmin() == b->GetXmin() && a->GetXmax() == b->GetXmax();
+}
+
+bool samebins(const TH1 *a, const TH1 *b){
+  return a->GetDimension() == b->GetDimension() && a->GetNcells() == b->GetNcells() &&
+    sameaxis(a->GetXaxis(), b->GetXaxis()) && sameaxis(a->GetYaxis(), b->GetYaxis()) &&
+    sameaxis(a->GetZaxis(), b->GetZaxis());
+}
+
+// acc += w * h
+void accadd(ACC &a, const TH1 *h, double w){
+  TH1 *m = (TH1 *)h;
+  int n = h->GetNcells();
+  const double *s2 = h->GetSumw2N() ? m->GetSumw2()->GetArray() : 0;
+  for (int k=0; k<n; k++) {
+    double v = h->GetBinContent(k);
+    a.c[k]  += w*v;
+    a.w2[k] += w*w*(s2 ? s2[k] : v);
+  }
+  a.entries += w*h->GetEntries();
+  a.sumw2   |= s2 != 0;
+}
+
+// a += b
+void accmerge(ACC &a, const ACC &b){
+  for (size_t k=0; k<a.c.size(); k++) {
+    a.c[k]  += b.c[k];
+    a.w2[k] += b.w2[k];
+  }
+  a.entries += b.entries;
+  a.sumw2   |= b.sumw2;
+  if (b.bad && !a.bad) { a.bad = true;  a.why = b.why; }
+}
+
+int main(int argc, char *argv[]){
+  int nthread = thread::hardware_concurrency();  // -j
+  string out;                                    // -o
+  string list;                                   // -l
+  bool quiet = false;                            // -q
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:l:q")) != -1) {
+    switch (opt) {
+    case 'j': nthread = atoi(optarg); break;
+    case 'o': out = optarg; break;
+    case 'l': list = optarg; break;
+    case 'q': quiet = true; break;
+    default:  argc = 0; break;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
+  vector<INPUT> in;
+  for (int k=1; k<argc; k++) {
+    INPUT x;
+    if (!parseinput(argv[k], x)) {
+      cerr << "bad input " << argv[k] << "\n";
+      return 2;
+    }
+    in.push_back(x);
+  }
+  if (!list.empty()) {
+    ifstream fin(list.c_str());
+    if (!fin) {
+      cerr << "cannot open " << list << "\n";
+      return 2;
+    }
+    string line;
+    while (getline(fin, line)) {
+      line = line.substr(0, line.find('#'));
+      istringstream ss(line);
+      INPUT x;
+      x.w = 1.0;
+      x.f = 0;
+      if (!(ss >> x.path)) continue;
+      ss >> x.w;
+      in.push_back(x);
+    }
+  }
+
+  // Usage
+  if (argc < 1 || out.empty() || in.empty()) {
+    cout << "Usage: hstmerge [-j N] [-q] -o [output hist file] [-l list] [hist file[*weight]] ...\n";
+    cout << "  writes sum(weight * hist file) of every histogram of the first file\n";
+    cout << "  -o file : output hist file\n";
+    cout << "  -l list : more inputs, lines of \"hist file [weight]\" ('#' starts a comment)\n";
+    cout << "  -j N    : threads of the tree-shaped reduction (default all cores)\n";
+    cout << "  -q      : print the summary line only\n";
+    cout << "  e.g. hstmerge -o hst/Al_net.root hst/run0041.root hst/run0046s.root*-0.83\n";
+    exit(2);
+  }
+  nthread = std::max(1, std::min(nthread, (int)in.size()));
+
+  // histograms are owned here, not by the files they are read from
+  ROOT::EnableThreadSafety();
+  TH1::AddDirectory(false);
+  for (INPUT &x : in) {
+    if (!(x.f = TFile::Open(x.path.c_str()))) {
+      cerr << "cannot open " << x.path << "\n";
+      return 2;
+    }
+  }
+  TFile *fo = new TFile(out.c_str(), "RECREATE");
+  if (fo->IsZombie()) {
+    cerr << "cannot open " << out << "\n";
+    return 2;
+  }
+
+  vector<string> names;
+  TIter next(in[0].f->GetListOfKeys());
+  TKey *key;
+  while ((key = (TKey *)next())) names.push_back(key->GetName());
+
+  double t0 = nowsec();
+  long long ncell = 0;
+  int nhist = 0, nbad = 0;
+  for (const string &name : names) {
+    TH1 *ref = dynamic_cast<TH1 *>(in[0].f->Get(name.c_str()));
+    if (!ref) continue;
+    int n = ref->GetNcells();
+    TH1 *o = (TH1 *)ref->Clone();
+    o->Reset();
+
+    // leaves: thread t adds files [t*N/T, (t+1)*N/T) into acc[t]
+    vector<ACC> acc(nthread);
+    vector<thread> workers;
+    for (int t=0; t<nthread; t++) {
+      workers.emplace_back([&, t]{
+        ACC &a = acc[t];
+        a.c.assign(n, 0.0);
+        a.w2.assign(n, 0.0);
+        size_t lo = t*in.size()/nthread, hi = (t+1)*in.size()/nthread;
+        for (size_t i=lo; i<hi; i++) {
+          TH1 *h = i == 0 ? ref : dynamic_cast<TH1 *>(in[i].f->Get(name.c_str()));
+          if (!h || !samebins(ref, h)) {
+            a.bad = true;
+            a.why = in[i].path + (h ? ": binned differently" : ": missing");
+          } else {
+            accadd(a, h, in[i].w);
+          }
+          if (i != 0) delete h;
+        }
+      });
+    }
+    for (auto &w : workers) w.join();
+
+    // pairwise rounds: acc[i] += acc[i+s]
+    for (int s=1; s<nthread; s*=2) {
+      workers.clear();
+      for (int i=0; i+s<nthread; i+=2*s)
+        workers.emplace_back([&, i, s]{ accmerge(acc[i], acc[i+s]); });
+      for (auto &w : workers) w.join();
+    }
+    delete ref;
+
+    const ACC &a = acc[0];
+    nhist++;
+    if (a.bad) {
+      nbad++;
+      if (!quiet) printf("%-24s skipped: %s\n", name.c_str(), a.why.c_str());
+      delete o;
+      continue;
+    }
+    bool sumw2 = a.sumw2;
+    for (const INPUT &x : in) sumw2 |= x.w != 1.0;
+    if (sumw2) o->Sumw2();
+    for (int k=0; k<n; k++) o->SetBinContent(k, a.c[k]);
+    if (sumw2) {
+      double *s2 = o->GetSumw2()->GetArray();
+      for (int k=0; k<n; k++) s2[k] = a.w2[k];
+    }
+    o->ResetStats();
+    o->SetEntries(fabs(a.entries));
+    fo->WriteTObject(o);
+    delete o;
+    ncell += n;
+  }
+  fo->Close();
+  delete fo;
+  for (INPUT &x : in) x.f->Close();
+
+  double dt = nowsec() - t0;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%s: %zu files, %d histograms (%d skipped), %.1f Mcells read in %.3f s (%.1f Mcells/s), %d threads, peak RSS %.1f MB\n",
+         out.c_str(), in.size(), nhist, nbad, ncell*in.size()/1e6, dt, dt > 0 ? ncell*in.size()/1e6/dt : 0.0,
+         nthread, ru.ru_maxrss/1024.0);
+  return nbad ? 1 : 0;
+}
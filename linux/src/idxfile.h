@@ -0,0 +1,161 @@
+/*
+  Sidecar event index of an NGDRV data file
+  Events are found only by walking the nbyte headers from the start; the
+  walk is done once and its result kept in <data file>.idx:
+    IDX_HEADER
+    unsigned long long [nentry]   (byte offset of events 0, stride, 2 stride, ...,
+                                   and last the end of the events)
+  so event i is at most stride-1 events after off[i/stride] (idxseek), and
+  a run splits into chunks of equal event counts without reading it.
+  The header also has the run statistics of the walk. The index is valid
+  as long as size and mtime of the data file match; offline rebuilds a
+  stale one.
+*/
+
+#ifndef __IDXFILE_H__
+#define __IDXFILE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "ngdrvcommon.h"
+#include "framing.h"
+
+#define IDX_MAGIC   0x31584449  /* "IDX1" */
+#define IDX_STRIDE  1024        /* events per entry: 8 bytes per 16 kB of a 16-byte event run */
+
+typedef struct IDX_HEADER {
+  unsigned int       magic;
+  unsigned int       stride;
+  unsigned long long nevent;
+  unsigned long long nentry;
+  long long          srcsize;   /* size  of the data file */
+  long long          srcmtime;  /* mtime of the data file */
+  /* run statistics */
+  long long          evend;     /* end of the events: NGDRV_EOF or end of file */
+  long long          eof;       /* offset of NGDRV_EOF, -1 if missing */
+  unsigned int       lenmin;    /* shortest and longest nbyte */
+  unsigned int       lenmax;
+  FRAME_STATS        skipped;   /* corrupt framing skipped by the walk */
+  unsigned int       truncated; /* the last event is cut short */
+  unsigned int       pad;
+} IDX_HEADER;
+
+typedef struct IDX {
+  IDX_HEADER h;
+  std::vector<unsigned long long> off;
+} IDX;
+
+inline std::string idxpath(std::string datFile){ return datFile + ".idx"; }
+
+/* Where the walk is after n events from p (right after the last of
+   them, before any corrupt bytes; or end, or NGDRV_EOF) */
+inline const unsigned char *idxwalk(const unsigned char *p, const unsigned char *end, long long n){
+  unsigned short nbyte;
+  for (; n > 0; n--) {
+    p = framesync(p, end, true, NULL);
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF) break;
+    if (end - p < nbyte) return end;
+    p += nbyte;
+  }
+  return p;
+}
+
+/* Event i of the mapped data file [base, end), end of the events for i >= nevent */
+inline const unsigned char *idxseek(const IDX &x, const unsigned char *base, const unsigned char *end,
+                                    unsigned long long i){
+  if (i >= x.h.nevent) return base + x.h.evend;
+  return idxwalk(base + x.off[i / x.h.stride], end, i % x.h.stride);
+}
+
+/* Read the index of datFile; false if missing or stale */
+inline bool idxopen(IDX &x, std::string datFile, const struct stat &src){
+  int fd = open(idxpath(datFile).c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  fstat(fd, &st);
+  IDX_HEADER &h = x.h;
+  bool ok = st.st_size >= (off_t)sizeof(h) && pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+    h.magic == IDX_MAGIC && h.stride > 0 &&
+    h.srcsize == (long long)src.st_size && h.srcmtime == (long long)src.st_mtime &&
+    h.nentry == (h.nevent + h.stride - 1) / h.stride + 1 &&
+    (size_t)st.st_size == sizeof(h) + h.nentry*8;
+  if (ok) {
+    x.off.resize(h.nentry);
+    ok = pread(fd, x.off.data(), h.nentry*8, sizeof(h)) == (ssize_t)(h.nentry*8);
+  }
+  close(fd);
+  return ok;
+}
+
+/* Index the events in [base, end) of a data file (the framing is walked
+   as the event loops of offline do: up to NGDRV_EOF, over corrupt bytes
+   (framesync), a truncated last event counts) */
+inline void idxbuild(IDX &x, const unsigned char *base, const unsigned char *end, const struct stat &src){
+  IDX_HEADER &h = x.h;
+  memset(&h, 0, sizeof(h));
+  h.magic  = IDX_MAGIC;
+  h.stride = IDX_STRIDE;
+  h.srcsize  = src.st_size;
+  h.srcmtime = src.st_mtime;
+  h.eof    = -1;
+  h.lenmin = ~0u;
+  x.off.clear();
+  const unsigned char *p = base;
+  unsigned short nbyte;
+  unsigned long long n = 0;
+  while (end - p >= 2) {
+    p = framesync(p, end, true, &h.skipped);
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF) { h.eof = p - base; break; }
+    if (n % IDX_STRIDE == 0) x.off.push_back(p - base);
+    if (nbyte < h.lenmin) h.lenmin = nbyte;
+    if (nbyte > h.lenmax) h.lenmax = nbyte;
+    n++;
+    if (end - p < nbyte) { h.truncated = 1; p = end; break; }
+    p += nbyte;
+  }
+  if (n == 0) h.lenmin = 0;
+  h.nevent = n;
+  h.evend  = p - base;
+  x.off.push_back(h.evend);
+  h.nentry = x.off.size();
+}
+
+/* Write the index of datFile (through a temporary file, renamed) */
+inline bool idxwrite(const IDX &x, std::string datFile){
+  std::string tmp = idxpath(datFile) + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+  bool ok = write(fd, &x.h, sizeof(x.h)) == (ssize_t)sizeof(x.h) &&
+            write(fd, x.off.data(), x.off.size()*8) == (ssize_t)(x.off.size()*8);
+  close(fd);
+  if (ok) ok = rename(tmp.c_str(), idxpath(datFile).c_str()) == 0;
+  if (!ok) unlink(tmp.c_str());
+  return ok;
+}
+
+/* The index of the data file datFile open on fd: read, or built (mapping
+   the file for the walk) and written for the next time.
+   0 read, 1 built, 2 built but not written, -1 the file cannot be mapped */
+inline int idxget(IDX &x, std::string datFile, int fd, const struct stat &src){
+  if (idxopen(x, datFile, src)) return 0;
+  void *map = src.st_size > 0 ? mmap(NULL, src.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (map == MAP_FAILED) return -1;
+  madvise(map, src.st_size, MADV_SEQUENTIAL);
+  const unsigned char *base = (const unsigned char *)map;
+  idxbuild(x, base, base + src.st_size, src);
+  if (map) munmap(map, src.st_size);
+  return idxwrite(x, datFile) ? 1 : 2;
+}
+
+#endif /* __IDXFILE_H__ */
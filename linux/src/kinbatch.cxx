@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: batched analysis (-k)      //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "dither.h"
+#include "analysis.h"
+#include "profrun.h"
+#include "skim.h"
+#include "kinbatch.h"
+
+using namespace std;
+
+// ##### Batched analysis (-k) #####
+// Events are buffered per thread; every kinblk events the kinematics of the
+// whole block go through one kernel of kinematics.h (AVX-512, AVX2 or
+// scalar, picked at runtime) and the results are filled with anafill(),
+// one detector group after the other. The dithers of the block are drawn
+// at once as well (dither_batch()).
+const int kinblk = 1024;
+struct KinBlock {
+  int    n = 0;
+  long long ev[kinblk];                  // event index (for the dithering)
+  unsigned short raw[kinblk][chmapnw];   // payload words
+  double dith[8][kinblk];                // dither of each word
+  double tdc[kinblk], qdc[kinblk], qdct[kinblk];
+  double tofr[kinblk], tof[kinblk], ex[kinblk], ex_err[kinblk];
+};
+thread_local KinBlock kblk;
+KIN_FUNC kinfunc = kin_scalar;
+
+void anabatchflush(){
+  KinBlock &b = kblk;
+  if (b.n == 0) return;
+  if (skimon) skimopen(b.n, b.ev, b.raw[0], chmapnw);
+  if (dithphilox) {
+    for (int k=0; k<chmapnw; k+=4)
+      dither_batch(runseed, b.n, b.ev, k/4, b.dith[k], b.dith[k+1], b.dith[k+2], b.dith[k+3]);
+  }
+  proflap(PROF_DECODE);
+  for (size_t g=0; g<groups.size(); g++) {
+    const GROUP &G = groups[g];
+    hsel(g);
+    for (int j=0; j<b.n; j++) {
+      b.tdc [j] = b.raw[j][G.tdc ];
+      b.qdc [j] = b.raw[j][G.qdc ];
+      b.qdct[j] = b.raw[j][G.qdct];
+    }
+    if (dithphilox) {
+      for (int j=0; j<b.n; j++) {
+        b.tdc[j] += b.dith[G.tdc][j];  b.qdc[j] += b.dith[G.qdc][j];  b.qdct[j] += b.dith[G.qdct][j];
+      }
+    } else {
+      // -d trandom3: same draws as anaexec for one group (group by group for more)
+      for (int j=0; j<b.n; j++) {
+        b.tdc[j] += rnd.Rndm()-0.5;  b.qdc[j] += rnd.Rndm()-0.5;  b.qdct[j] += rnd.Rndm()-0.5;
+      }
+    }
+    proflap(PROF_DECODE);
+    if (uselut) kin_lut(*G.lut, G.kconst, b.n, b.tdc, b.tofr, b.tof, b.ex, b.ex_err);
+    else        kinfunc(G.kconst, b.n, b.tdc, b.tofr, b.tof, b.ex, b.ex_err);
+    proflap(PROF_KIN);
+    for (int j=0; j<b.n; j++) {
+      skimslot = j;
+      anafill(b.tdc[j], b.qdc[j], b.qdct[j], b.tofr[j], b.tof[j], b.ex[j], b.ex_err[j]);
+    }
+  }
+  if (skimon) skimclose();
+  b.n = 0;
+}
+
+int anabatch(int event_size, const unsigned short *anabuff){
+  // raw words, dithered in anabatchflush
+  KinBlock &b = kblk;
+  b.ev[b.n] = evindex;
+  memcpy(b.raw[b.n], anabuff, chmapw * sizeof(unsigned short));
+  proflap(PROF_DECODE);
+  if (++b.n == kinblk) anabatchflush();
+  return 0;
+}
+
+// Events/s of the kinematics alone: the per-event formulas of anaexec
+// against every kernel the CPU supports, on dithered TDC values
+int kinbench(){
+  GROUP G = defgroup("A", 0, 2, 3);  // the constants the formulas below use
+  groupconst(G);
+  const KIN_CONST &kconst = G.kconst;
+  const KIN_LUT   &kinlut = *G.lut;
+  const int nev = 1<<20, nrep = 20;
+  vector<double> tdc(nev), ref(nev), tofr(nev), tof(nev), ex(nev), ex_err(nev), ref_err(nev);
+  for (int i=0; i<nev; i++) tdc[i] = 300 + 800*rnd.Rndm();
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int r=0; r<nrep; r++) {
+    for (int i=0; i<nev; i++) {
+      Double_t tofr = - tdc[i] *ch2ns + (fpl / cc + 980 * ch2ns);
+      Double_t tof  = tofr + trf;
+      Double_t betan  = (fpl / tof) / cc ;
+      Double_t gamman = 1.0 / sqrt(1.0 - betan * betan);
+      Double_t tof0_err = sqrt(pow(fpl_err / cc, 2) + pow(980 * ch2ns_err, 2));
+      Double_t tof_err  = sqrt( pow(tdc[i] * ch2ns_err, 2) + pow(tof0_err, 2) );
+      Double_t betan_err = sqrt( pow( (fpl / (cc * tof * tof)) * tof_err , 2) + pow( (1.0 / (cc * tof)) * fpl_err , 2) );
+      Double_t gamman_err = betan / pow(1.0 - betan * betan, 3.0/2.0) * betan_err;
+      ref[i] = tp - (mn * gamman - mn);
+      ref_err[i] = mn * gamman_err;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double dt = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+  printf("%-8s %8.1f Mevents/s\n", "anaexec", nev*(double)nrep/dt/1e6);
+
+  const char *names[] = { "scalar", "avx2", "avx512" };
+  for (const char *name : names) {
+    KIN_FUNC f = kinselect(name);
+    if (!f) {
+      printf("%-8s not supported by this CPU\n", name);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int r=0; r<nrep; r++)
+      for (int i=0; i<nev; i+=kinblk)
+        f(kconst, kinblk, &tdc[i], &tofr[i], &tof[i], &ex[i], &ex_err[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    dt = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+    double dex = 0, derr = 0;
+    for (int i=0; i<nev; i++) {
+      dex  = std::max(dex,  fabs(ex[i] - ref[i]));
+      derr = std::max(derr, fabs(ex_err[i] - ref_err[i]));
+    }
+    printf("%-8s %8.1f Mevents/s   max |dEx| = %.2e MeV, max |dEx_err| = %.2e MeV\n",
+           name, nev*(double)nrep/dt/1e6, dex, derr);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int r=0; r<nrep; r++)
+    for (int i=0; i<nev; i+=kinblk)
+      kin_lut(kinlut, kconst, kinblk, &tdc[i], &tofr[i], &tof[i], &ex[i], &ex_err[i]);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+  printf("%-8s %8.1f Mevents/s   (see -l check for its deviation)\n", "lut", nev*(double)nrep/dt/1e6);
+  return 0;
+}
+
+// Maximum deviation of the lut of every group from the exact formulas, on a
+// grid of 64 dithered values per channel, over the TDC range of hTDC and all
+// channels
+int kinlutcheck(){
+  const int nd = 64;
+  struct { const char *name; int lo, hi; } range[] = { { "hTDC range", 200, 2048 }, { "all", 0, KIN_NCH } };
+  for (size_t k=0; k<groups.size()*2; k++) {
+    auto &g = range[k%2];
+    const KIN_CONST &kconst = groups[k/2].kconst;
+    const KIN_LUT   &kinlut = *groups[k/2].lut;
+    if (k%2 == 0 && groups.size() > 1) printf("group %s\n", groups[k/2].name.c_str());
+    double dex = 0, derr = 0;
+    int cex = -1, cerr = -1, nbad = 0;
+    for (int c=g.lo; c<g.hi; c++) {
+      double tdc[nd], r[nd], t[nd], ex[nd], err[nd], lex[nd], lerr[nd];
+      for (int j=0; j<nd; j++) tdc[j] = c + (j + 0.5)/nd - 0.5;
+      kin_scalar(kconst, nd, tdc, r, t, ex, err);
+      kin_lut(kinlut, kconst, nd, tdc, r, t, lex, lerr);
+      for (int j=0; j<nd; j++) {
+        if (!isfinite(ex[j]) || !isfinite(err[j])) { nbad++; continue; }  // beta >= 1
+        if (fabs(lex[j] - ex[j])   > dex)  { dex  = fabs(lex[j] - ex[j]);   cex  = c; }
+        if (fabs(lerr[j] - err[j]) > derr) { derr = fabs(lerr[j] - err[j]); cerr = c; }
+      }
+    }
+    printf("%-10s ch %4d..%4d : max |dEx| = %.2e MeV (ch %d), max |dEx_err| = %.2e MeV (ch %d)",
+           g.name, g.lo, g.hi-1, dex, cex, derr, cerr);
+    if (nbad) printf(", %d unphysical values skipped", nbad);
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,20 @@
+/*
+  Batched analysis of offline (-k)
+  anabatch() takes the place of anaexec and buffers the events; the
+  kinematics of a block go through one kernel of kinematics.h at once.
+  kinbench() and kinlutcheck() are -k bench and -l check.
+*/
+
+#ifndef __KINBATCH_H__
+#define __KINBATCH_H__
+
+#include "kinematics.h"
+
+extern KIN_FUNC kinfunc;       /* kernel picked with -k */
+
+int  anabatch(int event_size, const unsigned short *anabuff);
+void anabatchflush();
+int  kinbench();
+int  kinlutcheck();
+
+#endif /* __KINBATCH_H__ */
@@ -0,0 +1,176 @@
+/*
+  Batched TOF -> beta -> gamma -> Ex kernels
+  Same formulas as anaexec of analysis.cxx, for a block of dithered TDC
+  values at once:
+    tofr   = tof0 - tdc*ch2ns,   tof = tofr + trf
+    betan  = fpl/cc / tof,       gamman = 1/sqrt(1 - betan^2)
+    ex     = tp - mn*(gamman - 1)
+    ex_err = mn * betan * gamman^3 * betan_err     ( (1-b^2)^-3/2 = gamma^3 )
+  with betan_err from tof_err = sqrt((tdc*ch2ns_err)^2 + tof0_err^2) and fpl_err.
+  kin_avx2/kin_avx512 are compiled for their instruction set only and
+  must be picked at runtime with kinselect().
+  KIN_LUT holds ex and ex_err with their derivatives for every TDC channel;
+  kin_lut() evaluates a dithered value c+d as v(c) + v'(c)*d.
+*/
+
+#ifndef __KINEMATICS_H__
+#define __KINEMATICS_H__
+
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+
+typedef struct KIN_CONST {
+  double tof0, trf, ch2ns;   /* [ns], [ns], [ns/ch] */
+  double lc;                 /* fpl/cc : TOF of light over the flight path [ns] */
+  double mn, tp;             /* [MeV] */
+  double ch2ns_err;          /* [ns/ch] */
+  double tof0_err2;          /* tof0_err^2 [ns^2] */
+  double lc_err;             /* fpl_err/cc [ns] */
+} KIN_CONST;
+
+typedef void (*KIN_FUNC)(const KIN_CONST &k, int n, const double *tdc,
+                         double *tofr, double *tof, double *ex, double *ex_err);
+
+inline void kin_scalar(const KIN_CONST &k, int n, const double *tdc,
+                       double *tofr, double *tof, double *ex, double *ex_err){
+  for (int i=0; i<n; i++) {
+    double r   = k.tof0 - tdc[i]*k.ch2ns;
+    double t   = r + k.trf;
+    double it  = 1.0/t;
+    double b   = k.lc * it;
+    double g   = 1.0/sqrt(1.0 - b*b);
+    double te  = sqrt(tdc[i]*k.ch2ns_err*tdc[i]*k.ch2ns_err + k.tof0_err2);
+    double be1 = k.lc*it*it*te, be2 = k.lc_err*it;
+    double be  = sqrt(be1*be1 + be2*be2);
+    tofr[i]   = r;
+    tof[i]    = t;
+    ex[i]     = k.tp - (k.mn*g - k.mn);
+    ex_err[i] = k.mn * b*g*g*g * be;
+  }
+}
+
+__attribute__((target("avx2,fma")))
+inline void kin_avx2(const KIN_CONST &k, int n, const double *tdc,
+                     double *tofr, double *tof, double *ex, double *ex_err){
+  const __m256d tof0 = _mm256_set1_pd(k.tof0),  trf = _mm256_set1_pd(k.trf);
+  const __m256d ch2ns = _mm256_set1_pd(k.ch2ns), lc = _mm256_set1_pd(k.lc);
+  const __m256d mn = _mm256_set1_pd(k.mn),      tp = _mm256_set1_pd(k.tp);
+  const __m256d cerr = _mm256_set1_pd(k.ch2ns_err), t0e2 = _mm256_set1_pd(k.tof0_err2);
+  const __m256d lce = _mm256_set1_pd(k.lc_err),  one = _mm256_set1_pd(1.0);
+  int i=0;
+  for (; i+4<=n; i+=4) {
+    __m256d d   = _mm256_loadu_pd(tdc+i);
+    __m256d r   = _mm256_fnmadd_pd(d, ch2ns, tof0);
+    __m256d t   = _mm256_add_pd(r, trf);
+    __m256d it  = _mm256_div_pd(one, t);
+    __m256d b   = _mm256_mul_pd(lc, it);
+    __m256d g   = _mm256_div_pd(one, _mm256_sqrt_pd(_mm256_fnmadd_pd(b, b, one)));
+    __m256d dc  = _mm256_mul_pd(d, cerr);
+    __m256d te  = _mm256_sqrt_pd(_mm256_fmadd_pd(dc, dc, t0e2));
+    __m256d be1 = _mm256_mul_pd(_mm256_mul_pd(b, it), te);
+    __m256d be2 = _mm256_mul_pd(lce, it);
+    __m256d be  = _mm256_sqrt_pd(_mm256_fmadd_pd(be1, be1, _mm256_mul_pd(be2, be2)));
+    __m256d g3  = _mm256_mul_pd(_mm256_mul_pd(g, g), g);
+    _mm256_storeu_pd(tofr+i, r);
+    _mm256_storeu_pd(tof+i, t);
+    _mm256_storeu_pd(ex+i, _mm256_sub_pd(tp, _mm256_fmsub_pd(mn, g, mn)));
+    _mm256_storeu_pd(ex_err+i, _mm256_mul_pd(_mm256_mul_pd(mn, b), _mm256_mul_pd(g3, be)));
+  }
+  kin_scalar(k, n-i, tdc+i, tofr+i, tof+i, ex+i, ex_err+i);
+}
+
+/* the AVX-512 intrinsics of gcc 12 trip a false -Wmaybe-uninitialized */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline void kin_avx512(const KIN_CONST &k, int n, const double *tdc,
+                       double *tofr, double *tof, double *ex, double *ex_err){
+  const __m512d tof0 = _mm512_set1_pd(k.tof0),  trf = _mm512_set1_pd(k.trf);
+  const __m512d ch2ns = _mm512_set1_pd(k.ch2ns), lc = _mm512_set1_pd(k.lc);
+  const __m512d mn = _mm512_set1_pd(k.mn),      tp = _mm512_set1_pd(k.tp);
+  const __m512d cerr = _mm512_set1_pd(k.ch2ns_err), t0e2 = _mm512_set1_pd(k.tof0_err2);
+  const __m512d lce = _mm512_set1_pd(k.lc_err),  one = _mm512_set1_pd(1.0);
+  int i=0;
+  for (; i+8<=n; i+=8) {
+    __m512d d   = _mm512_loadu_pd(tdc+i);
+    __m512d r   = _mm512_fnmadd_pd(d, ch2ns, tof0);
+    __m512d t   = _mm512_add_pd(r, trf);
+    __m512d it  = _mm512_div_pd(one, t);
+    __m512d b   = _mm512_mul_pd(lc, it);
+    __m512d g   = _mm512_div_pd(one, _mm512_sqrt_pd(_mm512_fnmadd_pd(b, b, one)));
+    __m512d dc  = _mm512_mul_pd(d, cerr);
+    __m512d te  = _mm512_sqrt_pd(_mm512_fmadd_pd(dc, dc, t0e2));
+    __m512d be1 = _mm512_mul_pd(_mm512_mul_pd(b, it), te);
+    __m512d be2 = _mm512_mul_pd(lce, it);
+    __m512d be  = _mm512_sqrt_pd(_mm512_fmadd_pd(be1, be1, _mm512_mul_pd(be2, be2)));
+    __m512d g3  = _mm512_mul_pd(_mm512_mul_pd(g, g), g);
+    _mm512_storeu_pd(tofr+i, r);
+    _mm512_storeu_pd(tof+i, t);
+    _mm512_storeu_pd(ex+i, _mm512_sub_pd(tp, _mm512_fmsub_pd(mn, g, mn)));
+    _mm512_storeu_pd(ex_err+i, _mm512_mul_pd(_mm512_mul_pd(mn, b), _mm512_mul_pd(g3, be)));
+  }
+  kin_scalar(k, n-i, tdc+i, tofr+i, tof+i, ex+i, ex_err+i);
+}
+#pragma GCC diagnostic pop
+
+/* Per-channel tables of the 12-bit TDC */
+#define KIN_NCH  4096
+
+typedef struct KIN_LUT_ENTRY {
+  double ex, dex;            /* ex and d(ex)/d(tdc) at the channel [MeV], [MeV/ch] */
+  double err, derr;          /* ex_err and d(ex_err)/d(tdc)                        */
+} KIN_LUT_ENTRY;
+
+typedef struct KIN_LUT {
+  KIN_LUT_ENTRY ch[KIN_NCH];
+} KIN_LUT;
+
+/* Fill the tables from the exact formulas; derivatives by central
+   differences (step 1e-3 ch, well below the dither) */
+inline void kin_lutbuild(KIN_LUT &l, const KIN_CONST &k){
+  const double h = 1e-3;
+  for (int c=0; c<KIN_NCH; c++) {
+    double tdc[3] = { c - h, (double)c, c + h }, r[3], t[3], ex[3], err[3];
+    kin_scalar(k, 3, tdc, r, t, ex, err);
+    l.ch[c].ex   = ex[1];
+    l.ch[c].dex  = (ex[2] - ex[0]) / (2*h);
+    l.ch[c].err  = err[1];
+    l.ch[c].derr = (err[2] - err[0]) / (2*h);
+  }
+}
+
+/* Same outputs as kin_scalar; tdc outside the channels of the table falls
+   back to the exact formulas */
+inline void kin_lut(const KIN_LUT &l, const KIN_CONST &k, int n, const double *tdc,
+                    double *tofr, double *tof, double *ex, double *ex_err){
+  for (int i=0; i<n; i++) {
+    double c = floor(tdc[i] + 0.5);
+    if (!(c >= 0 && c < KIN_NCH)) {
+      kin_scalar(k, 1, tdc+i, tofr+i, tof+i, ex+i, ex_err+i);
+      continue;
+    }
+    const KIN_LUT_ENTRY &e = l.ch[(int)c];
+    double d  = tdc[i] - c;
+    tofr[i]   = k.tof0 - tdc[i]*k.ch2ns;
+    tof[i]    = tofr[i] + k.trf;
+    ex[i]     = e.ex  + e.dex *d;
+    ex_err[i] = e.err + e.derr*d;
+  }
+}
+
+/* Kernel by name ("scalar", "avx2", "avx512"); "auto" picks the widest one
+   the CPU supports. NULL if the CPU lacks the requested instruction set. */
+inline KIN_FUNC kinselect(const char *name, const char **picked = NULL){
+  bool avx512 = __builtin_cpu_supports("avx512f");
+  bool avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  const char *p = name;
+  if (!strcmp(name, "auto")) p = avx512 ? "avx512" : avx2 ? "avx2" : "scalar";
+  if (picked) *picked = p;
+  if (!strcmp(p, "scalar"))         return kin_scalar;
+  if (!strcmp(p, "avx2")   && avx2)   return kin_avx2;
+  if (!strcmp(p, "avx512") && avx512) return kin_avx512;
+  return NULL;
+}
+
+#endif /* __KINEMATICS_H__ */
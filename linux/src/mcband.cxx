@@ -0,0 +1,41 @@
+////////////////////////////////////////////////////
+// Offline Analyzer: Monte Carlo systematics (-t) //
+////////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <stdio.h>
+
+#include "analysis.h"
+#include "mcband.h"
+
+using namespace std;
+
+// ##### Monte Carlo systematics (-t) #####
+// Per bin of hEx of every group: the nominal content and, over the toys,
+// the mean, the rms and the 2.5, 16, 50, 84 and 97.5% quantiles, written
+// to [hist file]_sys.csv
+void mcend(){
+  string path = hfile->GetName();
+  if (path.size() > 5 && path.compare(path.size()-5, 5, ".part") == 0) path.erase(path.size()-5);
+  path = path.substr(0, path.find_last_of(".")) + "_sys.csv";
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    cerr << "cannot open " << path << "\n";
+    return;
+  }
+  const double q[5] = { 0.025, 0.16, 0.5, 0.84, 0.975 };
+  fprintf(fp, "group,bin,ex,nominal,mean,rms,q025,q16,q50,q84,q975\n");
+  for (size_t g=0; g<hgrp.size(); g++) {
+    hsel(g);
+    for (int b=1; b<=hEx->nb; b++) {
+      double mean, rms, qv[5];
+      mcbands(*hExSys, b, 5, q, &mean, &rms, qv);
+      fprintf(fp, "%s,%d,%g,%u,%g,%g,%g,%g,%g,%g,%g\n", groups[g].name.c_str(), b, hEx->GetBinCenter(b),
+              hEx->cnt[b], mean, rms, qv[0], qv[1], qv[2], qv[3], qv[4]);
+    }
+  }
+  hsel(0);
+  fclose(fp);
+  cout << "Systematics: " << mctoys << " toys of fpl, ch2ns, tdcg and tp -> " << path << "\n";
+}
@@ -0,0 +1,12 @@
+/*
+  Bands of the Monte Carlo systematics of offline (-t)
+  mcend() writes per bin of hEx of every group the nominal content and the
+  spread over the toys (mcsys.h) to [hist file]_sys.csv.
+*/
+
+#ifndef __MCBAND_H__
+#define __MCBAND_H__
+
+void mcend();
+
+#endif /* __MCBAND_H__ */
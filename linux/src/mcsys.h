@@ -0,0 +1,212 @@
+/*
+  Monte Carlo systematics of the Ex spectrum (-t)
+  K toys redraw the calibration constants of a group around their values,
+  each from a Gaussian of the group's spread:
+    fpl   (flight path)              fpl_sys   [m]
+    ch2ns (TDC conversion)           ch2ns_sys [ns/ch]
+    tdcg  (TDC of the gamma peak)    tdcg_sys  [ch]
+    tp    (proton energy, all groups the same draw)  tp_sys [MeV]
+  and every neutron event of the run is put into the Ex spectrum of every
+  toy, in the same pass as the nominal analysis: with
+    tof = A - tdc*B,  A = fpl/cc + tdcg*ch2ns + trf,  B = ch2ns,
+    ex  = tp - mn*(tof/sqrt(tof^2 - L^2) - 1),        L = fpl/cc
+  the constants of a toy are A, B, L and tp only, so a toy costs a few
+  vector operations per event (the same roundings in every kernel: fma
+  where the vector kernels fuse, so they all fill the same cells). The kernels evaluate 4 (AVX2) or 8
+  (AVX-512) toys per vector; pick one at runtime with mcselect().
+  The draws come from Philox (dither.h) with counter (toy, group) and the
+  run seed, so they are the same for any -j, chunking or run order.
+  HISTMC holds the K spectra (bins of hEx; the toys of a cell side by
+  side, as the toys of an event land in a few neighbouring cells) and is
+  merged like the other histograms; mcbands() gives per-bin bands.
+*/
+
+#ifndef __MCSYS_H__
+#define __MCSYS_H__
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "dither.h"
+#include "histo.h"
+
+typedef struct MC_TOYS {
+  int ntoy;
+  int stride;                       /* ntoy padded to a multiple of 8 */
+  std::vector<double> A, B, L, T;   /* per toy */
+  double mn;
+} MC_TOYS;
+
+/* Standard normal pair from two uniform words (Box-Muller) */
+inline void mc_gauss2(uint32_t u0, uint32_t u1, double *z0, double *z1){
+  double r = sqrt(-2.0*log((u0 + 0.5) * (1.0/4294967296.0)));
+  double a = 6.283185307179586 * (u1 + 0.5) * (1.0/4294967296.0);
+  *z0 = r*cos(a);
+  *z1 = r*sin(a);
+}
+
+/* Draw ntoy toys of group g (sys: fpl, ch2ns, tdcg, tp spreads) */
+inline void mc_draw(MC_TOYS &m, int ntoy, uint64_t seed, uint32_t g,
+                    double fpl, double ch2ns, double tdcg, double tp, double cc, double trf, double mn,
+                    const double sys[4]){
+  int n = (ntoy + 7) & ~7;
+  m.ntoy   = ntoy;
+  m.stride = n;
+  m.mn     = mn;
+  m.A.assign(n, 0.0);  m.B.assign(n, 0.0);  m.L.assign(n, 0.0);  m.T.assign(n, 0.0);
+  for (int t=0; t<n; t++) {
+    uint32_t ctr[4] = { (uint32_t)t, g, 0x4d43u, 0 }, u[4];
+    uint32_t ctp[4] = { (uint32_t)t, 0xffffffffu, 0x4d43u, 0 }, v[4];
+    philox4x32(ctr, seed, u);
+    philox4x32(ctp, seed, v);
+    double z[4], zt, dummy;
+    mc_gauss2(u[0], u[1], &z[0], &z[1]);
+    mc_gauss2(u[2], u[3], &z[2], &dummy);
+    mc_gauss2(v[0], v[1], &zt, &dummy);
+    /* padding toys are the nominal constants, never filled */
+    if (t >= ntoy) z[0] = z[1] = z[2] = zt = 0;
+    double f  = fpl   + sys[0]*z[0];
+    double c  = ch2ns + sys[1]*z[1];
+    double tg = tdcg  + sys[2]*z[2];
+    m.L[t] = f/cc;
+    m.B[t] = c;
+    m.A[t] = f/cc + tg*c + trf;
+    m.T[t] = tp + sys[3]*zt;
+  }
+}
+
+typedef void (*MC_FUNC)(const MC_TOYS &m, double tdc, unsigned int *cnt, int nb, double xmin, double scale);
+
+/* Fill tdc into cnt[cell*stride + t] for every toy t; the cell is that of
+   hbin (under/overflow, NaN to the overflow) but found with a multiply by
+   scale, so ex within rounding of a bin edge may land in the next bin */
+inline void mc_scalar(const MC_TOYS &m, double tdc, unsigned int *cnt, int nb, double xmin, double scale){
+  for (int t=0; t<m.ntoy; t++) {
+    double tof = fma(-tdc, m.B[t], m.A[t]);
+    double g   = tof / sqrt(fma(-m.L[t], m.L[t], tof*tof));
+    double ex  = fma(-m.mn, g - 1.0, m.T[t]);
+    double y   = std::max(std::min((ex - xmin)*scale, (double)nb), -1.0);
+    if (std::isnan(ex)) y = nb;
+    cnt[((int)floor(y) + 1)*m.stride + t]++;
+  }
+}
+
+__attribute__((target("avx2,fma")))
+inline void mc_avx2(const MC_TOYS &m, double tdc, unsigned int *cnt, int nb, double xmin, double scale){
+  const __m256d d = _mm256_set1_pd(tdc), one = _mm256_set1_pd(1.0), mn = _mm256_set1_pd(m.mn);
+  const __m256d x0 = _mm256_set1_pd(xmin), sc = _mm256_set1_pd(scale);
+  const __m256d top = _mm256_set1_pd(nb), bot = _mm256_set1_pd(-1.0);
+  const int row = m.stride;
+  alignas(16) int c[4];
+  /* the rows are padded to 8 toys, the lanes past ntoy are not counted */
+  for (int t=0; t<m.ntoy; t+=4) {
+    __m256d tof = _mm256_fnmadd_pd(d, _mm256_loadu_pd(&m.B[t]), _mm256_loadu_pd(&m.A[t]));
+    __m256d l   = _mm256_loadu_pd(&m.L[t]);
+    __m256d g   = _mm256_div_pd(tof, _mm256_sqrt_pd(_mm256_fnmadd_pd(l, l, _mm256_mul_pd(tof, tof))));
+    __m256d ex  = _mm256_fnmadd_pd(mn, _mm256_sub_pd(g, one), _mm256_loadu_pd(&m.T[t]));
+    /* min first: NaN takes the second operand, the overflow */
+    __m256d y   = _mm256_max_pd(_mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(ex, x0), sc), top), bot);
+    _mm_store_si128((__m128i *)c, _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_floor_pd(y), one)));
+    if (t + 4 <= m.ntoy) {
+      cnt[c[0]*row + t  ]++;
+      cnt[c[1]*row + t+1]++;
+      cnt[c[2]*row + t+2]++;
+      cnt[c[3]*row + t+3]++;
+    } else {
+      for (int i=0; t+i<m.ntoy; i++) cnt[c[i]*row + t+i]++;
+    }
+  }
+}
+
+/* the AVX-512 intrinsics of gcc 12 trip a false -Wmaybe-uninitialized */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline void mc_avx512(const MC_TOYS &m, double tdc, unsigned int *cnt, int nb, double xmin, double scale){
+  const __m512d d = _mm512_set1_pd(tdc), one = _mm512_set1_pd(1.0), mn = _mm512_set1_pd(m.mn);
+  const __m512d x0 = _mm512_set1_pd(xmin), sc = _mm512_set1_pd(scale);
+  const __m512d top = _mm512_set1_pd(nb), bot = _mm512_set1_pd(-1.0);
+  const int row = m.stride;
+  alignas(32) int c[8];
+  /* the rows are padded to 8 toys, the lanes past ntoy are not counted */
+  for (int t=0; t<m.ntoy; t+=8) {
+    __m512d tof = _mm512_fnmadd_pd(d, _mm512_loadu_pd(&m.B[t]), _mm512_loadu_pd(&m.A[t]));
+    __m512d l   = _mm512_loadu_pd(&m.L[t]);
+    __m512d g   = _mm512_div_pd(tof, _mm512_sqrt_pd(_mm512_fnmadd_pd(l, l, _mm512_mul_pd(tof, tof))));
+    __m512d ex  = _mm512_fnmadd_pd(mn, _mm512_sub_pd(g, one), _mm512_loadu_pd(&m.T[t]));
+    /* min first: NaN takes the second operand, the overflow */
+    __m512d y   = _mm512_max_pd(_mm512_min_pd(_mm512_mul_pd(_mm512_sub_pd(ex, x0), sc), top), bot);
+    y = _mm512_roundscale_pd(y, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    _mm256_store_si256((__m256i *)c, _mm512_cvttpd_epi32(_mm512_add_pd(y, one)));
+    int n = std::min(8, m.ntoy - t);
+    for (int i=0; i<n; i++) cnt[c[i]*row + t+i]++;
+  }
+}
+#pragma GCC diagnostic pop
+
+/* "auto", "avx512", "avx2" or "scalar"; NULL if not available */
+inline MC_FUNC mcselect(const char *name, const char **picked = NULL){
+  bool avx512 = __builtin_cpu_supports("avx512f");
+  bool avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  const char *p = name;
+  if (!strcmp(name, "auto")) p = avx512 ? "avx512" : avx2 ? "avx2" : "scalar";
+  if (picked) *picked = p;
+  if (!strcmp(p, "scalar"))         return mc_scalar;
+  if (!strcmp(p, "avx2")   && avx2)   return mc_avx2;
+  if (!strcmp(p, "avx512") && avx512) return mc_avx512;
+  return NULL;
+}
+
+/* The K toy spectra of a group, binned as the HIST1 h (no ROOT histogram) */
+struct HISTMC : HIST {
+  const MC_TOYS *toys;
+  MC_FUNC func;
+  int    nb;
+  double xmin, scale;
+  std::vector<unsigned int> cnt;   /* [cell 0..nb+1][toy], toys padded to stride */
+
+  HISTMC(const MC_TOYS *m, MC_FUNC f, const HIST1 &h)
+    : toys(m), func(f), nb(h.nb), xmin(h.xmin), scale(h.scale), cnt((size_t)m->stride*(nb+2), 0) {}
+  inline void Fill(double tdc){
+    entries++;
+    func(*toys, tdc, cnt.data(), nb, xmin, scale);
+  }
+  HIST *clone() const {
+    HISTMC *c = new HISTMC(*this);
+    std::fill(c->cnt.begin(), c->cnt.end(), 0);
+    c->entries = 0;
+    return c;
+  }
+  void add(const HIST &h){
+    const HISTMC &o = (const HISTMC &)h;
+    for (size_t k=0; k<cnt.size(); k++) cnt[k] += o.cnt[k];
+    entries += o.entries;
+  }
+  void hexport(){}
+};
+
+/* Bands of cell b over the toys: mean, rms and the quantiles q[] (0..1) */
+inline void mcbands(const HISTMC &h, int b, int nq, const double *q, double *mean, double *rms, double *qv){
+  int K = h.toys->ntoy;
+  std::vector<unsigned int> v(K);
+  double s = 0, s2 = 0;
+  for (int t=0; t<K; t++) {
+    v[t] = h.cnt[(size_t)b*h.toys->stride + t];
+    s  += v[t];
+    s2 += (double)v[t]*v[t];
+  }
+  *mean = s/K;
+  *rms  = K > 1 ? sqrt(std::max(0.0, (s2 - s*s/K)/(K - 1))) : 0;
+  std::sort(v.begin(), v.end());
+  for (int k=0; k<nq; k++) {
+    /* linear interpolation between order statistics */
+    double x = q[k]*(K - 1);
+    int i = std::min((int)x, K - 1), j = std::min(i + 1, K - 1);
+    qv[k] = v[i] + (x - i)*((double)v[j] - v[i]);
+  }
+}
+
+#endif /* __MCSYS_H__ */
@@ -0,0 +1,419 @@
+///////////////////////////////////////////////////
+// Synthetic NGDRV data for the offline analyzer //
+///////////////////////////////////////////////////
+
+// Writes runs of any size in the framing offline reads (2-byte nbyte
+// header, payload words, NGDRV_DELIM, NGDRV_EOF at the end), with events
+// sampled from the histograms of analysed runs (hst/*.root):
+//   (TDC, QDC)  from hTDCQDC,
+//   QDCt        from the QDC column of hQDC2,
+// and the channel inside every bin from the 1 ch spectra hTDC, hQDC and
+// hQDCt. Groups A (words 0, 2, 3) and B (words 1, 4, 5) are independent
+// draws from the same distributions.
+// The draws of event i come from Philox (dither.h) with counter i and the
+// seed, so a given (model, seed, size) gives the same file for any -j.
+
+/* headers for standard I/O */
+#include <iostream>
+
+/* headers for ROOT */
+#include <TFile.h>
+#include <TH1.h>
+#include <TH2.h>
+#include <TKey.h>
+#include <TList.h>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+/* headers for DAQ System */
+#include "ngdrvcommon.h"
+#include "dither.h"
+
+using namespace std;
+
+const int      chmax  = 4095;          // largest channel of the 12-bit ADCs
+const int      evbyte = 16;            // nbyte of an event: header, 6 words, delimiter
+const int      shbyte = 6;             // nbyte of a short event (-x): header, word 0, delimiter
+const long long genblk = 1<<16;        // events per task
+const uint32_t gentag = 0x6e67656e;    // counter word 3, keeps the draws apart from the dithering
+
+// Binned distribution: contents of all cells, in ROOT order (x fastest,
+// under/overflow included), summed over the hst files
+struct AXIS {
+  int    nb;
+  double lo, hi;
+};
+struct DIST {
+  string name;
+  AXIS   x, y;                         // y.nb = 0 for 1D
+  vector<double> c;
+  int ncx() const { return x.nb + 2; }
+};
+
+// Histogram name of f: name itself or a key ending with it (hTDC is
+// prefixed with the target name)
+TH1 *findhist(TFile *f, string name){
+  TH1 *h = dynamic_cast<TH1 *>(f->Get(name.c_str()));
+  if (h) return h;
+  TIter next(f->GetListOfKeys());
+  TKey *k;
+  while ((k = (TKey *)next())) {
+    string n = k->GetName();
+    if (n.size() > name.size() && n.compare(n.size()-name.size(), name.size(), name) == 0)
+      return dynamic_cast<TH1 *>(k->ReadObj());
+  }
+  return 0;
+}
+
+// Add the contents of histogram d.name of f into d; false if missing or
+// binned differently from the files before
+bool adddist(TFile *f, DIST &d, int dim){
+  TH1 *h = findhist(f, d.name);
+  if (!h || h->GetDimension() != dim) return false;
+  AXIS x = { h->GetNbinsX(), h->GetXaxis()->GetXmin(), h->GetXaxis()->GetXmax() };
+  AXIS y = { 0, 0, 0 };
+  if (dim == 2) y = { h->GetNbinsY(), h->GetYaxis()->GetXmin(), h->GetYaxis()->GetXmax() };
+  if (d.c.empty()) {
+    d.x = x;  d.y = y;
+    d.c.assign((size_t)(x.nb+2) * (y.nb+2), 0.0);
+  } else if (x.nb != d.x.nb || x.lo != d.x.lo || x.hi != d.x.hi ||
+             y.nb != d.y.nb || y.lo != d.y.lo || y.hi != d.y.hi) {
+    return false;
+  }
+  for (int by=0; by<y.nb+2; by++)
+    for (int bx=0; bx<x.nb+2; bx++) {
+      double v = dim == 2 ? h->GetBinContent(bx, by) : h->GetBinContent(bx);
+      d.c[(size_t)by*(x.nb+2) + bx] += std::max(v, 0.0);
+    }
+  return true;
+}
+
+// Bin of x on axis a, like TAxis::FindFixBin
+int axisbin(const AXIS &a, double x){
+  if (x < a.lo)    return 0;
+  if (!(x < a.hi)) return a.nb + 1;
+  return std::min(a.nb, 1 + (int)((x - a.lo) * a.nb / (a.hi - a.lo)));
+}
+
+// Walker's alias method (Vose's construction): one draw of a cell out of
+// any number in O(1), from two 32-bit random words. Only the non-empty
+// cells get a slot, so a mostly empty 2D histogram stays small in cache.
+struct ALIAS {
+  struct SLOT {
+    float    prob;                     // keep the cell of the slot if below
+    uint32_t self, alias;              // cells
+  };
+  vector<SLOT> slot;
+  bool empty() const { return slot.empty(); }
+  void build(const vector<double> &w){
+    vector<uint32_t> cell;
+    double sum = 0;
+    for (size_t i=0; i<w.size(); i++)
+      if (w[i] > 0) { cell.push_back(i); sum += w[i]; }
+    size_t n = cell.size();
+    vector<double>   prob(n);
+    vector<uint32_t> alias(n), small, large;
+    for (size_t k=0; k<n; k++) {
+      prob[k] = w[cell[k]] * n / sum;
+      alias[k] = k;
+      (prob[k] < 1.0 ? small : large).push_back(k);
+    }
+    while (!small.empty() && !large.empty()) {
+      uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      alias[s] = l;
+      prob[l] -= 1.0 - prob[s];
+      if (prob[l] < 1.0) { large.pop_back(); small.push_back(l); }
+    }
+    for (uint32_t k : small) prob[k] = 1.0;  // rounding leftovers
+    for (uint32_t k : large) prob[k] = 1.0;
+    slot.resize(n);
+    for (size_t k=0; k<n; k++) slot[k] = { (float)prob[k], cell[k], cell[alias[k]] };
+  }
+  uint32_t draw(uint32_t u0, uint32_t u1) const {
+    const SLOT &s = slot[((uint64_t)u0 * slot.size()) >> 32];
+    return (u1 >> 8) * (1.0f/16777216.0f) < s.prob ? s.self : s.alias;
+  }
+};
+
+// Raw channels of the bins of an axis. After dithering, channel c lands
+// anywhere in [c-0.5, c+0.5), so it belongs to a bin in proportion to the
+// overlap. Where the 1 ch spectrum covers the bin the overlap is weighted
+// with the spectrum around c, 0.5*(F[c-1,c) + F[c,c+1)).
+// Underflow is channel 0, overflow chmax.
+struct CHAN {
+  vector<int>   c0;                    // first channel of every cell
+  vector<int>   off;                   // its weights: cdf[off[b] .. off[b+1])
+  vector<float> cdf;                   // cumulative weights of c0, c0+1, ...
+  int draw(int b, uint32_t u) const {
+    const float *f = &cdf[off[b]];
+    int n = off[b+1] - off[b], k = 0;
+    float t = (u >> 8) * (1.0f/16777216.0f) * f[n-1];
+    while (k < n-1 && f[k] <= t) k++;
+    return c0[b] + k;
+  }
+};
+
+void chanbuild(CHAN &s, const AXIS &a, const DIST &fine){
+  s.c0.assign(a.nb+2, 0);
+  s.c0[a.nb+1] = chmax;
+  s.off.assign(1, 0);
+  s.cdf.assign(1, 1.0f);               // underflow
+  double bw = (a.hi - a.lo) / a.nb;
+  for (int b=1; b<=a.nb; b++) {
+    double lo = a.lo + (b-1)*bw, hi = lo + bw;
+    int cl = std::max(0, (int)ceil(lo - 0.5)), ch = std::min(chmax, (int)ceil(hi + 0.5) - 1);
+    if (ch < cl) ch = cl;
+    bool infine = cl - 0.5 >= fine.x.lo && ch + 0.5 < fine.x.hi;
+    vector<double> w;
+    double sum = 0;
+    for (int c=cl; c<=ch; c++) {
+      double ov = std::max(0.0, std::min(c + 0.5, hi) - std::max(c - 0.5, lo));
+      if (infine) ov *= 0.5*(fine.c[axisbin(fine.x, c - 0.5)] + fine.c[axisbin(fine.x, c + 0.5)]);
+      w.push_back(ov);
+      sum += ov;
+    }
+    if (!(sum > 0))   // empty around here: overlap only
+      for (int c=cl; c<=ch; c++) w[c-cl] = std::max(0.0, std::min(c + 0.5, hi) - std::max(c - 0.5, lo));
+    s.c0[b] = cl;
+    s.off.push_back(s.cdf.size());
+    sum = 0;
+    for (double v : w) s.cdf.push_back(sum += v);
+  }
+  s.off.push_back(s.cdf.size());
+  s.cdf.push_back(1.0f);               // overflow
+  s.off.push_back(s.cdf.size());
+}
+
+// The model every event is drawn from
+DIST  dtq  = { "hTDCQDC" }, dqq = { "hQDC2" };
+DIST  dtdc = { "hTDC" }, dqdc = { "hQDC" }, dqdct = { "hQDCt" };
+ALIAS acell;                           // (TDC, QDC) cells of hTDCQDC
+vector<ALIAS> aqdct;                   // QDCt cells of hQDC2 per QDC bin (last: all QDC)
+vector<const ALIAS *> qdccol;          // the one to use for every QDC channel
+CHAN  ctdc, cqdc, cqdct;
+unsigned long long seed = 1;
+
+bool modelbuild(const vector<string> &files){
+  int nused = 0;
+  for (const string &fn : files) {
+    TFile *f = TFile::Open(fn.c_str());
+    if (!f) {
+      cerr << "cannot open " << fn << ", skipped\n";
+      continue;
+    }
+    vector<DIST> save = { dtq, dqq, dtdc, dqdc, dqdct };
+    if (adddist(f, dtq, 2) && adddist(f, dqq, 2) && adddist(f, dtdc, 1) &&
+        adddist(f, dqdc, 1) && adddist(f, dqdct, 1)) {
+      nused++;
+    } else {
+      cerr << fn << ": histograms missing or binned differently, skipped\n";
+      dtq = save[0];  dqq = save[1];  dtdc = save[2];  dqdc = save[3];  dqdct = save[4];
+    }
+    delete f;
+  }
+  if (nused == 0) return false;
+
+  acell.build(dtq.c);
+  if (acell.empty()) return false;
+  int nqx = dqq.ncx(), nqy = dqq.y.nb + 2;
+  aqdct.resize(nqx + 1);
+  vector<double> col(nqy), all(nqy, 0.0);
+  for (int bx=0; bx<nqx; bx++) {
+    for (int by=0; by<nqy; by++) {
+      col[by] = dqq.c[(size_t)by*nqx + bx];
+      all[by] += col[by];
+    }
+    aqdct[bx].build(col);
+  }
+  aqdct[nqx].build(all);
+  if (aqdct[nqx].empty()) return false;
+  for (int c=0; c<=chmax; c++) {
+    const ALIAS *a = &aqdct[axisbin(dqq.x, c)];
+    qdccol.push_back(a->empty() ? &aqdct[nqx] : a);
+  }
+  chanbuild(ctdc,  dtq.x, dtdc);
+  chanbuild(cqdc,  dtq.y, dqdc);
+  chanbuild(cqdct, dqq.y, dqdct);
+
+  double n = 0;
+  for (double v : dtq.c) n += v;
+  cout << "Model: " << nused << " of " << files.size() << " hst files, " << (long long)n << " events in hTDCQDC\n";
+  return true;
+}
+
+// TDC, QDC, QDCt of one detector from 7 random words
+inline void genevent(const uint32_t *u, unsigned short *tdc, unsigned short *qdc, unsigned short *qdct){
+  uint32_t cell = acell.draw(u[0], u[1]);
+  int nx = dtq.ncx();
+  *tdc = ctdc.draw(cell % nx, u[2]);
+  *qdc = cqdc.draw(cell / nx, u[3]);
+  int by = qdccol[*qdc]->draw(u[4], u[5]);
+  *qdct = cqdct.draw(by, u[6]);
+}
+
+// Every shortk-th event is short (-x, 0: none)
+long long shortk = 0;
+
+// Offset in the file of event i
+long long evoff(long long i){
+  return i*evbyte - (shortk ? i/shortk*(evbyte - shbyte) : 0);
+}
+
+// Events [i0, i0+n) into buf. The 4 Philox blocks of 64 events are
+// computed side by side (as in dither_batch) so the rounds vectorise.
+void genrange(long long i0, long long n, unsigned char *buf){
+  const int nlane = 64;
+  uint32_t c[4][4][nlane];             // [block][word][event]
+  for (long long j0=0; j0<n; j0+=nlane) {
+    int m = std::min<long long>(nlane, n - j0);
+    for (uint32_t blk=0; blk<4; blk++) {
+      uint32_t *c0 = c[blk][0], *c1 = c[blk][1], *c2 = c[blk][2], *c3 = c[blk][3];
+      for (int j=0; j<nlane; j++) {
+        unsigned long long e = i0 + j0 + j;
+        c0[j] = (uint32_t)e;  c1[j] = (uint32_t)(e >> 32);  c2[j] = blk;  c3[j] = gentag;
+      }
+      uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+      for (int r=0; r<10; r++) {
+        for (int j=0; j<nlane; j++) {
+          uint64_t p0 = (uint64_t)PHILOX_M0 * c0[j];
+          uint64_t p1 = (uint64_t)PHILOX_M1 * c2[j];
+          c0[j] = (uint32_t)(p1 >> 32) ^ c1[j] ^ k0;  c1[j] = (uint32_t)p1;
+          c2[j] = (uint32_t)(p0 >> 32) ^ c3[j] ^ k1;  c3[j] = (uint32_t)p0;
+        }
+        k0 += PHILOX_W0;  k1 += PHILOX_W1;
+      }
+    }
+    for (int j=0; j<m; j++) {
+      uint32_t u[16];
+      for (int k=0; k<16; k++) u[k] = c[k/4][k%4][j];
+      unsigned short ev[8];
+      ev[0] = evbyte;
+      genevent(u,     &ev[1], &ev[3], &ev[4]);   // Group A: words 0, 2, 3
+      genevent(u + 8, &ev[2], &ev[5], &ev[6]);   // Group B: words 1, 4, 5
+      ev[7] = NGDRV_DELIM;
+      long long e = i0 + j0 + j;
+      if (shortk && e % shortk == shortk-1) {
+        ev[0] = shbyte;
+        ev[2] = NGDRV_DELIM;
+      }
+      memcpy(buf + evoff(e) - evoff(i0), ev, ev[0]);
+    }
+  }
+}
+
+double nowsec(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+// "10G" -> bytes (k, M, G, T: powers of 1024)
+long long parsesize(const char *s){
+  char *e;
+  double v = strtod(s, &e);
+  const char *u = "kMGT";
+  const char *p = *e ? strchr(u, *e) : 0;
+  if (*e && (!p || e[1])) return -1;
+  if (p) v *= (double)(1LL << (10*(p - u + 1)));
+  return (long long)v;
+}
+
+int main(int argc, char *argv[]){
+  long long nevent = 1000000;  // -n : number of events
+  long long size = 0;          // -s : file size instead
+  int nthread = thread::hardware_concurrency();  // -j
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:S:j:x:")) != -1) {
+    switch (opt) {
+    case 'n': nevent = atoll(optarg); break;
+    case 's': size = parsesize(optarg); if (size < evbyte) argc = 0; break;
+    case 'S': seed = strtoull(optarg, 0, 0); break;
+    case 'j': nthread = atoi(optarg); break;
+    case 'x': shortk = atoll(optarg); if (shortk < 0) argc = 0; break;
+    default:  argc = 0; break;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
+  // Usage
+  if (argc < 3 || nevent <= 0) {
+    cout << "Usage: ngdrvgen [-n events | -s size] [-S seed] [-j N] [-x k] [data file] [hist file ...]\n";
+    cout << "  -n events : number of events (default 1000000)\n";
+    cout << "  -s size   : as many events as fit in size bytes (suffix k, M, G, T)\n";
+    cout << "  -S seed   : seed of the draws (default 1); the same seed gives the same file\n";
+    cout << "  -j N      : generate with N threads\n";
+    cout << "  -x k      : every k-th event short, its first word only (" << shbyte << " bytes)\n";
+    cout << "  events are drawn from hTDCQDC, hQDC2, hTDC, hQDC and hQDCt of the hist files\n";
+    exit(0);
+  }
+  if (size > 0) nevent = (size - 2) / evbyte;
+  nthread = std::max(nthread, 1);
+
+  vector<string> files(argv + 2, argv + argc);
+  if (!modelbuild(files)) {
+    cerr << "no usable histograms in the hist files\n";
+    return 2;
+  }
+
+  int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    cerr << "cannot open " << argv[1] << "\n";
+    return 2;
+  }
+  long long nbyte = evoff(nevent) + 2;
+  cout << "Output File : " << argv[1] << " (" << nevent << " events, " << nbyte << " bytes, seed " << seed << ")\n";
+
+  // blocks of genblk events, written in place by nthread workers
+  long long ntask = (nevent + genblk - 1) / genblk;
+  atomic<long long> next(0), done(0);
+  atomic<bool> failed(false);
+  double t0 = nowsec();
+  vector<thread> workers;
+  for (int w=0; w<nthread; w++) {
+    workers.emplace_back([&]{
+      vector<unsigned char> buf(genblk*evbyte);
+      long long t;
+      while ((t = next++) < ntask && !failed) {
+        long long i0 = t*genblk, n = std::min(genblk, nevent - i0);
+        genrange(i0, n, buf.data());
+        size_t len = evoff(i0+n) - evoff(i0), off = 0;
+        while (off < len) {
+          ssize_t r = pwrite(fd, buf.data() + off, len - off, evoff(i0) + off);
+          if (r <= 0) { failed = true; break; }
+          off += r;
+        }
+        done += n;
+      }
+    });
+  }
+  while (done < nevent && !failed) {
+    usleep(200000);
+    printf("\r Event:%lld (%4.1f%%)", (long long)done, done*100.0/nevent);
+    fflush(stdout);
+  }
+  for (auto &t : workers) t.join();
+  unsigned short eof = NGDRV_EOF;
+  if (failed || pwrite(fd, &eof, 2, evoff(nevent)) != 2) {
+    cerr << "\nwrite error on " << argv[1] << "\n";
+    return 2;
+  }
+  close(fd);
+  double dt = nowsec() - t0;
+  printf("\r Event:%lld (100.0%%)\n", nevent);
+  printf("%lld events in %.2f s: %.1f Mevents/s, %.1f MB/s, %d threads\n",
+         nevent, dt, nevent/dt/1e6, nbyte/dt/1e6, nthread);
+  return 0;
+}
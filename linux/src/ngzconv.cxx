@@ -0,0 +1,319 @@
+//////////////////////////////////////////////
+// NGDRV data file <-> compressed run (.ngz) //
+//////////////////////////////////////////////
+
+// Cuts a data file at event boundaries into blocks of about -b bytes and
+// compresses every block on its own (zstd or lz4, see ngzfile.h), with -j
+// threads. The blocks are written in order, then the block index; the
+// result is read back and compared with the data file block by block
+// before ngzconv reports success (-n skips that).
+// A truncated last event stays in the block of the event before it, and
+// NGDRV_EOF with anything after it goes to a last block of its own, so
+// offline gets the same events (with the same indices) from both files.
+// -x expands a compressed run back into the data file.
+
+/* headers for standard I/O */
+#include <iostream>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+/* headers for DAQ System */
+#include "ngdrvcommon.h"
+#define USE_NGZ                  // the codecs of ngzfile.h, always needed here
+#include "ngzfile.h"
+#include "framing.h"
+
+using namespace std;
+
+double nowsec(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+// "4M" -> bytes (k, M, G: powers of 1024)
+long long parsesize(const char *s){
+  char *e;
+  double v = strtod(s, &e);
+  const char *u = "kMG";
+  const char *p = *e ? strchr(u, *e) : 0;
+  if (*e && (!p || e[1])) return -1;
+  if (p) v *= (double)(1LL << (10*(p - u + 1)));
+  return (long long)v;
+}
+
+bool writeall(int fd, const void *buf, size_t len, off_t off){
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t r = pwrite(fd, p, len, off);
+    if (r <= 0) return false;
+    p += r; len -= r; off += r;
+  }
+  return true;
+}
+
+// Block boundaries of [base, base+size): blocks of whole events of about
+// blksize bytes, with nbyte set for blocks of one event length. Corrupt
+// bytes (framesync) stay in the block before the event they end at.
+vector<NGZ_BLOCK> splitblocks(const unsigned char *base, long long size, long long blksize,
+                              FRAME_STATS &st){
+  vector<NGZ_BLOCK> blk;
+  NGZ_BLOCK b = {};
+  long long stride = -1;  // event length in b, 0 if mixed
+  long long n = 0;
+  const unsigned char *p = base, *end = base + size;
+  auto close = [&](const unsigned char *q){
+    b.rawsize = q - base - b.rawoff;
+    b.nbyte   = stride > 0 && stride < 0x10000 ? stride : 0;
+    blk.push_back(b);
+    b = NGZ_BLOCK();
+    b.rawoff = q - base;
+    b.first  = n;
+    stride   = -1;
+  };
+  unsigned short nbyte;
+  while (end - p >= 2) {
+    const unsigned char *q = framesync(p, end, true, &st);
+    if (q != p) stride = 0;
+    p = q;
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF) break;
+    if (end - p < nbyte) {
+      // truncated tail: offline fills it up from the event before
+      b.nevent++;
+      n++;
+      stride = 0;
+      p = end;
+      break;
+    }
+    if (b.nevent > 0 && p - base - b.rawoff + nbyte > blksize) close(p);
+    stride = (stride == -1 || stride == nbyte) ? nbyte : 0;
+    b.nevent++;
+    n++;
+    p += nbyte;
+  }
+  if (b.nevent > 0) close(p);
+  if (p < end) {
+    // NGDRV_EOF (or an odd byte) and what follows
+    stride = 0;
+    close(end);
+  }
+  return blk;
+}
+
+// Compress a data file into a compressed run
+int compress(const char *in, const char *out, int codec, int level, long long blksize, int nthread, bool verify){
+  int fd = open(in, O_RDONLY);
+  if (fd == -1) {
+    cerr << "cannot open " << in << "\n";
+    return 2;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  long long size = st.st_size;
+  if (ngzis(fd)) {
+    cerr << in << " is compressed already\n";
+    return 2;
+  }
+  void *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  if (map == MAP_FAILED) {
+    cerr << "cannot map " << in << "\n";
+    return 2;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  close(fd);
+  const unsigned char *base = (const unsigned char *)map;
+
+  double t0 = nowsec();
+  FRAME_STATS skipped = {};
+  vector<NGZ_BLOCK> blk = splitblocks(base, size, blksize, skipped);
+  if (skipped.nresync)
+    printf("Corrupt framing at %llu places: %llu bytes (about %llu events) skipped by offline, kept here\n",
+           skipped.nresync, skipped.nbyte, skipped.nevent);
+  NGZ_HEADER h = {};
+  h.magic   = NGZ_MAGIC;
+  h.codec   = codec;
+  h.nblock  = blk.size();
+  h.rawsize = size;
+  for (const NGZ_BLOCK &b : blk) h.nevent += b.nevent;
+
+  int fo = open(out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fo == -1) {
+    cerr << "cannot open " << out << "\n";
+    return 2;
+  }
+
+  // rounds of nthread*4 blocks: compressed in parallel, written in order
+  const size_t round = nthread*4;
+  vector<vector<unsigned char> > cbuf(round);
+  long long off = sizeof(h);
+  bool failed = false;
+  for (size_t b0=0; b0<blk.size() && !failed; b0+=round) {
+    size_t nb = std::min(round, blk.size() - b0);
+    atomic<size_t> next(0);
+    atomic<bool> bad(false);
+    vector<thread> workers;
+    for (int w=0; w<nthread; w++) {
+      workers.emplace_back([&]{
+        size_t k;
+        while ((k = next++) < nb) {
+          NGZ_BLOCK &b = blk[b0+k];
+          if (!ngzpack(codec, level, base + b.rawoff, b.rawsize, b.nbyte, cbuf[k], b)) bad = true;
+        }
+      });
+    }
+    for (auto &t : workers) t.join();
+    for (size_t k=0; k<nb && !bad; k++) {
+      blk[b0+k].off = off;
+      if (!writeall(fo, cbuf[k].data(), cbuf[k].size(), off)) bad = true;
+      off += cbuf[k].size();
+    }
+    failed = bad;
+    printf("\r Block:%zu/%zu (%4.1f%%)", b0+nb, blk.size(), (b0+nb)*100.0/blk.size());
+    fflush(stdout);
+  }
+  h.index = off;
+  if (failed || !writeall(fo, blk.data(), blk.size()*sizeof(NGZ_BLOCK), off) ||
+      !writeall(fo, &h, sizeof(h), 0)) {
+    cerr << "\ncompression or write error on " << out << "\n";
+    return 2;
+  }
+  long long csize = off + blk.size()*sizeof(NGZ_BLOCK);
+  double dt = nowsec() - t0;
+  printf("\r%lld events, %lld -> %lld bytes (%.2fx) in %zu blocks, %.2f s: %.1f MB/s, %d threads\n",
+         (long long)h.nevent, size, csize, csize ? (double)size/csize : 0.0, blk.size(), dt, size/dt/1e6, nthread);
+
+  if (verify) {
+    NGZ_FILE z;
+    if (!ngzopen(z, fo)) {
+      cerr << "cannot read back " << out << "\n";
+      return 2;
+    }
+    atomic<size_t> next(0);
+    atomic<long long> bad(-1);
+    vector<thread> workers;
+    for (int w=0; w<nthread; w++) {
+      workers.emplace_back([&]{
+        vector<unsigned char> raw;
+        size_t b;
+        while ((b = next++) < z.h.nblock) {
+          const NGZ_BLOCK &k = z.blk[b];
+          if (!ngzunpack(z, b, raw) || memcmp(raw.data(), base + k.rawoff, k.rawsize)) bad = b;
+        }
+      });
+    }
+    for (auto &t : workers) t.join();
+    ngzclose(z);
+    if (bad >= 0) {
+      cerr << "block " << bad << " of " << out << " does not expand to " << in << "\n";
+      return 1;
+    }
+    cout << "Verified: all blocks expand to " << in << "\n";
+  }
+  close(fo);
+  if (map) munmap(map, size);
+  return 0;
+}
+
+// Expand a compressed run back into the data file
+int expand(const char *in, const char *out, int nthread){
+  int fd = open(in, O_RDONLY);
+  NGZ_FILE z;
+  if (fd == -1 || !ngzopen(z, fd)) {
+    cerr << "cannot open " << in << " as a compressed run\n";
+    return 2;
+  }
+  close(fd);
+  int fo = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fo == -1) {
+    cerr << "cannot open " << out << "\n";
+    return 2;
+  }
+  double t0 = nowsec();
+  atomic<size_t> next(0);
+  atomic<long long> bad(-1);
+  vector<thread> workers;
+  for (int w=0; w<nthread; w++) {
+    workers.emplace_back([&]{
+      vector<unsigned char> raw;
+      size_t b;
+      while ((b = next++) < z.h.nblock) {
+        const NGZ_BLOCK &k = z.blk[b];
+        if (!ngzunpack(z, b, raw) || !writeall(fo, raw.data(), raw.size(), k.rawoff)) bad = b;
+      }
+    });
+  }
+  for (auto &t : workers) t.join();
+  if (bad >= 0 || ftruncate(fo, z.h.rawsize)) {
+    cerr << "cannot expand block " << bad << " of " << in << "\n";
+    return 2;
+  }
+  close(fo);
+  double dt = nowsec() - t0;
+  printf("%llu events, %lld bytes in %.2f s: %.1f MB/s, %d threads\n",
+         z.h.nevent, z.h.rawsize, dt, z.h.rawsize/dt/1e6, nthread);
+  ngzclose(z);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  int codec = NGZ_ZSTD;        // -c
+  int level = -1;              // -l (-1: default of the codec)
+  long long blksize = NGZ_BLKSIZE;  // -b
+  int nthread = thread::hardware_concurrency();  // -j
+  bool unpack = false;         // -x
+  bool verify = true;          // -n : no read back
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:l:b:j:xn")) != -1) {
+    switch (opt) {
+    case 'c':
+      if      (!strcmp(optarg, "zstd")) codec = NGZ_ZSTD;
+      else if (!strcmp(optarg, "lz4"))  codec = NGZ_LZ4;
+      else argc = 0;
+      break;
+    case 'l': level = atoi(optarg); break;
+    case 'b': blksize = parsesize(optarg); if (blksize < 1024 || blksize > (1LL<<30)) argc = 0; break;
+    case 'j': nthread = atoi(optarg); break;
+    case 'x': unpack = true; break;
+    case 'n': verify = false; break;
+    default:  argc = 0; break;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
+  // Usage
+  if (argc != 3) {
+    cout << "Usage: ngzconv [-c zstd|lz4] [-l level] [-b size] [-j N] [-n] [data file] [compressed run]\n";
+    cout << "       ngzconv -x [-j N] [compressed run] [data file]\n";
+    cout << "  -c codec : zstd (default) or lz4\n";
+    cout << "  -l level : compression level (zstd default 3; lz4 above 1 uses lz4hc)\n";
+    cout << "  -b size  : raw bytes per block (suffix k, M, G; default 4M)\n";
+    cout << "  -j N     : compress / decompress with N threads\n";
+    cout << "  -n       : do not read the compressed run back to check it\n";
+    cout << "  -x       : expand a compressed run back into the data file\n";
+    cout << "  offline reads compressed runs as they are (.ngz, any option but -r and -f)\n";
+    exit(0);
+  }
+  nthread = std::max(nthread, 1);
+  if (level < 0) level = codec == NGZ_ZSTD ? 3 : 0;
+
+  if (unpack) return expand(argv[1], argv[2], nthread);
+  cout << "Input  File : " << argv[1] << "\n";
+  cout << "Output File : " << argv[2] << " (" << (codec == NGZ_ZSTD ? "zstd" : "lz4") << " level " << level
+       << ", blocks of " << blksize << " bytes)\n";
+  return compress(argv[1], argv[2], codec, level, blksize, nthread, verify);
+}
@@ -0,0 +1,184 @@
+/*
+  Blocked compressed NGDRV runs (.ngz)
+  The bytes of a data file, cut at event boundaries into blocks of about
+  NGZ_BLKSIZE bytes, every block compressed on its own (zstd or lz4):
+    NGZ_HEADER
+    compressed blocks
+    NGZ_BLOCK [nblock]     (the block index, at header.index)
+  A block of events of one length is byte-shuffled before compression
+  (byte 0 of all events, then byte 1, ...): the constant nbyte headers and
+  delimiters and the empty high bits of the 12-bit words become long runs.
+  The last block holds NGZ_EOF and whatever follows it, so expanding all
+  blocks gives back the data file byte for byte.
+  Blocks decompress independently into whole events, and the index gives
+  the run index of their first event: offline analyses them in parallel
+  with the same dithering, so with the same histograms, as the data file.
+  The codecs are only compiled in with USE_NGZ (zstd and lz4 installed, see
+  the Makefile); without it a compressed run is recognised but not read.
+*/
+
+#ifndef __NGZFILE_H__
+#define __NGZFILE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <vector>
+
+#ifdef USE_NGZ
+#include <zstd.h>
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "ngdrvcommon.h"
+
+#define NGZ_MAGIC    0x315a474e  /* "NGZ1" */
+#define NGZ_ZSTD     1
+#define NGZ_LZ4      2
+#define NGZ_SHUFFLE  1           /* block flag: events all nbyte long, byte-shuffled */
+#define NGZ_BLKSIZE  (4<<20)     /* default raw bytes per block */
+
+typedef struct NGZ_HEADER {
+  unsigned int       magic;
+  unsigned int       codec;
+  unsigned long long nblock;
+  unsigned long long nevent;
+  long long          rawsize;    /* size of the data file */
+  long long          index;      /* offset of the block index */
+} NGZ_HEADER;
+
+typedef struct NGZ_BLOCK {
+  long long          off;        /* offset of the compressed block */
+  unsigned int       csize;      /* its size */
+  unsigned int       rawsize;    /* size of the events it holds */
+  long long          rawoff;     /* their offset in the data file */
+  long long          first;      /* run index of the first event */
+  unsigned int       nevent;
+  unsigned short     flags;      /* NGZ_SHUFFLE */
+  unsigned short     nbyte;      /* event length if shuffled */
+} NGZ_BLOCK;
+
+typedef struct NGZ_FILE {
+  void             *map;
+  size_t            size;
+  NGZ_HEADER        h;
+  const NGZ_BLOCK  *blk;
+} NGZ_FILE;
+
+/* fd holds a compressed run */
+inline bool ngzis(int fd){
+  unsigned int m;
+  return pread(fd, &m, 4, 0) == 4 && m == NGZ_MAGIC;
+}
+
+/* Map a compressed run; false if fd is not one or its index is broken */
+inline bool ngzopen(NGZ_FILE &z, int fd){
+  memset(&z, 0, sizeof(z));
+  struct stat st;
+  fstat(fd, &st);
+  NGZ_HEADER h;
+  if (st.st_size < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      h.magic != NGZ_MAGIC || (h.codec != NGZ_ZSTD && h.codec != NGZ_LZ4) || h.index < (long long)sizeof(h) ||
+      h.index + h.nblock*sizeof(NGZ_BLOCK) != (unsigned long long)st.st_size) return false;
+  z.size = st.st_size;
+  z.map  = mmap(NULL, z.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (z.map == MAP_FAILED) { z.map = NULL; return false; }
+  madvise(z.map, z.size, MADV_SEQUENTIAL);
+  z.h   = h;
+  z.blk = (const NGZ_BLOCK *)((const char *)z.map + h.index);
+  for (size_t b=0; b<h.nblock; b++)
+    if (z.blk[b].off < (long long)sizeof(h) || z.blk[b].off + z.blk[b].csize > h.index) {
+      munmap(z.map, z.size);
+      z.map = NULL;
+      return false;
+    }
+  return true;
+}
+
+inline void ngzclose(NGZ_FILE &z){
+  if (z.map) munmap(z.map, z.size);
+  z.map = NULL;
+}
+
+/* byte b of event i: src[i*nbyte + b] <-> dst[b*n + i] */
+inline void ngzshuffle(const unsigned char *src, unsigned char *dst, size_t n, int nbyte){
+  for (int b=0; b<nbyte; b++)
+    for (size_t i=0; i<n; i++) dst[b*n + i] = src[i*nbyte + b];
+}
+inline void ngzunshuffle(const unsigned char *src, unsigned char *dst, size_t n, int nbyte){
+  for (size_t i=0; i<n; i++)
+    for (int b=0; b<nbyte; b++) dst[i*nbyte + b] = src[b*n + i];
+}
+
+#ifdef USE_NGZ
+
+/* Compress raw[0..len) (nevent events of nbyte each if nbyte > 0) into out;
+   sets the flags of blk, false on error */
+inline bool ngzpack(int codec, int level, const unsigned char *raw, size_t len, int nbyte,
+                    std::vector<unsigned char> &out, NGZ_BLOCK &blk){
+  static thread_local std::vector<unsigned char> tmp;
+  blk.flags = 0;
+  blk.nbyte = 0;
+  if (nbyte > 0 && len > 0) {
+    tmp.resize(len);
+    ngzshuffle(raw, tmp.data(), len/nbyte, nbyte);
+    raw = tmp.data();
+    blk.flags = NGZ_SHUFFLE;
+    blk.nbyte = nbyte;
+  }
+  blk.rawsize = len;
+  if (codec == NGZ_ZSTD) {
+    static thread_local ZSTD_CCtx *cc = ZSTD_createCCtx();
+    out.resize(ZSTD_compressBound(len));
+    size_t n = ZSTD_compressCCtx(cc, out.data(), out.size(), raw, len, level);
+    if (ZSTD_isError(n)) return false;
+    out.resize(n);
+  } else {
+    out.resize(LZ4_compressBound(len));
+    int n = level > 1 ? LZ4_compress_HC((const char *)raw, (char *)out.data(), len, out.size(), level)
+                      : LZ4_compress_default((const char *)raw, (char *)out.data(), len, out.size());
+    if (n <= 0 && len > 0) return false;
+    out.resize(n);
+  }
+  blk.csize = out.size();
+  return true;
+}
+
+/* Decompress block b of z into out (its events, as in the data file) */
+inline bool ngzunpack(const NGZ_FILE &z, size_t b, std::vector<unsigned char> &out){
+  static thread_local std::vector<unsigned char> tmp;
+  const NGZ_BLOCK &k = z.blk[b];
+  const unsigned char *src = (const unsigned char *)z.map + k.off;
+  bool shuf = (k.flags & NGZ_SHUFFLE) && k.nbyte > 0;
+  if (shuf && k.rawsize % k.nbyte) return false;
+  out.resize(k.rawsize);
+  unsigned char *dst = out.data();
+  if (shuf) {
+    tmp.resize(k.rawsize);
+    dst = tmp.data();
+  }
+  if (z.h.codec == NGZ_ZSTD) {
+    static thread_local ZSTD_DCtx *dc = ZSTD_createDCtx();
+    size_t n = ZSTD_decompressDCtx(dc, dst, k.rawsize, src, k.csize);
+    if (ZSTD_isError(n) || n != k.rawsize) return false;
+  } else if (k.rawsize > 0) {
+    int n = LZ4_decompress_safe((const char *)src, (char *)dst, k.csize, k.rawsize);
+    if (n != (int)k.rawsize) return false;
+  }
+  if (shuf) ngzunshuffle(dst, out.data(), k.rawsize/k.nbyte, k.nbyte);
+  return true;
+}
+
+#else
+
+inline bool ngzunpack(const NGZ_FILE &, size_t, std::vector<unsigned char> &){
+  return false;
+}
+
+#endif /* USE_NGZ */
+
+#endif /* __NGZFILE_H__ */
@@ -1,249 +1,278 @@
 //////////////////////////////////////////////////
 // Offline Analyzer for Physics Experiments III //
+//   main(): the options and the run            //
 //////////////////////////////////////////////////
 
 /* headers for standard I/O */
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
-/* headers for ROOT */
-#include <TH1F.h>
-#include <TH2F.h>
-#include <TFile.h>
-#include <TRandom3.h>
-#include <TMath.h>
-
-using namespace std;
-
-TRandom3 rnd;
-TFile *hfile;
-
-// Definitions of constants 
-// Useful link: https://physics.nist.gov/cuu/Constants/Table/allascii.txt
-Double_t   cc  = 0.299792458;  // Speed of light [m/ns]
-Double_t   mp  = 938.272013;   // Proton mass [MeV/c2]
-Double_t   mn  = 939.565346;   // Neutron mass [MeV/c2]
-Double_t   tp  = 48.81;        // kinetic energy of incident proton [MeV]
-Double_t   trf = 1.0/16.2344e6 * 1.0e9;       // RF period [ns]
-Double_t   fpl = (7507.0 + 2.0 + 50.8/2.0)/1000.0; // Distance from target to detector [m]
-// Double_t   fpl_err = 25.4 / 1000.0; // Uncertainty in fpl [m]
-Double_t   fpl_err = 0.0; // Uncertainty in fpl [m]
-Double_t   ch2ns = 1.0/22.2105; /*?*/   // Conversion factor from channel to nsec [ns/ch]
-Double_t   ch2ns_err = 0.01681 / (22.2105*22.2105); /*?*/ // Error of the conversion factor [ns/ch]
-Double_t   qthpsd = 900.0; // qdc software threshold for psd [ch]
-Double_t   qthex  = 0.0;/*?*/ // qdc software threshold for ex  [ch]
-
-// Declaration of Histograms
-TH1F *hTDC, *hQDC, *hQDCg, *hQDCn, *hQDCt;
-TH2F *hQDC2, *hQDC2e, *hQDC2c;
-TH2F *hTDCQDC, *hTDCQDCg, *hTDCQDCn;
-TH2F *hTOFQDC, *hTOFQDCg, *hTOFQDCn;
-TH1F *hEx;
-TH1F *hExSmear;
-string atom_name = "hoge";
-string saveFigPath = "img/";
-
-int anainit(string hstFileName){
-  // anainit is executed ONCE at the beginning of the program
-
-  // ##### Open the output histogram file #####
-  hfile = new TFile(hstFileName.c_str(),"RECREATE","ROOT Histogram File");
-
-  // ##### Histogram definitions ######
-  // QDC spectrum : full gate (all), full gate (gamma), full gate (neutron), tail gate
-  hTDC  = new TH1F((atom_name + "hTDC").c_str() , "TDC" , 1848, 200., 2048.);
-
-  // QDC spectrum : full gate (all), full gate (gamma), full gate (neutron), tail gate
-  hQDC  = new TH1F("hQDC", (atom_name + "QDC").c_str(), 2048, 0., 2048.); 
-  hQDCg = new TH1F("hQDCg", (atom_name + "QDCg").c_str(), 2048, 0., 2048.);
-  hQDCn = new TH1F("hQDCn", (atom_name + "QDCn").c_str(), 2048, 0., 2048.);
-  hQDCt = new TH1F("QhQDCt", (atom_name + "QDCt").c_str(), 2048, 0., 2048.);
-  hQDC ->GetXaxis()->SetRangeUser(10.,2048.);
-  hQDCg->GetXaxis()->SetRangeUser(10.,2048.);
-  hQDCn->GetXaxis()->SetRangeUser(10.,2048.);
-  hQDCt->GetXaxis()->SetRangeUser(10.,2048.);
-
-  // QDC full vs. tail 2D : overall, zoomed, corrected
-  hQDC2  = new TH2F("hQDC2" , (atom_name + "QDC vs. QDCt").c_str()         ,  256, 0., 2048.,  512,    0., 2048.);
-  hQDC2e = new TH2F("hQDC2e", (atom_name + "QDC vs. QDCt (zoomed)").c_str(),  400, 0.,  400.,  400,    0.,  400.);
-  hQDC2c = new TH2F("hQDC2c", (atom_name + "QDC vs. QDCtc").c_str()        ,  256, 0., 2048.,  250, -250.,  250.);
-  hQDC2->GetXaxis()->SetTitle("QDC [-]");
-  hQDC2->GetYaxis()->SetTitle("count [-]");
-  hQDC2e->GetXaxis()->SetTitle("QDC [-]");
-  hQDC2e->GetYaxis()->SetTitle("count [-]");
-  hQDC2c->GetXaxis()->SetTitle("QDC [-]");
-  hQDC2c->GetYaxis()->SetTitle("count [-]");
-
-  // TDC vs. QDC : all, gamma, neutron
-  hTDCQDC  = new TH2F("hTDCQDC"  , (atom_name + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
-  hTDCQDCg = new TH2F("hTDCQDCg" , (atom_name + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
-  hTDCQDCn = new TH2F("hTDCQDCn" , (atom_name + "TDC vs. QDC").c_str(), 1000, 0., 2500., 1000, 0., 2500.);
-
-  hTDCQDC->GetXaxis()->SetTitle("TDC [ch]");
-  hTDCQDC->GetYaxis()->SetTitle("QDC [-]");
-  hTDCQDCg->GetXaxis()->SetTitle("TDC [ch]");
-  hTDCQDCg->GetYaxis()->SetTitle("QDC [-]");
-  hTDCQDCn->GetXaxis()->SetTitle("TDC [ch]");
-  hTDCQDCn->GetYaxis()->SetTitle("QDC [-]");
-
-  // TOF vs. QDC : all, gamma, neutron
-  hTOFQDC  = new TH2F("hTOFQDC"  , (atom_name + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
-  hTOFQDCg = new TH2F("hTOFQDCg" , (atom_name + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
-  hTOFQDCn = new TH2F("hTOFQDCn" , (atom_name + "TOF vs. QDC").c_str(), 500, -100., 100., 500, 0., 2500.);
-
-  hTOFQDC->GetXaxis()->SetTitle("TOF [ns]");
-  hTOFQDC->GetYaxis()->SetTitle("QDC");
-  hTOFQDCg->GetXaxis()->SetTitle("TOF [ns]");
-  hTOFQDCg->GetYaxis()->SetTitle("QDC");
-  hTOFQDCn->GetXaxis()->SetTitle("TOF [ns]");
-  hTOFQDCn->GetYaxis()->SetTitle("QDC");
-
-
-  // Excitation energy
-  hEx = new TH1F("hEx", (atom_name + "Ex").c_str() , 400, -10.0, 30.0);
-  hEx->GetXaxis()->SetTitle("Energy [MeV]");
-  hEx->GetYaxis()->SetTitle("Count [-]");
-  hExSmear = new TH1F("hExSmear", (atom_name + "Ex").c_str() , 400, -10.0, 30.0);
-  hExSmear->GetXaxis()->SetTitle("Energy [MeV]");
-  hExSmear->GetYaxis()->SetTitle("Count [-]");
-  hExSmear->Sumw2();
-
-  return 0;
-}
-
-
-int anaexec(int event_size, unsigned short *anabuff){
-  // anaexec is executed for each event
-
-  Double_t tdc,qdc,qdct,qdctc;
-  // Rename from circuit channels to physical variables
-  //   tdc  : Trf-Tdet [ch]
-  //   qdc  : Charge (full gate) [ch]
-  //   qdct : Charge (tail gate) [ch]
-  //   qdctc: Charge (tail gate) corrected for PSD [ch]
-  // [ Group A ]
-  tdc  = anabuff[0] + (rnd.Rndm()-0.5);
-  qdc  = anabuff[2] + (rnd.Rndm()-0.5);
-  qdct = anabuff[3] + (rnd.Rndm()-0.5);
-//   // [ Group B ]
-//   tdc  = anabuff[1] + (rnd.Rndm()-0.5); 
-//   qdc  = anabuff[4] + (rnd.Rndm()-0.5);
-//   qdct = anabuff[5] + (rnd.Rndm()-0.5);
-
-  // n-gamma separation
-  qdctc = qdct - (5.0 / 16.0 * qdc + 12.5); /* threshold whether the particle is Neutron or not*/
-  Bool_t is_undefined_line = qdc - (3.0 * tdc - 1500.0) > 0.0; // flag to remove the undefined line peak.
-  Bool_t fNeutron = qdc>qthpsd && qdctc>0.0 && is_undefined_line; // fNeutron=true for neutron events
-  Bool_t fGamma   = qdc>qthpsd && qdctc<0.0 && is_undefined_line; // fGamma  =true for gamma   events
-
-  // TOF calculation
-  Double_t tof0 = fpl / cc + 980 * ch2ns;   // constant term calibrated by gamma peak (i.e. L/C + TDC_gamma).
-  Double_t tofr = - tdc *ch2ns + tof0 ;  // tofr = tof - RF*n
-  Double_t tof  = tofr + trf; // corrected for RF cycles
-
-  // Neutron and excitation energy 
-  Double_t betan  = (fpl / tof) / cc ; /*?*/   // beta  of neutron
-  Double_t gamman = 1.0 / sqrt(1.0 - betan * betan); /*?*/   // gamma of neutron
-  Double_t tn = mn * gamman - mn; /*?*/       // kinetic energy of neutron
-  Double_t ex = tp - tn; /*?*/       // excitation energy
-
-  // calc uncertainty in TOF due to tdc channel uncertainty
-  
-  // TOF uncertainty propagation
-  Double_t tof0_err = sqrt(pow(fpl_err / cc, 2) + pow(980 * ch2ns_err, 2));
-  Double_t tof_err  = sqrt( pow(tdc * ch2ns_err, 2) + pow(tof0_err, 2) );
-  
-  // Neutron energy uncertainty propagation
-  Double_t betan_err = sqrt( pow( (fpl / (cc * tof * tof)) * tof_err , 2) + pow( (1.0 / (cc * tof)) * fpl_err , 2) );
-  Double_t gamman_err = betan / pow(1.0 - betan * betan, 3.0/2.0) * betan_err;
-  Double_t tn_err = mn * gamman_err; // assuming no uncertainty in mn
-  Double_t ex_err = tn_err; // assuming no uncertainty in tp
-
-
-  // Fill in the histograms
-  if(! (qdc>0.0)) return 0;  // If qdc is not recorded, skip the event.
-
-  hTDC ->Fill(tdc );
-  hQDC ->Fill(qdc );
-  hQDCt->Fill(qdct);
-  if(fNeutron) hQDCn->Fill(qdc );
-  if(fGamma  ) hQDCg->Fill(qdc );
-
-  //  if(tdc<200. || tdc>2100.) return 0;
-
-  hQDC2 ->Fill(qdc, qdct);
-  hQDC2e->Fill(qdc, qdct);
-  hQDC2c->Fill(qdc, qdctc);
-
-  hTDCQDC->Fill(tdc,qdc);
-  if(fNeutron) hTDCQDCn->Fill(tdc,qdc);
-  if(fGamma  ) hTDCQDCg->Fill(tdc,qdc);
-
-  hTOFQDC->Fill(tofr,qdc);
-  if(fNeutron) hTOFQDCn->Fill(tof,qdc);
-  if(fGamma  ) hTOFQDCg->Fill(tof,qdc);
-
-  if(qdc>qthex && fNeutron) {
-    hEx->Fill(ex);
-
-    const int    Nsigma = 6;
-    const int    nb = hExSmear->GetNbinsX();
-    const double bw = hExSmear->GetBinWidth(1);
-    int bmin = hExSmear->FindFixBin(ex - Nsigma*ex_err);
-    int bmax = hExSmear->FindFixBin(ex + Nsigma*ex_err);
-    bmin = std::max(bmin, 1);
-    bmax = std::min(bmax, nb);
-
-    // 規格化済みガウス（TMath::Gaus(..., norm=true)）×bin幅 を重みとして Fill
-    for (int b = bmin; b <= bmax; ++b) {
-      double xc  = hExSmear->GetBinCenter(b);
-      double pdf = TMath::Gaus(xc, ex, ex_err, /*norm=*/true);
-      double w   = pdf * bw;
-      hExSmear->Fill(xc, w);
-    }
-  }
-
-
-  return 0;
-}
-
-
-int anaend(){
-  // anaend is executed ONCE at the end of the program
-  
-  hfile->Write(); // Write the histograms into the output file
-  hEx->Print((saveFigPath + "/excitation.png").c_str());
-  return 0;
-}
-
-
-//////////////////////////////////////////////////////////
-//   Don't touch the following lines.                   //
-//   Try understanding them if you are interested in.   //
-//////////////////////////////////////////////////////////
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <time.h>
-#include <signal.h>
+#include <getopt.h>
+
+#include <vector>
+#include <thread>
+#include <algorithm>
 
 /* headers for DAQ System */
 #include "ngdrvcommon.h"
+#include "analysis.h"
+#include "profrun.h"
+#include "skim.h"
+#include "fitlist.h"
+#include "evloop.h"
+#include "runpool.h"
+#include "serve.h"
+#include "psdscan.h"
+#include "kinbatch.h"
 
-unsigned short buff[NGDRV_MAXEVLEN];
+using namespace std;
 
+//////////////////////////////////////////////////////////
+//   Don't touch the following lines.                   //
+//   Try understanding them if you are interested in.   //
+//////////////////////////////////////////////////////////
 int main(int argc, char *argv[]){
 
   int fd;
   string hstFileName;
+  bool useRead = false;  // -r : use the old read() event loop
+  double follow = 0;     // -f : follow a growing data file, snapshot period [s]
+  string chmap;          // -g : channel map of the detector groups
+  string fitlist;        // -e : peak fits of the Ex spectra
+  int  nthread = 0;      // -j : number of worker threads (0: serial, all cores with -b)
+  string manifest;       // -b : batch manifest
+  bool makeCache = false;  // -c : build the column cache
+  string psdGrid;        // -s : PSD cut scan grid
+  string kernel;         // -k : batched kinematics kernel
+  string lutmode;        // -l : kinematics lookup table
+  string dithmode = "philox";  // -d : dithering
+  string profjson;       // -P : JSON profile report
+  string skim;           // -x : skim selection
+  string gatelist;       // -G : graphical gates
+  string servesock;      // -D : resident server on this socket
+  long long first = 0, count = -1;  // --first, --count : range of events
+  string cmd;            // command line, for the profile report
+  for (int k=0; k<argc; k++) cmd += (k ? " " : "") + string(argv[k]);
+
+  static struct option longopt[] = {
+    {"first", required_argument, 0, 'F'},
+    {"count", required_argument, 0, 'N'},
+    {0, 0, 0, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "rj:b:cs:k:m:l:d:f:g:G:e:t:x:pP:D:", longopt, 0)) != -1) {
+    switch (opt) {
+    case 'F': first = atoll(optarg); if (first < 0) argc = 0; break;
+    case 'N': count = atoll(optarg); if (count < 0) argc = 0; break;
+    case 'm': smearmode = optarg; break;
+    case 'l': lutmode = optarg; break;
+    case 'd': dithmode = optarg; break;
+    case 'k': kernel = optarg; break;
+    case 's': psdGrid = optarg; break;
+    case 'r': useRead = true; break;
+    case 'g': chmap = optarg; break;
+    case 'G': gatelist = optarg; break;
+    case 'e': fitlist = optarg; break;
+    case 'x': skim = optarg; break;
+    case 't': mctoys = atoi(optarg); if (mctoys <= 0) argc = 0; break;
+    case 'p': profon = true; break;
+    case 'P': profon = true; profjson = optarg; break;
+    case 'f': follow = atof(optarg); if (!(follow > 0)) argc = 0; break;
+    case 'c': makeCache = true; break;
+    case 'j': nthread = atoi(optarg); break;
+    case 'b': manifest = optarg; break;
+    case 'D': servesock = optarg; break;
+    default:  argc = 0; break;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
+  if (smearmode != "exact" && smearmode != "cache" && smearmode != "legacy") {
+    cerr << "unknown smearing " << smearmode << "\n";
+    return 2;
+  }
+  if (!fitlist.empty() && !readfitlist(fitlist)) return 2;
+  if (chmap.empty()) groups.assign(1, defgroup("A", 0, 2, 3));
+  else if (!readchmap(chmap)) return 2;
+  if (!gatelist.empty() && !readgates(gatelist)) return 2;
+  if (!skim.empty()) {
+    if (!skimparse(skim)) {
+      cerr << "bad skim selection " << skim << "\n";
+      return 2;
+    }
+    skimsel = skim;
+    skimon  = true;
+  }
+  if (groups.size() > 1) {
+    cout << "Detector groups:";
+    for (const GROUP &G : groups) cout << " " << G.name << " (" << G.tdc << "," << G.qdc << "," << G.qdct << ")";
+    cout << "\n";
+  }
+
+  if (dithmode == "trandom3") {
+    dithphilox = false;
+  } else if (dithmode.compare(0, 6, "philox") == 0 &&
+             (dithmode.size() == 6 || sscanf(dithmode.c_str(), "philox:%llu", &runseed) == 1)) {
+    dithphilox = true;
+  } else {
+    cerr << "unknown dithering " << dithmode << "\n";
+    return 2;
+  }
+  if (lutmode == "check") {
+    anaconst();
+    exit(kinlutcheck());
+  }
+  if (!lutmode.empty() && lutmode != "use") {
+    cerr << "unknown -l " << lutmode << "\n";
+    return 2;
+  }
+  uselut = !lutmode.empty();
+  if (!kernel.empty()) {
+    const char *picked;
+    if (kernel == "bench") {
+      anaconst();
+      exit(kinbench());
+    }
+    if (!(kinfunc = kinselect(kernel.c_str(), &picked))) {
+      cerr << "kernel " << kernel << " is not available\n";
+      return 2;
+    }
+    cout << "Kinematics kernel: " << picked << "\n";
+    anafunc  = anabatch;
+    anaflush = anabatchflush;
+  }
+
+  if (mctoys > 0) {
+    const char *picked;
+    if (!(mcfunc = mcselect(kernel.empty() ? "auto" : kernel.c_str(), &picked))) {
+      cerr << "kernel " << kernel << " is not available for -t\n";
+      return 2;
+    }
+    cout << "Systematics: " << mctoys << " toys, kernel " << picked << "\n";
+  }
+
+  if (!servesock.empty() && (!manifest.empty() ? argc == 1 : argc == 2 || argc == 3)) {
+    if (skimon || !psdGrid.empty() || follow > 0 || useRead || mctoys > 0 || !fitlist.empty()) {
+      cerr << "-x, -s, -f, -r, -t and -e cannot be used with -D\n";
+      return 2;
+    }
+    if (!dithphilox) {
+      cerr << "-D needs -d philox (the queries draw the dithers again)\n";
+      return 2;
+    }
+    if (!kernel.empty()) cerr << "-k is ignored with -D\n";
+    if (nthread<=0) nthread = thread::hardware_concurrency();
+    vector<Run*> runs;
+    vector<pair<string, string> > list;
+    if (manifest.empty()) {
+      list.push_back(make_pair(string(argv[1]), string(argc == 3 ? argv[2] : "hoge")));
+    } else {
+      ifstream fin(manifest.c_str());
+      if (!fin) {
+        cerr << "cannot open manifest " << manifest << "\n";
+        return 2;
+      }
+      string line, d, t;
+      while (getline(fin, line)) {
+        istringstream ss(line.substr(0, line.find('#')));
+        if (ss >> d >> t) list.push_back(make_pair(d, t));
+      }
+    }
+    for (auto &l : list) {
+      Run *r = new Run;
+      r->datFile = l.first;
+      r->target  = l.second;
+      r->first   = first;
+      r->count   = count;
+      if (!maprun(*r, std::max(nthread, 1), makeCache) || r->skm.map) {
+        cerr << "cannot map " << r->datFile << " (or it is a skim), skipped\n";
+        unmaprun(*r);
+        delete r;
+        continue;
+      }
+      runs.push_back(r);
+    }
+    exit(serve(servesock, runs, std::max(nthread, 1)));
+  }
+
+  if (!manifest.empty() && argc == 1) {
+    if (skimon) {
+      cerr << "-x cannot be used with -b\n";
+      return 2;
+    }
+    if (nthread<=0) nthread = thread::hardware_concurrency();
+    exit(batch(manifest, std::max(nthread, 1), makeCache, first, count, cmd, profjson));
+  }
 
   // Usage
   if (argc<2||argc>4) {
-    cout << "Usage: " << argv[0] << " [data file] [hist file]\n";
+    cout << "Usage: offline [-r] [-c] [-j N] [-k kernel] [-m smear] [-l use] [-d dither] [-s grid] [-f sec] [-g map] [-G gates] [-e fits] [-t K] [-x sel] [-p] [-P json] [--first i] [--count n] [data file] [atom name] [hist file]\n";
+    cout << "       offline [-c] [-j N] [-k kernel] [-g map] [-G gates] [-e fits] [-t K] [-p] [-P json] [--first i] [--count n] -b [manifest]\n";
+    cout << "       offline -D socket [-c] [-j N] [-l use] [-d philox[:seed]] [-g map] [-G gates] [--first i] [--count n] (-b [manifest] | [data file] [atom name])\n";
+    cout << "       offline -k bench\n";
+    cout << "       offline -l check\n";
+    cout << "  -r   : read events with read() instead of mmap (old path, for comparison)\n";
+    cout << "  -c   : decode the run once into a column cache ([data file].soa);\n";
+    cout << "         a valid cache is always used instead of the data file (except with -r)\n";
+    cout << "  -j N : analyse with N threads (mmap only)\n";
+    cout << "  [data file] may be a compressed run from ngzconv (.ngz): its blocks are decompressed\n";
+    cout << "         in parallel (by -j workers, or ahead of the single analysis thread)\n";
+    cout << "  [data file] may also be a pipe or FIFO (\"-\": stdin), read as it comes with read(), or\n";
+    cout << "         sim:key=value,... a simulated ngdrv device (rate, n, t, spill=on/off ms, burst,\n";
+    cout << "         buf, src, seed; see evsource.h): the events lost because the analysis did not\n";
+    cout << "         keep up, and the event rate it keeps up with, are printed at the end\n";
+    cout << "  -k auto|avx512|avx2|scalar : compute the kinematics in blocks of events\n";
+    cout << "         with a SIMD kernel; -k bench compares their speed to anaexec\n";
+    cout << "  -l use : ex and ex_err from per-channel tables (value and slope, interpolated\n";
+    cout << "         over the dither) built in anainit; -l check prints their max deviation\n";
+    cout << "  -d philox[:seed]|trandom3 : dithering of the channels; philox (default, seed 4357)\n";
+    cout << "         depends only on the event index, the same for any -j, -c or -k\n";
+    cout << "  -m exact|cache|legacy : smearing of hExSmear (erf over bin edges,\n";
+    cout << "         the same with cached kernels, or the old Gaussian at bin centres)\n";
+    cout << "  -f sec : follow a data file still being written, until NGDRV_EOF or Ctrl-C;\n";
+    cout << "         [hist file] is replaced by a snapshot at most sec seconds after new events\n";
+    cout << "  -g map : detector groups (name, TDC/QDC/QDCt words, calibration) analysed in\n";
+    cout << "         one pass, see chmap.list; histograms of groups after the first get _name\n";
+    cout << "  -G gates : polygon gates on the (QDC, QDCt) and (TDC, QDC) planes (see gates.list),\n";
+    cout << "         rasterised once into bitmaps of the 12-bit channels, all looked up at once per\n";
+    cout << "         event; gates named line, neutron, gamma replace those cuts, -p counts every gate\n";
+    cout << "  -e fits : fit Gaussian peaks + background to hEx/hExSmear of the targets in a fit\n";
+    cout << "         list (see fit.list) at the end, summed over the runs of a target with -b, all\n";
+    cout << "         spectra and starts in parallel (-j threads, default all cores), and write mean\n";
+    cout << "         and error into a copy of the table main.py reads (gaussian_fitting_auto.csv;\n";
+    cout << "         copy rows into gaussian_fitting.csv to use them)\n";
+    cout << "  -t K : Monte Carlo systematics: hEx of K toys of fpl, ch2ns, the gamma peak TDC and tp\n";
+    cout << "         (spreads fpl_sys, ch2ns_sys, tdcg_sys, tp_sys) filled in the same pass (SIMD\n";
+    cout << "         over toys, -k picks the kernel); per-bin bands go to [hist file]_sys.csv\n";
+    cout << "  -x sel : also write the events a selection passes (any group), with their words and\n";
+    cout << "         tofr/tof/ex/ex_err, to [hist file].skm; sel is neutron, gamma, gates (-G) and/or ranges\n";
+    cout << "         var=lo:hi of tdc qdc qdct qdctc tofr tof ex ex_err (comma separated). A skim is\n";
+    cout << "         read as [data file] like a run, to the histograms of the selected events\n";
+    cout << "  -p   : print events/s, MB/s, the time per stage and the cut pass counts at the end\n";
+    cout << "  -P json : the same, also written to a JSON file (to compare versions)\n";
+    cout << "  -b   : analyse all runs of a manifest (lines of data file, atom name, hist file)\n";
+    cout << "  --first i, --count n : analyse only events i to i+n-1 (of every run with -b); the\n";
+    cout << "         event index [data file].idx (written on first use, rebuilt when the data\n";
+    cout << "         file changes) finds event i and the chunks of -j without reading the run\n";
+    cout << "  -D socket : load the events of the runs once (their words, and ex ex_err of every\n";
+    cout << "         group) and answer histogram queries on a Unix socket, one per line, e.g.\n";
+    cout << "           h1 ex 400 -10 30 neutron qthpsd=700 run=Al\n";
+    cout << "           h2 tdc 1000 0 2500 qdc 500 0 2500 qdc=1200: group=B\n";
+    cout << "         (cuts as -x, keys run group qthpsd psdsl psdof qthex), in parallel (-j workers\n";
+    cout << "         per query, default all cores), recent replies cached; also runs, stats,\n";
+    cout << "         quit, shutdown\n";
+    cout << "  -s slopes,offsets,thresholds : scan the PSD cut over a grid of min:max:n ranges\n";
+    cout << "         instead of filling histograms; the table goes to [hist file]_psdscan.csv\n";
     exit(0);
   }
+  if (argc >= 3) targetname = argv[2];
   if (argc == 3) {
     atom_name = string(argv[2]);
     atom_name += ": "; // add whitespace
@@ -254,53 +283,140 @@ int main(int argc, char *argv[]){
   }
   std::cout << "atom_name: " << atom_name << "\r\n";
 
-  // Open Rawdata
-  if ((fd=open(argv[1],O_RDONLY))== -1) {
-    cerr << "device open error!\n";
+  // Open Rawdata: a data file, a pipe or FIFO ("-": stdin) or the simulated device (sim:...)
+  EVSRC src;
+  string srcerr;
+  if (!evopen(src, argv[1], srcerr)) {
+    cerr << "device open error! " << srcerr << "\n";
+    return 2;
+  }
+  fd = src.fd;
+  struct stat stbuf = {};
+  if (fd != -1) fstat(fd, &stbuf);
+  long long inputFileSize = src.type == EVSRC_FILE ? stbuf.st_size : 0;
+  if (src.type == EVSRC_FILE) cout << "\nInput  File : " << argv[1] << " (" << inputFileSize << " bytes)\n";
+  else cout << "\nInput  File : " << argv[1] << (src.type == EVSRC_SIM ? " (simulated device)\n" : " (stream)\n");
+  if (follow > 0 && src.type != EVSRC_FILE) {
+    cerr << "-f needs a data file\n";
+    return 2;
+  }
+  if ((useRead || follow > 0) && (ngzis(fd) || skmis(fd))) {
+    cerr << "-r and -f cannot read a compressed run or a skim\n";
+    return 2;
+  }
+  if (follow > 0 && (first > 0 || count >= 0)) {
+    cerr << "--first and --count cannot be used with -f\n";
     return 2;
   }
-  struct stat stbuf;
-  fstat(fd, &stbuf);
-  int inputFileSize = stbuf.st_size;
-  cout << "\nInput  File : " << argv[1] << " (" << inputFileSize << " bytes)\n";
 
   // Output File Name
   if (argc==4){
     hstFileName = argv[3];
   } else {
-    hstFileName = argv[1];
-    int path_i = hstFileName.find_last_of("/")+1;
-    int ext_i  = hstFileName.find_last_of(".")  ;
-    hstFileName = "hst/" + hstFileName.substr(path_i,ext_i-path_i) + ".root";
+    hstFileName = src.type == EVSRC_SIM ? "hst/sim.root" : !strcmp(argv[1], "-") ? "hst/stdin.root" : defaulthst(argv[1]);
+  }
+  if (!psdGrid.empty()) {
+    if (follow > 0) {
+      cerr << "-f cannot be used with -s\n";
+      return 2;
+    }
+    if (skimon || !gates.empty()) {
+      cerr << "-x and -G cannot be used with -s\n";
+      return 2;
+    }
+    if (!psdscaninit(psdGrid)) {
+      cerr << "bad PSD scan grid " << psdGrid << "\n";
+      return 2;
+    }
+    hstFileName = hstFileName.substr(0, hstFileName.find_last_of(".")) + "_psdscan.csv";
+    anafunc  = psdscan;
+    anaflush = 0;
   }
   cout << "Output File : " << hstFileName << "\n";
+  string skimFileName = hstFileName.substr(0, hstFileName.find_last_of(".")) + ".skm";
+  if (skimon) cout << "Skim File   : " << skimFileName << " (" << skimsel << ")\n";
+
+  profstart();
 
   // Initialize OutputFile & Histograms
-  anainit(hstFileName);
+  // (with -f the file is written as [hist file].part, renamed at the end)
+  if (psdGrid.empty()) anainit(follow > 0 ? hstFileName + ".part" : hstFileName);
 
   // Event Loop
-  int i,nword;
-  unsigned short n,nbyte;
-  int sumbyte;
-  i=0; sumbyte=0;
-  while(1){
-    n=read(fd, &nbyte, 2);
-    if (n==0 || nbyte == NGDRV_EOF) {
-      cout << " EOF!\n";
-      cout << "Total event number = " << i << "\n\n";
-      anaend();
-      close(fd);
-      exit(0);
+  long long i;
+  profl0 = nowsec();
+  Run r;
+  r.datFile = argv[1];
+  r.first = first;
+  r.count = count;
+  bool mapped = !(follow > 0) && !useRead && src.type == EVSRC_FILE && maprun(r, std::max(nthread, 1), makeCache);
+  if (follow > 0) {
+    if (nthread>1) cerr << "-j is ignored with -f\n";
+    i = followloop(fd, argv[1], hstFileName, follow, r.frame);
+  } else if (!mapped) {
+    if (ngzis(fd) || skmis(fd)) {
+      cerr << "cannot open " << argv[1] << " as a compressed run or a skim\n";
+      return 2;
     }
-    n=read(fd, buff, nbyte-2);
-    nword=(nbyte-2)/2 - 1;  // unused now
-    anaexec(nword, buff);
-    i++;
-    sumbyte+=nbyte;
-    if(i%1000==0) {  // simple counter
-      printf("\r Event:%d (%4.1f%%)", i, sumbyte*100.0/inputFileSize); 
-      fflush(stdout);
+    if (!useRead && src.type == EVSRC_FILE) cerr << "mmap failed, falling back to read()\n";
+    if (nthread>1) cerr << "-j is ignored with read()\n";
+    long long skip = 0;
+    if (first > 0 && src.type != EVSRC_FILE) {
+      // a stream: read() over the events before first
+      skip = first;
+    } else if (first > 0) {
+      // seek to the indexed event before first, read() over the rest
+      int how = idxget(r.idx, argv[1], fd, stbuf);
+      if (how < 0) {
+        cerr << "--first needs a data file that can be indexed\n";
+        return 2;
+      }
+      idxreport(r.idx, idxpath(argv[1]), how);
+      first = std::min<long long>(first, r.idx.h.nevent);
+      bool in = first < (long long)r.idx.h.nevent;
+      lseek(fd, in ? r.idx.off[first / r.idx.h.stride] : r.idx.h.evend, SEEK_SET);
+      skip = in ? first % r.idx.h.stride : 0;
     }
+    i = readloop(src, inputFileSize, first, count, skip, r.frame);
+  } else if (nthread<=1 && r.ngz.map) {
+    i = ngzloop(r.ngz, std::max(1, (int)thread::hardware_concurrency() - 1), r.first, r.last, r.frame);
+  } else if (nthread<=1) {
+    i = runchunk(r, 0, true);
+  } else {
+    if (psdGrid.empty()) r.h = hget();
+    vector<Run*> runs(1, &r);
+    runpool(runs, nthread);
+    i = r.nevent;
+    cout << " Threads: " << nthread << "\n";
+  }
+  profl1 = nowsec();
+  unmaprun(r);
+
+  cout << " EOF!\n";
+  cout << "Total event number = " << i << "\n";
+  framereport(r.frame);
+  if (src.type == EVSRC_SIM) {
+    evsimreport(src);
+  } else if (S_ISCHR(stbuf.st_mode)) {
+    // the ngdrv driver: its trigger and loss counters
+    unsigned long cnt, los;
+    if (evioctl(src, NGDRV_IOC_INTCNT, &cnt) == 0 && evioctl(src, NGDRV_IOC_INTLOS, &los) == 0)
+      printf("Device: %lu events triggered, %lu lost\n", cnt, los);
+  }
+  cout << "\n";
+  if (skimon) skimwrite(skimFileName, i, src.type == EVSRC_FILE ? stbuf.st_size : src.nread);
+  if (psdGrid.empty()) anaend();
+  else                 psdscanend(hstFileName);
+  if (psdGrid.empty() && !fitlines.empty())
+    fitall(nthread > 0 ? nthread : std::max(1, (int)thread::hardware_concurrency()));
+  if (follow > 0) {
+    hfile->Close();
+    rename((hstFileName + ".part").c_str(), hstFileName.c_str());
+  }
+  if (profon) {
+    if (follow > 0) fstat(fd, &stbuf);  // the size it grew to
+    profreport(i, src.type == EVSRC_FILE ? stbuf.st_size : src.nread, std::max(nthread, 1), cmd, profjson);
   }
-  close(fd);
+  evclose(src);
+  exit(0);
 }
@@ -0,0 +1,597 @@
+///////////////////////////////////////////////////
+// Python module of the offline analyzer         //
+///////////////////////////////////////////////////
+
+// import offline   (make pymodule: offline.cpython-*.so next to offline)
+//
+//   import offline, numpy as np
+//   a  = offline.analyse("dat/run0041.dat", "Al", opts="-j 4", columns="neutron")
+//   h  = a.hist("hEx")                # cells 0..nb+1, as the HIST1 counts them
+//   nb, lo, hi = a.axis("hEx")
+//   q  = a.hist("hTDCQDC")            # (ny+2, nx+2), q[by, bx]
+//   ex = a.column("ex")               # float64, the skimmed events of group 0
+//   tdc = a.column("tdc", "B")        # uint16, the TDC word of group B
+//
+// analyse() runs the analysis of analysis.cxx on one run in this process,
+// as offline does for one data file: anainit(), the event loop of the run
+// (runchunk(), ngzloop(), the pool of -j, or readloop() for a pipe or the
+// simulated device), anaend(). opts are the options of offline that apply
+// to one run (-j -c -k -l -d -m -g -G -t --first --count). Its hist file,
+// skim, ... are written as usual.
+// The Run it returns keeps the histograms the run filled, and hist() gives
+// their own cells (the buffer protocol, PEP 3118): the counts of a HIST1
+// (uint32; its contents and sums of squares, float64, once weighted) and of
+// a HIST2 (uint32; float32 from its TH2F for a tiled one, see histo.h).
+// With columns=sel it also writes the skim of -x sel (skimfile.h; "qdc=0:"
+// for every event with a QDC) and maps it: the event index, the payload
+// words and tofr/tof/ex/ex_err of every group, as columns. NumPy wraps the
+// arrays without a copy; the histograms and the map stay until the last
+// array of the run is freed. Without NumPy they are memoryviews.
+// The analysis lives in globals, so one analyse() runs at a time.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+#include "analysis.h"
+#include "skim.h"
+#include "evloop.h"
+#include "runpool.h"
+#include "kinbatch.h"
+
+using namespace std;
+
+// One run analysed: its histograms (and the hist file that owns their ROOT
+// histograms) and its skim
+struct PYX_RUN {
+  TFile         *file = 0;
+  vector<HIST*>  h;               // hget() of the run
+  vector<string> group;
+  string         hst, skmpath;
+  SKM_FILE       skm = {};
+  bool           skim = false;
+};
+
+// The options of offline analyse() takes
+struct PYX_OPTS {
+  int    nthread = 0;             // -j
+  bool   cache = false;           // -c
+  string kernel, lut;             // -k, -l
+  string dither = "philox";       // -d
+  string smear = "exact";         // -m
+  string chmap, gates;            // -g, -G
+  int    toys = 0;                // -t
+  long long first = 0, count = -1;
+};
+
+mutex pyxlock;   // held by the analyse() running
+
+
+// ##### Python objects #####
+// Run: the histograms and skim of one analyse(); View: a buffer over part of them
+typedef struct {
+  PyObject_HEAD
+  PYX_RUN *r;
+} PyxRun;
+
+typedef struct {
+  PyObject_HEAD
+  PyObject   *run;         // keeps the histograms and the map
+  void       *buf;
+  const char *format;
+  Py_ssize_t  itemsize, ndim;
+  Py_ssize_t  shape[2], strides[2];
+} PyxView;
+
+static PyObject *runtype, *viewtype, *numpy;
+
+static int viewgetbuffer(PyObject *o, Py_buffer *b, int flags){
+  PyxView *v = (PyxView *)o;
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "offline arrays are read-only");
+    b->obj = NULL;
+    return -1;
+  }
+  b->buf      = v->buf;
+  b->obj      = o;  Py_INCREF(o);
+  b->len      = v->itemsize * v->shape[0] * (v->ndim > 1 ? v->shape[1] : 1);
+  b->readonly = 1;
+  b->itemsize = v->itemsize;
+  b->format   = flags & PyBUF_FORMAT ? (char *)v->format : NULL;
+  b->ndim     = v->ndim;
+  b->shape    = flags & PyBUF_ND ? v->shape : NULL;
+  b->strides  = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? v->strides : NULL;
+  b->suboffsets = NULL;
+  b->internal   = NULL;
+  return 0;
+}
+
+static void viewdealloc(PyObject *o){
+  PyTypeObject *tp = Py_TYPE(o);
+  Py_XDECREF(((PyxView *)o)->run);
+  PyObject_Free(o);
+  Py_DECREF(tp);
+}
+
+static void pyxfree(PYX_RUN *r){
+  if (r->skim) skmclose(r->skm);
+  for (HIST *h : r->h) {
+    delete h->th;   // leaves the hist file
+    delete h;
+  }
+  delete r->file;
+  delete r;
+}
+
+static void rundealloc(PyObject *o){
+  PyTypeObject *tp = Py_TYPE(o);
+  if (((PyxRun *)o)->r) pyxfree(((PyxRun *)o)->r);
+  PyObject_Free(o);
+  Py_DECREF(tp);
+}
+
+// An array of n (x m) items at buf of run r: a NumPy array, or a memoryview
+static PyObject *pyxarray(PyxRun *r, const void *buf, const char *format, Py_ssize_t itemsize,
+                          Py_ssize_t n, Py_ssize_t m = 0){
+  PyxView *v = PyObject_New(PyxView, (PyTypeObject *)viewtype);
+  if (!v) return NULL;
+  v->run = (PyObject *)r;  Py_INCREF(r);
+  v->buf = (void *)buf;
+  v->format   = format;
+  v->itemsize = itemsize;
+  v->ndim     = m ? 2 : 1;
+  v->shape[0] = n;  v->shape[1] = m;
+  v->strides[0] = m ? m*itemsize : itemsize;  v->strides[1] = itemsize;
+  PyObject *a = numpy ? PyObject_CallMethod(numpy, "asarray", "O", v) : PyMemoryView_FromObject((PyObject *)v);
+  Py_DECREF(v);
+  return a;
+}
+
+// The histograms hist() gives: those of the hist file (not the toys of -t)
+static bool pyxshown(const HIST *h){
+  return h->th && (dynamic_cast<const HIST1 *>(h) || dynamic_cast<const HIST2 *>(h));
+}
+
+static HIST *runfind(PyxRun *r, const char *name){
+  for (HIST *h : r->r->h)
+    if (pyxshown(h) && !strcmp(h->th->GetName(), name)) return h;
+  PyErr_Format(PyExc_KeyError, "no histogram %s", name);
+  return NULL;
+}
+
+static PyObject *runhist(PyObject *o, PyObject *args, PyObject *kw){
+  static const char *kwlist[] = {"name", "sumw2", NULL};
+  PyxRun *r = (PyxRun *)o;
+  const char *name;
+  int sumw2 = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "s|p", (char **)kwlist, &name, &sumw2)) return NULL;
+  HIST *h = runfind(r, name);
+  if (!h) return NULL;
+  if (HIST1 *a = dynamic_cast<HIST1 *>(h)) {
+    if (!a->w.empty()) return pyxarray(r, sumw2 ? a->w2.data() : a->w.data(), "d", 8, a->nb+2);
+    if (!sumw2)        return pyxarray(r, a->cnt.data(), "I", 4, a->nb+2);
+  }
+  if (sumw2) {
+    PyErr_Format(PyExc_ValueError, "%s has no sums of squares (not Sumw2())", name);
+    return NULL;
+  }
+  HIST2 *a = (HIST2 *)h;
+  if (!a->ntx) return pyxarray(r, a->cnt.data(), "I", 4, a->nby+2, a->ncx);
+  return pyxarray(r, ((TH2F *)a->th)->GetArray(), "f", 4, a->nby+2, a->ncx);
+}
+
+static PyObject *runaxis(PyObject *o, PyObject *args){
+  const char *name;
+  if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+  HIST *h = runfind((PyxRun *)o, name);
+  if (!h) return NULL;
+  if (HIST1 *a = dynamic_cast<HIST1 *>(h)) return Py_BuildValue("(idd)", a->nb, a->xmin, a->xmax);
+  HIST2 *a = (HIST2 *)h;
+  return Py_BuildValue("((idd)(idd))", a->nbx, a->xmin, a->xmax, a->nby, a->ymin, a->ymax);
+}
+
+static PyObject *runentries(PyObject *o, PyObject *args){
+  const char *name;
+  if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+  HIST *h = runfind((PyxRun *)o, name);
+  return h ? PyFloat_FromDouble(h->GetEntries()) : NULL;
+}
+
+static PyObject *runcolumn(PyObject *o, PyObject *args, PyObject *kw){
+  static const char *kwlist[] = {"name", "group", NULL};
+  static const char *kin[SKM_NKIN] = {"tofr", "tof", "ex", "ex_err"};
+  PyxRun *r = (PyxRun *)o;
+  PYX_RUN &d = *r->r;
+  const char *name;
+  PyObject *group = NULL;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "s|O", (char **)kwlist, &name, &group)) return NULL;
+  if (!d.skim) {
+    PyErr_SetString(PyExc_ValueError, "no columns: analyse() without columns=");
+    return NULL;
+  }
+  // group: index or name
+  int g = -1, ng = d.skm.h.ngroup;
+  if (!group) {
+    g = 0;
+  } else if (PyLong_Check(group)) {
+    g = PyLong_AsLong(group);
+  } else if (PyUnicode_Check(group)) {
+    const char *s = PyUnicode_AsUTF8(group);
+    for (size_t k=0; k<d.group.size(); k++) if (d.group[k] == s) g = k;
+  }
+  if (g < 0 || g >= ng) {
+    PyErr_SetString(PyExc_KeyError, "no such detector group");
+    return NULL;
+  }
+  Py_ssize_t n = d.skm.h.nevent;
+  string c = name;
+  if (c == "event") return pyxarray(r, d.skm.ev, "Q", 8, n);
+  if (c == "pass")  return pyxarray(r, d.skm.pass, "I", 4, n);
+  if (c.size() == 2 && c[0] == 'w' && c[1] >= '0' && c[1] < '0' + SKM_NWORD)
+    return pyxarray(r, d.skm.col[c[1] - '0'], "H", 2, n);
+  const SKM_GROUP &G = d.skm.grp[g];
+  if (c == "tdc")  return pyxarray(r, d.skm.col[G.tdc], "H", 2, n);
+  if (c == "qdc")  return pyxarray(r, d.skm.col[G.qdc], "H", 2, n);
+  if (c == "qdct") return pyxarray(r, d.skm.col[G.qdct], "H", 2, n);
+  for (int j=0; j<SKM_NKIN; j++)
+    if (c == kin[j]) return pyxarray(r, d.skm.kin[g][j], "d", 8, n);
+  PyErr_Format(PyExc_KeyError, "no column %s (event pass w0..w%d tdc qdc qdct tofr tof ex ex_err)",
+               name, SKM_NWORD-1);
+  return NULL;
+}
+
+static PyObject *runget(PyObject *o, void *what){
+  PYX_RUN &d = *((PyxRun *)o)->r;
+  switch ((long)what) {
+  case 0: return PyUnicode_FromString(d.hst.c_str());
+  case 1: if (d.skim) return PyUnicode_FromString(d.skmpath.c_str());  Py_RETURN_NONE;
+  case 2: {
+    PyObject *l = PyList_New(0);
+    for (HIST *h : d.h) {
+      if (!l || !pyxshown(h)) continue;
+      PyObject *s = PyUnicode_FromString(h->th->GetName());
+      if (!s || PyList_Append(l, s) < 0) Py_CLEAR(l);
+      Py_XDECREF(s);
+    }
+    return l;
+  }
+  case 3: {
+    PyObject *l = PyList_New(d.group.size());
+    for (size_t k=0; l && k<d.group.size(); k++) PyList_SET_ITEM(l, k, PyUnicode_FromString(d.group[k].c_str()));
+    return l;
+  }
+  default: return PyLong_FromLongLong(d.skim ? d.skm.h.nevent : 0);
+  }
+}
+
+static PyMethodDef runmethods[] = {
+  {"hist",    (PyCFunction)(void(*)(void))runhist, METH_VARARGS | METH_KEYWORDS,
+   "hist(name, sumw2=False): cells of a histogram, under/overflow included ((ny+2, nx+2) for 2D)"},
+  {"axis",    runaxis, METH_VARARGS, "axis(name): (nbins, min, max), per axis for 2D"},
+  {"entries", runentries, METH_VARARGS, "entries(name): entries of a histogram"},
+  {"column",  (PyCFunction)(void(*)(void))runcolumn, METH_VARARGS | METH_KEYWORDS,
+   "column(name, group=0): a column of the skim (event pass w0..w5 tdc qdc qdct tofr tof ex ex_err)"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef rungetset[] = {
+  {"histfile", runget, NULL, "hist file written", (void *)0},
+  {"skimfile", runget, NULL, "skim written (None without columns=)", (void *)1},
+  {"names",    runget, NULL, "histogram names", (void *)2},
+  {"groups",   runget, NULL, "detector group names", (void *)3},
+  {"nevent",   runget, NULL, "events of the skim", (void *)4},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyType_Slot runslots[] = {
+  {Py_tp_dealloc, (void *)rundealloc},
+  {Py_tp_methods, runmethods},
+  {Py_tp_getset,  rungetset},
+  {Py_tp_doc,     (void *)"Histograms and skim columns of one offline run"},
+  {0, NULL}
+};
+static PyType_Spec runspec = {"offline.Run", sizeof(PyxRun), 0,
+                              Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, runslots};
+
+static PyType_Slot viewslots[] = {
+  {Py_tp_dealloc,    (void *)viewdealloc},
+  {Py_bf_getbuffer,  (void *)viewgetbuffer},
+  {Py_tp_doc,        (void *)"Read-only buffer over the cells of a histogram or a skim column"},
+  {0, NULL}
+};
+static PyType_Spec viewspec = {"offline.View", sizeof(PyxView), 0,
+                               Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, viewslots};
+
+
+// ##### analyse() #####
+// opts as offline's getopt takes them; false (and a Python error) on others
+static bool pyxopts(vector<string> &av, PYX_OPTS &o){
+  static struct option longopt[] = {
+    {"first", required_argument, 0, 'F'},
+    {"count", required_argument, 0, 'N'},
+    {0, 0, 0, 0}
+  };
+  vector<char *> argv;
+  for (string &s : av) argv.push_back(&s[0]);
+  argv.push_back(NULL);
+  int argc = argv.size()-1, opt;
+  optind = 0;   // start over (glibc)
+  opterr = 0;
+  while ((opt = getopt_long(argc, argv.data(), "+j:ck:l:d:m:g:G:t:", longopt, 0)) != -1) {
+    switch (opt) {
+    case 'F': o.first = atoll(optarg); if (o.first < 0) opt = '?'; break;
+    case 'N': o.count = atoll(optarg); if (o.count < 0) opt = '?'; break;
+    case 'j': o.nthread = atoi(optarg); break;
+    case 'c': o.cache = true; break;
+    case 'k': o.kernel = optarg; break;
+    case 'l': o.lut = optarg; break;
+    case 'd': o.dither = optarg; break;
+    case 'm': o.smear = optarg; break;
+    case 'g': o.chmap = optarg; break;
+    case 'G': o.gates = optarg; break;
+    case 't': o.toys = atoi(optarg); if (o.toys <= 0) opt = '?'; break;
+    }
+    if (opt == '?') break;
+  }
+  if (opt == '?' || optind < argc) {
+    PyErr_Format(PyExc_ValueError, "bad option %s (analyse() takes -j -c -k -l -d -m -g -G -t --first --count)",
+                 opt == '?' ? argv[std::max(optind-1, 1)] : argv[optind]);
+    return false;
+  }
+  return true;
+}
+
+// Set the globals of the analysis for a run as main() does, after the
+// groups, gates and random state a previous run left
+static bool pyxsetup(const PYX_OPTS &o, const char *columns){
+  for (GROUP &G : groups) {
+    delete G.lut;
+    delete G.toys;
+    for (int p=0; p<GATE_NPLANE; p++) delete G.gmap[p];
+  }
+  groups.clear();
+  gates.clear();
+  rnd.SetSeed(4357);
+  anafunc  = anaexec;
+  anaflush = 0;
+  uselut   = false;
+  mctoys   = o.toys;
+  smearmode = o.smear;
+
+  if (smearmode != "exact" && smearmode != "cache" && smearmode != "legacy") {
+    PyErr_Format(PyExc_ValueError, "unknown smearing %s", smearmode.c_str());
+    return false;
+  }
+  if (o.chmap.empty()) groups.assign(1, defgroup("A", 0, 2, 3));
+  else if (!readchmap(o.chmap)) {
+    PyErr_Format(PyExc_ValueError, "cannot read the channel map %s", o.chmap.c_str());
+    return false;
+  }
+  if (!o.gates.empty() && !readgates(o.gates)) {
+    PyErr_Format(PyExc_ValueError, "cannot read the gates %s", o.gates.c_str());
+    return false;
+  }
+  skimon = columns != NULL;
+  if (skimon) {
+    if (!skimparse(columns)) {
+      PyErr_Format(PyExc_ValueError, "bad skim selection %s", columns);
+      return false;
+    }
+    skimsel = columns;
+  }
+  if (o.dither == "trandom3") {
+    dithphilox = false;
+  } else if (o.dither.compare(0, 6, "philox") == 0 &&
+             (o.dither.size() == 6 || sscanf(o.dither.c_str(), "philox:%llu", &runseed) == 1)) {
+    dithphilox = true;
+    if (o.dither.size() == 6) runseed = 4357;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown dithering %s", o.dither.c_str());
+    return false;
+  }
+  if (!o.lut.empty() && o.lut != "use") {
+    PyErr_Format(PyExc_ValueError, "unknown -l %s", o.lut.c_str());
+    return false;
+  }
+  uselut = !o.lut.empty();
+  if (!o.kernel.empty()) {
+    if (!(kinfunc = kinselect(o.kernel.c_str()))) {
+      PyErr_Format(PyExc_ValueError, "kernel %s is not available", o.kernel.c_str());
+      return false;
+    }
+    anafunc  = anabatch;
+    anaflush = anabatchflush;
+  }
+  if (mctoys > 0 && !(mcfunc = mcselect(o.kernel.empty() ? "auto" : o.kernel.c_str()))) {
+    PyErr_Format(PyExc_ValueError, "kernel %s is not available for -t", o.kernel.c_str());
+    return false;
+  }
+  return true;
+}
+
+// The run, between anainit() and anaend() (without the GIL); the events
+// analysed, -1 for a compressed run or a skim that cannot be mapped
+static long long pyxrun(EVSRC &src, const char *data, string hst, const PYX_OPTS &o){
+  struct stat st = {};
+  if (src.fd != -1) fstat(src.fd, &st);
+  int nthread = std::max(o.nthread, 1);
+  anainit(hst);
+  Run r;
+  r.datFile = data;
+  r.first = o.first;
+  r.count = o.count;
+  long long i;
+  if (src.type == EVSRC_FILE && maprun(r, nthread, o.cache)) {
+    if (nthread <= 1 && r.ngz.map) {
+      i = ngzloop(r.ngz, std::max(1, (int)thread::hardware_concurrency() - 1), r.first, r.last, r.frame);
+    } else if (nthread <= 1) {
+      i = runchunk(r, 0, true);
+    } else {
+      r.h = hget();
+      vector<Run*> runs(1, &r);
+      runpool(runs, nthread);
+      i = r.nevent;
+    }
+  } else if (src.type == EVSRC_FILE && (ngzis(src.fd) || skmis(src.fd))) {
+    i = -1;
+  } else {
+    i = readloop(src, src.type == EVSRC_FILE ? st.st_size : 0, o.first, o.count, o.first, r.frame);
+  }
+  unmaprun(r);
+  if (i < 0) return i;
+
+  cout << " EOF!\n";
+  cout << "Total event number = " << i << "\n";
+  framereport(r.frame);
+  if (src.type == EVSRC_SIM) evsimreport(src);
+  cout << "\n";
+  if (skimon) skimwrite(hst.substr(0, hst.find_last_of(".")) + ".skm", i,
+                        src.type == EVSRC_FILE ? st.st_size : src.nread);
+  anaend();
+  return i;
+}
+
+static PyObject *pyanalyse(PyObject *self, PyObject *args, PyObject *kw){
+  static const char *kwlist[] = {"data", "atom", "hist", "opts", "columns", "quiet", NULL};
+  const char *data, *atom = NULL, *hist = NULL, *columns = NULL;
+  PyObject *opts = NULL;
+  int quiet = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kw, "s|zzOzp", (char **)kwlist,
+                                   &data, &atom, &hist, &opts, &columns, &quiet))
+    return NULL;
+
+  // the options
+  vector<string> av(1, "analyse");
+  if (opts && opts != Py_None) {
+    if (PyUnicode_Check(opts)) {
+      istringstream ss(PyUnicode_AsUTF8(opts));
+      string t;
+      while (ss >> t) av.push_back(t);
+    } else {
+      PyObject *seq = PySequence_Fast(opts, "opts must be a string or a sequence of strings");
+      if (!seq) return NULL;
+      for (Py_ssize_t k=0; k<PySequence_Fast_GET_SIZE(seq); k++) {
+        const char *s = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, k));
+        if (!s) { Py_DECREF(seq);  return NULL; }
+        av.push_back(s);
+      }
+      Py_DECREF(seq);
+    }
+  }
+  PYX_OPTS o;
+  if (!pyxopts(av, o)) return NULL;
+
+  unique_lock<mutex> lk(pyxlock, try_to_lock);
+  if (!lk.owns_lock()) {
+    PyErr_SetString(PyExc_RuntimeError, "analyse() is already running in another thread");
+    return NULL;
+  }
+  if (!pyxsetup(o, columns)) return NULL;
+
+  // the target and the hist file, as offline names them
+  if (hist && !atom) atom = "hoge";
+  targetname  = atom ? atom : "";
+  atom_name   = "hoge";
+  saveFigPath = "img/";
+  if (atom && !hist) {
+    atom_name   = string(atom) + ": ";
+    saveFigPath += atom;
+    mkdir(saveFigPath.c_str(), S_IRWXO | S_IRWXU | S_IRWXG);
+  }
+  EVSRC src;
+  string srcerr;
+  if (!evopen(src, data, srcerr)) {
+    PyErr_Format(PyExc_OSError, "%s", srcerr.c_str());
+    return NULL;
+  }
+  string hst = hist ? hist : src.type == EVSRC_SIM ? "hst/sim.root" : !strcmp(data, "-") ? "hst/stdin.root" : defaulthst(data);
+
+  fflush(stdout);
+  cout.flush();
+  int out = -1;
+  if (quiet) {
+    int nul = open("/dev/null", O_WRONLY);
+    if (nul != -1) { out = dup(1);  dup2(nul, 1);  close(nul); }
+  }
+  long long n;
+  Py_BEGIN_ALLOW_THREADS
+  n = pyxrun(src, data, hst, o);
+  Py_END_ALLOW_THREADS
+  evclose(src);
+  fflush(stdout);
+  cout.flush();
+  if (out != -1) { dup2(out, 1);  close(out); }
+
+  // the histograms go to the Run (the thread lets go of them)
+  PYX_RUN *d = new PYX_RUN;
+  d->file = hfile;
+  d->h    = hget();
+  d->hst  = hst;
+  for (const GROUP &G : groups) d->group.push_back(G.name);
+  hgrp.clear();
+  hfile = 0;
+  if (n < 0) {
+    pyxfree(d);
+    return PyErr_Format(PyExc_RuntimeError, "cannot open %s as a compressed run or a skim", data);
+  }
+  if (skimon) {
+    d->skmpath = hst.substr(0, hst.find_last_of(".")) + ".skm";
+    int sfd = open(d->skmpath.c_str(), O_RDONLY);
+    d->skim = sfd != -1 && skmopen(d->skm, sfd);
+    if (sfd != -1) close(sfd);
+    if (!d->skim) {
+      PyErr_Format(PyExc_RuntimeError, "cannot map the skim %s", d->skmpath.c_str());
+      pyxfree(d);
+      return NULL;
+    }
+  }
+  PyxRun *r = PyObject_New(PyxRun, (PyTypeObject *)runtype);
+  if (!r) { pyxfree(d);  return NULL; }
+  r->r = d;
+  return (PyObject *)r;
+}
+
+static PyMethodDef pymethods[] = {
+  {"analyse", (PyCFunction)(void(*)(void))pyanalyse, METH_VARARGS | METH_KEYWORDS,
+   "analyse(data, atom=None, hist=None, opts=None, columns=None, quiet=False) -> Run\n"
+   "Analyse a data file in this process (opts: offline's options for one run, a\n"
+   "string or a list) and keep its histograms; columns=sel also skims the events\n"
+   "sel passes (-x) and maps their columns. hist() and column() of the Run are\n"
+   "arrays without a copy."},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyModuleDef pymodule = {PyModuleDef_HEAD_INIT, "offline",
+                               "The offline analyzer: histograms and events of a run as NumPy arrays",
+                               -1, pymethods};
+
+PyMODINIT_FUNC PyInit_offline(void){
+  PyObject *m = PyModule_Create(&pymodule);
+  if (!m) return NULL;
+  runtype  = PyType_FromSpec(&runspec);
+  viewtype = PyType_FromSpec(&viewspec);
+  if (!runtype || !viewtype ||
+      PyModule_AddObjectRef(m, "Run", runtype) < 0 ||
+      PyModule_AddObjectRef(m, "View", viewtype) < 0) {
+    Py_CLEAR(runtype);
+    Py_CLEAR(viewtype);
+    Py_DECREF(m);
+    return NULL;
+  }
+  numpy = PyImport_ImportModule("numpy");
+  if (!numpy) PyErr_Clear();
+  return m;
+}
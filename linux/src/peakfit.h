@@ -0,0 +1,270 @@
+/*
+  Gaussian peak fits of 1D spectra (Ex)
+  Model of the counts in a bin of width bw centred at x:
+    f(x) = sum_k  A_k * bw / (sqrt(2 pi) s_k) * exp(-(x - m_k)^2 / (2 s_k^2))
+         + sum_j  c_j * u^j,     u = (x - xc) / hw  (centre and half width of the range)
+  parameters A_0, m_0, s_0, A_1, ... then c_0, c_1, ...; A_k is the
+  number of events of peak k.
+  fitlm() minimises chi2 = sum (y - f)^2 / e2 over the bins of the range
+  (bins with e2 = 0 are left out, as ROOT does with empty bins) by
+  Levenberg-Marquardt; the errors are the square roots of the diagonal of
+  (J^T W J)^-1 at the minimum (chi2 + 1, like MINUIT).
+  fitseeds() gives the starts: every choice of npeak out of the highest
+  local maxima above a straight background (and the seeds given), each
+  with a few widths. Fits of one spectrum from all starts are independent,
+  fitbest() picks the valid one with the lowest chi2.
+*/
+
+#ifndef __PEAKFIT_H__
+#define __PEAKFIT_H__
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#define FIT_MAXPEAK  4
+#define FIT_MAXBKG   4                              /* polynomial terms (order + 1) */
+#define FIT_MAXPAR   (3*FIT_MAXPEAK + FIT_MAXBKG)
+#define FIT_NCAND    6                              /* local maxima tried as peak positions */
+#define FIT_MAXITER  200
+
+typedef struct FIT_DATA {
+  std::vector<double> x, y, e2;  /* bin centres, contents and squared errors */
+  double bw;                     /* bin width */
+} FIT_DATA;
+
+typedef struct FIT_MODEL {
+  int    npeak;                  /* Gaussians, 1..FIT_MAXPEAK */
+  int    nbkg;                   /* background terms, 0 (none) .. FIT_MAXBKG */
+  double lo, hi;                 /* range */
+  std::vector<double> seeds;     /* peak positions to start from, besides the maxima */
+} FIT_MODEL;
+
+typedef struct FIT_RESULT {
+  bool   ok;
+  int    npar, ndf, niter;
+  double chi2;
+  double p[FIT_MAXPAR], err[FIT_MAXPAR];
+} FIT_RESULT;
+
+inline int fitnpar(const FIT_MODEL &m){ return 3*m.npeak + m.nbkg; }
+
+/* Bins of the spectrum cont (cells 0..nb+1 as in HIST1, sums of squares
+   w2, or Poisson errors if NULL) with centres in [lo, hi] */
+inline FIT_DATA fitdata(int nb, double xmin, double xmax, const double *cont, const double *w2,
+                        double lo, double hi){
+  FIT_DATA d;
+  d.bw = (xmax - xmin)/nb;
+  for (int b=1; b<=nb; b++) {
+    double x = xmin + (b - 0.5)*d.bw;
+    if (x < lo || x > hi) continue;
+    d.x.push_back(x);
+    d.y.push_back(cont[b]);
+    d.e2.push_back(w2 ? w2[b] : cont[b]);
+  }
+  return d;
+}
+
+/* f(x) and df/dp */
+inline double fiteval(const FIT_MODEL &m, const double *p, double x, double bw, double *g){
+  const double rs2pi = 0.3989422804014327;   /* 1/sqrt(2 pi) */
+  double f = 0;
+  for (int k=0; k<m.npeak; k++) {
+    double a = p[3*k], mu = p[3*k+1], s = p[3*k+2];
+    double t = (x - mu)/s;
+    double e = rs2pi * bw / s * exp(-0.5*t*t);
+    f += a*e;
+    if (g) {
+      g[3*k]   = e;
+      g[3*k+1] = a*e * t/s;
+      g[3*k+2] = a*e * (t*t - 1)/s;
+    }
+  }
+  double u = (x - 0.5*(m.lo + m.hi)) / (0.5*(m.hi - m.lo)), uj = 1;
+  for (int j=0; j<m.nbkg; j++, uj *= u) {
+    f += p[3*m.npeak + j]*uj;
+    if (g) g[3*m.npeak + j] = uj;
+  }
+  return f;
+}
+
+inline double fitchi2(const FIT_DATA &d, const FIT_MODEL &m, const double *p){
+  double c = 0;
+  for (size_t i=0; i<d.x.size(); i++) {
+    if (!(d.e2[i] > 0)) continue;
+    double r = d.y[i] - fiteval(m, p, d.x[i], d.bw, 0);
+    c += r*r / d.e2[i];
+  }
+  return c;
+}
+
+/* a := a^-1 (n x n, Gauss-Jordan with partial pivoting); false if singular */
+inline bool fitinvert(int n, double *a){
+  int piv[FIT_MAXPAR];
+  for (int c=0; c<n; c++) {
+    int r = c;
+    for (int i=c+1; i<n; i++) if (fabs(a[i*n+c]) > fabs(a[r*n+c])) r = i;
+    if (!(fabs(a[r*n+c]) > 0)) return false;
+    piv[c] = r;
+    if (r != c) for (int j=0; j<n; j++) std::swap(a[r*n+j], a[c*n+j]);
+    double f = 1.0/a[c*n+c];
+    a[c*n+c] = 1.0;
+    for (int j=0; j<n; j++) a[c*n+j] *= f;
+    for (int i=0; i<n; i++) {
+      if (i == c) continue;
+      double t = a[i*n+c];
+      a[i*n+c] = 0.0;
+      for (int j=0; j<n; j++) a[i*n+j] -= t*a[c*n+j];
+    }
+  }
+  /* the row swaps become column swaps, undone in reverse order */
+  for (int c=n-1; c>=0; c--)
+    if (piv[c] != c) for (int i=0; i<n; i++) std::swap(a[i*n+c], a[i*n+piv[c]]);
+  return true;
+}
+
+/* J^T W J and J^T W r at p, and chi2 */
+inline double fitnormal(const FIT_DATA &d, const FIT_MODEL &m, const double *p, double *h, double *v){
+  int n = fitnpar(m);
+  double g[FIT_MAXPAR], c = 0;
+  memset(h, 0, sizeof(double)*n*n);
+  memset(v, 0, sizeof(double)*n);
+  for (size_t i=0; i<d.x.size(); i++) {
+    if (!(d.e2[i] > 0)) continue;
+    double w = 1.0/d.e2[i];
+    double r = d.y[i] - fiteval(m, p, d.x[i], d.bw, g);
+    c += r*r*w;
+    for (int a=0; a<n; a++) {
+      v[a] += g[a]*r*w;
+      for (int b=0; b<=a; b++) h[a*n+b] += g[a]*g[b]*w;
+    }
+  }
+  for (int a=0; a<n; a++)
+    for (int b=0; b<a; b++) h[b*n+a] = h[a*n+b];
+  return c;
+}
+
+/* Levenberg-Marquardt from p0 */
+inline FIT_RESULT fitlm(const FIT_DATA &d, const FIT_MODEL &m, const double *p0){
+  FIT_RESULT r;
+  memset(&r, 0, sizeof(r));
+  int n = r.npar = fitnpar(m);
+  memcpy(r.p, p0, sizeof(double)*n);
+  int nbin = 0;
+  for (double e : d.e2) nbin += e > 0;
+  r.ndf = nbin - n;
+  if (r.ndf <= 0) return r;
+
+  double h[FIT_MAXPAR*FIT_MAXPAR], v[FIT_MAXPAR], a[FIT_MAXPAR*FIT_MAXPAR], q[FIT_MAXPAR];
+  double lambda = 1e-3;
+  double chi2 = fitnormal(d, m, r.p, h, v);
+  int quiet = 0;
+  for (r.niter=0; r.niter<FIT_MAXITER && quiet<3; r.niter++) {
+    memcpy(a, h, sizeof(double)*n*n);
+    for (int k=0; k<n; k++) a[k*n+k] *= 1.0 + lambda;
+    if (!fitinvert(n, a)) { lambda *= 10; continue; }
+    for (int k=0; k<n; k++) {
+      q[k] = r.p[k];
+      for (int j=0; j<n; j++) q[k] += a[k*n+j]*v[j];
+    }
+    for (int k=0; k<m.npeak; k++) q[3*k+2] = fabs(q[3*k+2]);
+    double c = fitchi2(d, m, q);
+    if (c < chi2) {
+      quiet = chi2 - c < 1e-8*(chi2 + 1e-12) ? quiet + 1 : 0;
+      memcpy(r.p, q, sizeof(double)*n);
+      chi2 = fitnormal(d, m, r.p, h, v);
+      lambda = std::max(lambda*0.1, 1e-12);
+    } else {
+      lambda *= 10;
+      if (lambda > 1e12) break;   /* no step lowers chi2: at the minimum */
+    }
+  }
+  r.chi2 = chi2;
+  memcpy(a, h, sizeof(double)*n*n);
+  if (!fitinvert(n, a)) return r;
+  r.ok = std::isfinite(chi2);
+  for (int k=0; k<n; k++) {
+    r.err[k] = a[k*n+k] > 0 ? sqrt(a[k*n+k]) : 0;
+    if (!std::isfinite(r.p[k])) r.ok = false;
+  }
+  /* a fit is a fit of peaks: positive areas and widths, means in the range */
+  for (int k=0; k<m.npeak && r.ok; k++)
+    r.ok = r.p[3*k] > 0 && r.p[3*k+2] > 0.1*d.bw && r.p[3*k+2] < m.hi - m.lo &&
+           r.p[3*k+1] >= m.lo && r.p[3*k+1] <= m.hi;
+  return r;
+}
+
+/* Start parameters: npeak positions out of the seeds and the highest
+   local maxima above a straight background, with widths of 1, 3 and 8 bins */
+inline std::vector<std::vector<double> > fitseeds(const FIT_DATA &d, const FIT_MODEL &m){
+  std::vector<std::vector<double> > s;
+  int nx = d.x.size();
+  if (nx < 3) return s;
+  int e = std::min(3, nx);
+  double y0 = 0, y1 = 0;
+  for (int i=0; i<e; i++) { y0 += d.y[i]/e;  y1 += d.y[nx-1-i]/e; }
+  double x0 = d.x[(e-1)/2], x1 = d.x[nx-1-(e-1)/2];
+  auto bkg = [&](double x){ return x1 > x0 ? y0 + (y1 - y0)*(x - x0)/(x1 - x0) : y0; };
+
+  /* local maxima of the 3-bin average over the background, highest first */
+  std::vector<std::pair<double,double> > cand;   /* (height, position) */
+  for (int i=1; i<nx-1; i++) {
+    double sm = (d.y[i-1] + d.y[i] + d.y[i+1])/3;
+    double lm = i > 1    ? (d.y[i-2] + d.y[i-1] + d.y[i])/3 : -1e300;
+    double rm = i < nx-2 ? (d.y[i] + d.y[i+1] + d.y[i+2])/3 : -1e300;
+    if (sm > lm && sm >= rm && sm > bkg(d.x[i])) cand.push_back(std::make_pair(sm - bkg(d.x[i]), d.x[i]));
+  }
+  std::sort(cand.rbegin(), cand.rend());
+  std::vector<double> pos(m.seeds.begin(), m.seeds.end());
+  for (size_t i=0; i<cand.size() && pos.size()<FIT_NCAND + m.seeds.size(); i++) pos.push_back(cand[i].second);
+  if ((int)pos.size() < m.npeak) return s;
+
+  /* heights at the positions, for the areas */
+  auto height = [&](double x){
+    int i = std::min(nx-1, std::max(0, (int)floor((x - d.x[0])/d.bw + 0.5)));
+    return std::max(d.y[i] - bkg(x), 1.0);
+  };
+  const double widths[] = { 1.0, 3.0, 8.0 };
+  std::vector<int> pick(m.npeak);
+  for (int k=0; k<m.npeak; k++) pick[k] = k;
+  int np = pos.size();
+  while (true) {
+    for (double w : widths) {
+      std::vector<double> p(fitnpar(m), 0.0);
+      double sg = w*d.bw;
+      for (int k=0; k<m.npeak; k++) {
+        p[3*k]   = height(pos[pick[k]]) * sg / (0.3989422804014327 * d.bw);
+        p[3*k+1] = pos[pick[k]];
+        p[3*k+2] = sg;
+      }
+      /* the straight background in u = -1 .. 1 */
+      if (m.nbkg > 0) p[3*m.npeak] = m.nbkg > 1 ? 0.5*(y0 + y1) : std::min(y0, y1);
+      if (m.nbkg > 1) p[3*m.npeak+1] = 0.5*(y1 - y0);
+      s.push_back(p);
+    }
+    /* next combination of npeak out of np */
+    int k = m.npeak - 1;
+    while (k >= 0 && pick[k] == np - m.npeak + k) k--;
+    if (k < 0) break;
+    pick[k]++;
+    for (int j=k+1; j<m.npeak; j++) pick[j] = pick[j-1] + 1;
+  }
+  return s;
+}
+
+/* The valid fit with the lowest chi2, its peaks sorted by mean (ok false if none) */
+inline FIT_RESULT fitbest(const std::vector<FIT_RESULT> &r, const FIT_MODEL &m){
+  FIT_RESULT b;
+  memset(&b, 0, sizeof(b));
+  for (const FIT_RESULT &x : r)
+    if (x.ok && (!b.ok || x.chi2 < b.chi2)) b = x;
+  for (int i=1; i<m.npeak; i++)
+    for (int k=i; k>0 && b.p[3*k+1] < b.p[3*k-2]; k--) {
+      std::swap_ranges(b.p + 3*k, b.p + 3*k + 3, b.p + 3*k - 3);
+      std::swap_ranges(b.err + 3*k, b.err + 3*k + 3, b.err + 3*k - 3);
+    }
+  return b;
+}
+
+#endif /* __PEAKFIT_H__ */
@@ -0,0 +1,74 @@
+/*
+  Low-overhead profiling of the event loop (-p)
+  Time is read from the TSC (rdtsc, a few ns) and charged lap by lap:
+  prof_lap(p, s) gives stage s the cycles since the previous lap of the
+  thread. The stages of an event need one read each, never nest and add
+  up to the time spent in the event loops. PROF_SCOPE times a whole block
+  (anainit, anaend) instead and must not be used inside the loops.
+  Cycles are converted to seconds with the TSC rate measured against
+  CLOCK_MONOTONIC over the run (constant TSC assumed, as on any x86 since
+  Nehalem).
+  The cut counters count the events of each detector group that pass the
+  cuts of anafill.
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+#include <x86intrin.h>
+#include <vector>
+
+/* stages */
+#define PROF_READ     0   /* read()/framing of the event loops, column transposition */
+#define PROF_DECODE   1   /* payload words -> dithered tdc, qdc, qdct */
+#define PROF_KIN      2   /* TOF -> Ex, ex_err (formulas, lut or kernel) */
+#define PROF_FILL     3   /* cuts and histogram fills */
+#define PROF_SMEAR    4   /* smearing into hExSmear */
+#define PROF_INIT     5   /* anainit: booking, run constants, luts */
+#define PROF_WRITE    6   /* anaend (export, write) and snapshots */
+#define PROF_FIT      7   /* peak fits of the Ex spectra (-e), summed over the fitting threads */
+#define PROF_TOYS     8   /* hEx of the Monte Carlo toys (-t) */
+#define PROF_NSTAGE   9
+
+static const char *const prof_stage[PROF_NSTAGE] = {
+  "read/framing", "decode", "kinematics", "fill", "smear", "init", "write", "fit", "toys"
+};
+
+/* cut counters, per group */
+#define PROF_CEVENT   0   /* events analysed */
+#define PROF_CQDC     1   /* qdc > 0 (filled at all) */
+#define PROF_CLINE    2   /* ... and above the undefined line (qdc > 3 tdc - 1500) */
+#define PROF_CNEUT    3   /* ... fNeutron */
+#define PROF_CGAMMA   4   /* ... fGamma */
+#define PROF_CEX      5   /* ... fNeutron and qdc > qthex (into hEx) */
+#define PROF_NCUT     6
+
+static const char *const prof_cut[PROF_NCUT] = {
+  "events", "qdc>0", "qdc>3tdc-1500", "neutron", "gamma", "ex"
+};
+
+typedef struct PROF {
+  uint64_t last;                         /* TSC at the previous lap */
+  uint64_t tsc[PROF_NSTAGE];             /* cycles per stage */
+  std::vector<unsigned long long> cut;   /* [group][PROF_NCUT] */
+} PROF;
+
+inline uint64_t prof_tsc(){ return __rdtsc(); }
+
+inline void prof_lap(PROF &p, int s){
+  uint64_t t = __rdtsc();
+  p.tsc[s] += t - p.last;
+  p.last = t;
+}
+
+/* cycles of the enclosing block go to stage s of p (nothing if p is NULL) */
+struct PROF_SCOPE {
+  PROF *p;
+  int s;
+  uint64_t t0;
+  PROF_SCOPE(PROF *p_, int s_) : p(p_), s(s_), t0(p_ ? __rdtsc() : 0) {}
+  ~PROF_SCOPE(){ if (p) p->tsc[s] += __rdtsc() - t0; }
+};
+
+#endif /* __PROFILE_H__ */
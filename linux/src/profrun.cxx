@@ -0,0 +1,149 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: profiling (-p, -P)         //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <stdio.h>
+
+#include <sys/resource.h>
+#include <vector>
+#include <mutex>
+
+#include "analysis.h"
+#include "profrun.h"
+
+using namespace std;
+
+// Profiling (-p, see profile.h): every thread charges its time to the stages
+// with proflap() and counts the cuts into its own PROF, summed in profreport()
+bool profon = false;
+thread_local PROF *prof = 0;
+vector<PROF*> profs;           // of all threads
+mutex proflock;
+
+PROF *profget(){
+  if (!prof) {
+    prof = new PROF();
+    lock_guard<mutex> g(proflock);
+    profs.push_back(prof);
+  }
+  return prof;
+}
+
+// Cut counters per group: those of profile.h, then one per gate (events with qdc>0 inside it)
+size_t profncut(){ return PROF_NCUT + gates.size(); }
+string profcutname(size_t k){
+  if (k < PROF_NCUT) return prof_cut[k];
+  const GATE &g = gates[k-PROF_NCUT];
+  return "gate " + g.name + (g.group.empty() ? "" : "/" + g.group);
+}
+
+// Count the cuts an event of the group grp passes (-p)
+void profcut(bool fqdc, bool fline, bool fn, bool fg, bool fex, uint32_t gbits){
+  size_t g = grp - &groups[0], nc = profncut();
+  if (prof->cut.size() < groups.size()*nc) prof->cut.resize(groups.size()*nc, 0);
+  unsigned long long *c = &prof->cut[g*nc];
+  c[PROF_CEVENT]++;
+  if (!fqdc) return;
+  c[PROF_CQDC]++;
+  c[PROF_CLINE]  += fline;
+  c[PROF_CNEUT]  += fn;
+  c[PROF_CGAMMA] += fg;
+  c[PROF_CEX]    += fex;
+  for (size_t k=0; k<gates.size(); k++) c[PROF_NCUT+k] += (gbits >> k) & 1;
+}
+
+// ##### Profile report (-p) #####
+// Events/s and MB/s over the wall time of the event loop, the peak RSS,
+// the time of every stage summed over the threads (profile.h) and the cut
+// pass counts of every group; with -P the same as JSON, to compare versions.
+double   proft0, profl0, profl1;  // CLOCK_MONOTONIC at the start and around the event loop [s]
+uint64_t proftsc0;                // TSC at the start
+
+void profstart(){
+  proft0   = nowsec();
+  proftsc0 = prof_tsc();
+}
+
+// s as the inside of a JSON string: " and \ escaped, control characters as \u00XX
+string jsonesc(const string &s){
+  string q;
+  for (unsigned char ch : s) {
+    if (ch == '"' || ch == '\\') {
+      q += '\\';
+      q += ch;
+    } else if (ch < 0x20) {
+      char u[8];
+      snprintf(u, sizeof(u), "\\u%04x", ch);
+      q += u;
+    } else {
+      q += ch;
+    }
+  }
+  return q;
+}
+
+void profreport(long long nevent, long long nbyte, int nthread, string cmd, string json){
+  double hz = (prof_tsc() - proftsc0) / (nowsec() - proft0);  // TSC rate
+  double sec[PROF_NSTAGE], sum = 0;
+  const size_t nc = profncut();
+  vector<unsigned long long> cut(groups.size()*nc, 0);
+  for (int s=0; s<PROF_NSTAGE; s++) {
+    uint64_t t = 0;
+    for (PROF *p : profs) t += p->tsc[s];
+    sec[s] = t / hz;
+    sum += sec[s];
+  }
+  for (PROF *p : profs)
+    for (size_t k=0; k<p->cut.size() && k<cut.size(); k++) cut[k] += p->cut[k];
+  double loop = profl1 - profl0, all = nowsec() - proft0;
+  double evs = loop>0 ? nevent/loop : 0, mbs = loop>0 ? nbyte/1e6/loop : 0;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);  // ru_maxrss: peak RSS [kB]
+
+  printf("\nProfile: %lld events, %.1f MB in %.3f s (event loop; %.3f s in all)\n", nevent, nbyte/1e6, loop, all);
+  printf("  %.3f Mevents/s, %.1f MB/s, peak RSS %.1f MB, TSC %.3f GHz\n", evs/1e6, mbs, ru.ru_maxrss/1024.0, hz/1e9);
+  printf("  %-14s %10s %10s %7s%s\n", "stage", "time [s]", "ns/event", "",
+         nthread > 1 ? "   (time summed over threads)" : "");
+  for (int s=0; s<=PROF_NSTAGE; s++) {
+    double t = s < PROF_NSTAGE ? sec[s] : sum;
+    printf("  %-14s %10.4f %10.1f %6.1f%%\n", s < PROF_NSTAGE ? prof_stage[s] : "total",
+           t, nevent ? t*1e9/nevent : 0.0, sum>0 ? 100*t/sum : 0.0);
+  }
+  for (size_t g=0; g<groups.size(); g++) {
+    const unsigned long long *c = &cut[g*nc];
+    if (!c[PROF_CEVENT]) continue;  // not analysed by anafill (-s)
+    printf("  cuts of group %s\n", groups[g].name.c_str());
+    for (size_t k=0; k<nc; k++)
+      printf("  %-14s %10llu %10s %6.2f%%\n", profcutname(k).c_str(), c[k], "",
+             c[PROF_CEVENT] ? 100.0*c[k]/c[PROF_CEVENT] : 0.0);
+  }
+
+  if (json.empty()) return;
+  FILE *fp = fopen(json.c_str(), "w");
+  if (!fp) {
+    cerr << "cannot open " << json << "\n";
+    return;
+  }
+  // names from the command line, -g and -G are escaped
+  fprintf(fp, "{\n  \"command\": \"%s\",\n  \"threads\": %d,\n", jsonesc(cmd).c_str(), nthread);
+  fprintf(fp, "  \"events\": %lld,\n  \"bytes\": %lld,\n", nevent, nbyte);
+  fprintf(fp, "  \"loop_s\": %.6f,\n  \"total_s\": %.6f,\n", loop, all);
+  fprintf(fp, "  \"events_per_s\": %.1f,\n  \"mb_per_s\": %.3f,\n  \"maxrss_kb\": %ld,\n  \"tsc_hz\": %.0f,\n",
+          evs, mbs, ru.ru_maxrss, hz);
+  fprintf(fp, "  \"stages\": {\n");
+  for (int s=0; s<PROF_NSTAGE; s++)
+    fprintf(fp, "    \"%s\": { \"s\": %.6f, \"ns_per_event\": %.3f }%s\n", prof_stage[s], sec[s],
+            nevent ? sec[s]*1e9/nevent : 0.0, s < PROF_NSTAGE-1 ? "," : "");
+  fprintf(fp, "  },\n  \"cuts\": {\n");
+  for (size_t g=0; g<groups.size(); g++) {
+    fprintf(fp, "    \"%s\": {", jsonesc(groups[g].name).c_str());
+    for (size_t k=0; k<nc; k++)
+      fprintf(fp, " \"%s\": %llu%s", jsonesc(profcutname(k)).c_str(), cut[g*nc+k], k < nc-1 ? "," : " ");
+    fprintf(fp, "}%s\n", g < groups.size()-1 ? "," : "");
+  }
+  fprintf(fp, "  }\n}\n");
+  fclose(fp);
+  cout << "Profile report: " << json << "\n";
+}
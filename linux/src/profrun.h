@@ -0,0 +1,38 @@
+/*
+  Profiling of offline (-p, -P)
+  Every thread charges its time to the stages of profile.h with proflap()
+  and counts the cuts of anafill into its own PROF; profreport() sums them
+  at the end and prints (and with -P writes as JSON) the report.
+*/
+
+#ifndef __PROFRUN_H__
+#define __PROFRUN_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#include "profile.h"
+
+extern bool profon;
+extern thread_local PROF *prof;
+PROF *profget();
+
+/* start of an event loop: nothing before it is charged */
+inline void profbegin(){ if (profon) profget()->last = prof_tsc(); }
+inline void proflap(int s){ if (profon) prof_lap(*prof, s); }
+
+void profcut(bool fqdc, bool fline, bool fn, bool fg, bool fex, uint32_t gbits);
+
+/* CLOCK_MONOTONIC [s] */
+inline double nowsec(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+extern double profl0, profl1;   /* around the event loop [s] */
+void profstart();
+void profreport(long long nevent, long long nbyte, int nthread, std::string cmd, std::string json);
+
+#endif /* __PROFRUN_H__ */
@@ -0,0 +1,221 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: PSD cut scan (-s)          //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <stdio.h>
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <immintrin.h>
+
+#include "analysis.h"
+#include "profrun.h"
+#include "psdscan.h"
+
+using namespace std;
+
+// ##### PSD cut scan (-s) #####
+// Every candidate (slope, offset, threshold) of the n-gamma line of anaexec
+//   qdctc = qdct - (slope*qdc + offset),  neutron: qdc>threshold && qdctc>0
+// is evaluated in one pass. Per (slope, threshold) the events are projected
+// onto qdct - slope*qdc; the offsets only split these projections at the end.
+// The projection bins have their edges on the offset grid, so the split is
+// exact. An event passes threshold j if qdc is above it, so it is counted
+// once under k = number of thresholds below its qdc and summed over k>j later.
+vector<double> psdslope, psdoffset, psdthr;
+int    psdnb;                 // projection bins (+ under/overflow) over about -512..1024 ch
+double psdlo, psdw;           // lower edge and width of the projection bins [ch]
+const int    psdblk = 256;    // events buffered before filling
+
+struct PsdScanAcc {
+  vector<unsigned int> cnt;   // [slope][k][bin]
+  int    n = 0;
+  double qdc[psdblk], qdct[psdblk];
+  int    k[psdblk];
+};
+vector<PsdScanAcc*> psdaccs;  // one per thread
+mutex psdlock;
+thread_local PsdScanAcc *psdacc = 0;
+
+// Cells k*(psdnb+2) + bin of the buffered events j0.. in the projection of
+// slope sl (NaN goes to the overflow)
+void psdcells_scalar(const PsdScanAcc &a, int j0, double sl, int *cell){
+  const double iw = 1.0/psdw;
+  for (int j=j0; j<a.n; j++) {
+    double d = (a.qdct[j] - sl*a.qdc[j] - psdlo) * iw;
+    int bin = d < 0.0 ? 0 : !(d < psdnb) ? psdnb+1 : (int)d + 1;
+    cell[j] = a.k[j]*(psdnb+2) + bin;
+  }
+}
+
+// The same, 4 events at a time: floor, clamped to the under/overflow
+__attribute__((target("avx2")))
+void psdcells_avx2(const PsdScanAcc &a, double sl, int *cell){
+  const __m256d vsl = _mm256_set1_pd(sl), lo = _mm256_set1_pd(psdlo), iw = _mm256_set1_pd(1.0/psdw);
+  const __m256d under = _mm256_set1_pd(-1.0), over = _mm256_set1_pd(psdnb);
+  const __m128i one = _mm_set1_epi32(1), nb = _mm_set1_epi32(psdnb+2);
+  int j = 0;
+  for (; j+4<=a.n; j+=4) {
+    __m256d q  = _mm256_loadu_pd(a.qdc+j), qt = _mm256_loadu_pd(a.qdct+j);
+    __m256d d  = _mm256_mul_pd(_mm256_sub_pd(_mm256_sub_pd(qt, _mm256_mul_pd(vsl, q)), lo), iw);
+    d = _mm256_max_pd(_mm256_min_pd(_mm256_floor_pd(d), over), under);  // min(NaN, over) = over
+    __m128i b  = _mm_add_epi32(_mm256_cvtpd_epi32(d), one);
+    __m128i k  = _mm_loadu_si128((const __m128i *)(a.k+j));
+    _mm_storeu_si128((__m128i *)(cell+j), _mm_add_epi32(_mm_mullo_epi32(k, nb), b));
+  }
+  _mm256_zeroupper();  // the tail calls SSE code
+  psdcells_scalar(a, j, sl, cell);
+}
+
+inline bool psdavx2(){
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return avx2;
+}
+
+// Fill the buffered events into the projections of all slopes. The cells
+// are computed with AVX2 where the CPU has it; the increments are scattered
+// into the counts one by one (events of a block share cells).
+void psdflush(PsdScanAcc &a){
+  const int nk = psdthr.size() + 1;
+  const bool avx2 = psdavx2();
+  int cell[psdblk];
+  for (size_t s=0; s<psdslope.size(); s++) {
+    if (avx2) psdcells_avx2(a, psdslope[s], cell);
+    else      psdcells_scalar(a, 0, psdslope[s], cell);
+    unsigned int *c = &a.cnt[s*nk*(psdnb+2)];
+    for (int j=0; j<a.n; j++) c[cell[j]]++;
+  }
+  a.n = 0;
+}
+
+int psdscan(int event_size, const unsigned short *anabuff){
+  if (!psdacc) {
+    psdacc = new PsdScanAcc;
+    psdacc->cnt.assign(psdslope.size()*(psdthr.size()+1)*(psdnb+2), 0);
+    lock_guard<mutex> g(psdlock);
+    psdaccs.push_back(psdacc);
+  }
+  // same dithering and undefined line cut as anaexec, first detector group
+  const GROUP &G = groups[0];
+  Double_t tdc  = anabuff[G.tdc ] + dither(G.tdc );
+  Double_t qdc  = anabuff[G.qdc ] + dither(G.qdc );
+  Double_t qdct = anabuff[G.qdct] + dither(G.qdct);
+  proflap(PROF_DECODE);
+  int k = lower_bound(psdthr.begin(), psdthr.end(), qdc) - psdthr.begin();
+  if (k>0 && qdc - (3.0 * tdc - 1500.0) > 0.0) {
+    PsdScanAcc &a = *psdacc;
+    a.qdc[a.n] = qdc;  a.qdct[a.n] = qdct;  a.k[a.n] = k;
+    if (++a.n == psdblk) psdflush(a);
+  }
+  proflap(PROF_FILL);
+  return 0;
+}
+
+// "min:max:n" (or a single value) -> n equally spaced values
+vector<double> psdrange(string spec){
+  double lo, hi;
+  int n;
+  vector<double> v;
+  if (sscanf(spec.c_str(), "%lf:%lf:%d", &lo, &hi, &n) == 3 && n>=1) {
+    for (int i=0; i<n; i++) v.push_back(n==1 ? lo : lo + (hi-lo)*i/(n-1));
+  } else if (sscanf(spec.c_str(), "%lf", &lo) == 1) {
+    v.push_back(lo);
+  }
+  return v;
+}
+
+// Grid "slopes,offsets,thresholds", e.g. "0.25:0.375:21,0:25:26,700:1100:21"
+bool psdscaninit(string grid){
+  size_t c1 = grid.find(','), c2 = grid.find(',', c1+1);
+  if (c1==string::npos || c2==string::npos) return false;
+  psdslope  = psdrange(grid.substr(0, c1));
+  psdoffset = psdrange(grid.substr(c1+1, c2-c1-1));
+  psdthr    = psdrange(grid.substr(c2+1));
+  if (psdslope.empty() || psdoffset.empty() || psdthr.empty()) return false;
+  sort(psdthr.begin(), psdthr.end());
+  // the bins are one offset step wide; at most 16384 of them, so the step
+  // must be at least 1536/16384 ch (finer than the dithered channels anyway)
+  psdw = 1.0;
+  if (psdoffset.size()>1) {
+    psdw = fabs(psdoffset[1] - psdoffset[0]);
+    if (psdw < 1536.0/16384) {
+      cerr << "PSD scan: offset step " << psdw << " ch is below " << 1536.0/16384 << " ch\n";
+      return false;
+    }
+  }
+  psdlo = psdoffset[0] - psdw*ceil((psdoffset[0] + 512.0)/psdw);
+  psdnb = (int)ceil(1536.0/psdw);
+  cout << "PSD scan: " << psdslope.size() << " slopes x " << psdoffset.size() << " offsets x "
+       << psdthr.size() << " thresholds\n";
+  return true;
+}
+
+// Write neutron/gamma counts and the figure of merit
+//   FOM = (mean_n - mean_g) / (FWHM_n + FWHM_g),  FWHM = 2.3548 sigma
+// of the projection split at each offset, one CSV line per grid point.
+// The events below and above the projection range (about -512..1024 ch)
+// count as gamma and neutron but have no position for the means and
+// sigmas; they are written as under_g and over_n.
+int psdscanend(string csvFileName){
+  PROF_SCOPE ps(profon ? profget() : 0, PROF_WRITE);
+  const int nk = psdthr.size() + 1;
+  const int nb = psdnb + 2;
+  vector<unsigned long long> cnt(psdslope.size()*nk*nb, 0);
+  for (PsdScanAcc *a : psdaccs) {
+    psdflush(*a);
+    for (size_t i=0; i<cnt.size(); i++) cnt[i] += a->cnt[i];
+    delete a;
+  }
+  psdaccs.clear();
+
+  FILE *fp = fopen(csvFileName.c_str(), "w");
+  if (!fp) {
+    cerr << "cannot open " << csvFileName << "\n";
+    return 2;
+  }
+  fprintf(fp, "slope,offset,threshold,neutron,gamma,mean_n,sigma_n,mean_g,sigma_g,fom,under_g,over_n\n");
+  double outside = 0;  // most events out of the range at a grid point
+  vector<double> proj(nb), s0(nb+1), s1(nb+1), s2(nb+1);
+  for (size_t s=0; s<psdslope.size(); s++) {
+    fill(proj.begin(), proj.end(), 0.0);
+    for (int j=(int)psdthr.size()-1; j>=0; j--) {
+      // events above threshold j
+      const unsigned long long *c = &cnt[(s*nk + j+1)*nb];
+      for (int b=0; b<nb; b++) proj[b] += c[b];
+      // running sums over bins; under/overflow only count, no moments
+      outside = std::max(outside, proj[0] + proj[nb-1]);
+      s0[0] = s1[0] = s2[0] = 0.0;
+      for (int b=0; b<nb; b++) {
+        double x = psdlo + (b - 0.5)*psdw;  // bin centre
+        bool in = b>0 && b<nb-1;
+        s0[b+1] = s0[b] + proj[b];
+        s1[b+1] = s1[b] + (in ? proj[b]*x   : 0.0);
+        s2[b+1] = s2[b] + (in ? proj[b]*x*x : 0.0);
+      }
+      for (size_t o=0; o<psdoffset.size(); o++) {
+        // first bin above the line (its lower edge is on the offset)
+        int bs = (int)lround((psdoffset[o] - psdlo)/psdw) + 1;
+        bs = std::max(1, std::min(bs, nb-1));
+        double ng = s0[bs], nn = s0[nb] - s0[bs];
+        double wg = s0[bs] - s0[1],   wn = s0[nb-1] - s0[bs];
+        double mg = wg>0 ? s1[bs]/wg : 0.0;
+        double mn_ = wn>0 ? (s1[nb-1]-s1[bs])/wn : 0.0;
+        double sg = wg>0 ? sqrt(std::max(0.0, s2[bs]/wg - mg*mg)) : 0.0;
+        double sn = wn>0 ? sqrt(std::max(0.0, (s2[nb-1]-s2[bs])/wn - mn_*mn_)) : 0.0;
+        double fom = (sg+sn)>0 ? (mn_-mg) / (2.3548*(sg+sn)) : 0.0;
+        fprintf(fp, "%g,%g,%g,%llu,%llu,%g,%g,%g,%g,%g,%llu,%llu\n", psdslope[s], psdoffset[o], psdthr[j],
+                (unsigned long long)nn, (unsigned long long)ng, mn_, sn, mg, sg, fom,
+                (unsigned long long)proj[0], (unsigned long long)proj[nb-1]);
+      }
+    }
+  }
+  fclose(fp);
+  cout << "PSD scan table: " << csvFileName << "\n";
+  if (outside > 0)
+    cout << "PSD scan: up to " << (long long)outside << " events outside the projection range,"
+         << " not in the means and sigmas (under_g, over_n)\n";
+  return 0;
+}
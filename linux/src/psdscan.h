@@ -0,0 +1,17 @@
+/*
+  PSD cut scan of offline (-s)
+  psdscan() takes the place of anaexec and projects the events onto every
+  candidate n-gamma line of a grid in one pass; psdscanend() writes the
+  counts and the figure of merit per grid point.
+*/
+
+#ifndef __PSDSCAN_H__
+#define __PSDSCAN_H__
+
+#include <string>
+
+bool psdscaninit(std::string grid);
+int  psdscan(int event_size, const unsigned short *anabuff);
+int  psdscanend(std::string csvFileName);
+
+#endif /* __PSDSCAN_H__ */
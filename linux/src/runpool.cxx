@@ -0,0 +1,262 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: runs and the worker pool   //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <TROOT.h>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "analysis.h"
+#include "profrun.h"
+#include "evloop.h"
+#include "fitlist.h"
+#include "runpool.h"
+
+using namespace std;
+
+// ##### Worker pool #####
+int nchunks(const Run &r){
+  if (r.ngz.map) return r.ngz.h.nblock;
+  if (r.skm.map) return r.ecut.size()-1;
+  return r.soa.map ? r.ecut.size()-1 : r.cut.size()-1;
+}
+
+long long runchunk(Run &r, int c, bool counter){
+  if (r.ngz.map) return ngzchunk(r.ngz, c, r.first, r.last, r.frame);
+  if (r.skm.map) return skimchunk(r.skm, r.ecut[c], r.ecut[c+1], counter);
+  if (r.soa.map) return colchunk(r.soa, r.ecut[c], r.ecut[c+1], r.size, counter);
+  const unsigned char *base = (const unsigned char *)r.map;
+  return mapchunk(r.cut[c], r.cut[c+1], base, r.size, counter, r.ecut[c], r.frame);
+}
+
+// Analyse the chunks of all runs with nthread workers. A worker fills a
+// private copy of the histograms of the run it is on and adds the copy to
+// the run's set when it moves on to another run or runs out of chunks.
+void runpool(vector<Run*> &runs, int nthread){
+  vector<pair<Run*, int> > task;
+  for (Run *r : runs)
+    for (int c=0; c<nchunks(*r); c++) task.push_back(make_pair(r, c));
+  atomic<size_t> next(0);
+
+  ROOT::EnableThreadSafety();
+  vector<thread> workers;
+  for (int w=0; w<nthread; w++) {
+    workers.emplace_back([&, w]{
+      rnd.SetSeed(4357 + w);  // independent dithering per worker (-d trandom3)
+      Run *cur = 0;
+      vector<HIST*> mine;
+      long long n = 0;
+      auto flush = [&]{
+        if (!cur) return;
+        lock_guard<mutex> g(cur->lock);
+        if (!mine.empty()) {
+          hset(cur->h);
+          hmerge(mine);
+        }
+        cur->nevent += n;
+        n = 0;
+      };
+      size_t t;
+      while ((t = next++) < task.size()) {
+        Run *r = task[t].first;
+        int  c = task[t].second;
+        if (r != cur) {
+          flush();
+          cur = r;
+          lock_guard<mutex> g(cur->lock);
+          if (!cur->h.empty()) {
+            hset(cur->h);
+            mine = hclone();
+          }
+        }
+        if (!mine.empty()) hset(mine);
+        n += runchunk(*r, c, false);
+      }
+      flush();
+    });
+  }
+  for (auto &t : workers) t.join();
+}
+
+// Map a run's data file read-only and split events [first, first+count)
+// of it into nchunk chunks of equal event counts, found with the event
+// index (read, or built and written on the first use). A valid column
+// cache is used instead of the data file; with makecache a missing or
+// stale one is (re)built first. A compressed run (.ngz) is split into its
+// blocks instead and has neither.
+bool maprun(Run &r, int nchunk, bool makecache){
+  int fd;
+  if ((fd=open(r.datFile.c_str(),O_RDONLY))== -1) return false;
+  struct stat stbuf;
+  fstat(fd, &stbuf);
+  r.size = stbuf.st_size;
+  if (!S_ISREG(stbuf.st_mode)) { close(fd); return false; }
+  auto range = [&](long long nevent){
+    r.first = std::min(r.first, nevent);
+    r.last  = r.count < 0 ? nevent : std::min(nevent, r.first + r.count);
+    if (r.first > 0 || r.count >= 0) cout << "Events " << r.first << " - " << r.last << " of " << nevent << "\n";
+  };
+
+  if (ngzis(fd)) {
+#ifndef USE_NGZ
+    cerr << r.datFile << ": compressed runs not supported in this build\n";
+    close(fd);
+    return false;
+#endif
+    bool ok = ngzopen(r.ngz, fd);
+    close(fd);
+    if (!ok) return false;
+    if (makecache) cerr << "-c is ignored for compressed runs\n";
+    cout << "Compressed run: " << r.ngz.h.nblock << " blocks, " << r.ngz.h.nevent << " events ("
+         << r.ngz.h.rawsize << " bytes uncompressed)\n";
+    for (size_t b=0; b<r.ngz.h.nblock; b++) r.ecut.push_back(r.ngz.blk[b].first);
+    r.ecut.push_back(r.ngz.h.nevent);
+    range(r.ngz.h.nevent);
+    return true;
+  }
+
+  if (skmis(fd)) {
+    bool ok = skmopen(r.skm, fd);
+    close(fd);
+    if (!ok) return false;
+    if (makecache) cerr << "-c is ignored for skims\n";
+    cout << "Skim (" << r.skm.h.sel << "): " << r.skm.h.nevent << " of " << r.skm.h.nsrc << " events\n";
+    range(r.skm.h.nevent);
+    for (int c=0; c<=nchunk; c++) r.ecut.push_back(r.first + (r.last - r.first) * c / nchunk);
+    return true;
+  }
+
+  if (!soaopen(r.soa, r.datFile, stbuf)) {
+    if (r.size>0) r.map = mmap(NULL, r.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (r.map == MAP_FAILED) { close(fd); return false; }
+    madvise(r.map, r.size, MADV_SEQUENTIAL);
+    madvise(r.map, r.size, MADV_WILLNEED);
+    const unsigned char *base = (const unsigned char *)r.map;
+    if (makecache) {
+      if (soabuild(r.datFile, base, base + r.size, stbuf) && soaopen(r.soa, r.datFile, stbuf)) {
+        munmap(r.map, r.size);
+        r.map = MAP_FAILED;
+      } else {
+        cerr << "cannot write " << soapath(r.datFile) << "\n";
+      }
+    }
+  }
+
+  if (r.soa.map) {
+    close(fd);
+    cout << "Column cache: " << soapath(r.datFile) << " (" << r.soa.nevent << " events)\n";
+    range(r.soa.nevent);
+    for (int c=0; c<=nchunk; c++) r.ecut.push_back(r.first + (r.last - r.first) * c / nchunk);
+    return true;
+  }
+  int how = idxget(r.idx, r.datFile, fd, stbuf);
+  close(fd);
+  if (how < 0) return false;
+  idxreport(r.idx, idxpath(r.datFile), how);
+  range(r.idx.h.nevent);
+  const unsigned char *base = (const unsigned char *)r.map;
+  for (int c=0; c<=nchunk; c++) {
+    r.ecut.push_back(r.first + (r.last - r.first) * c / nchunk);
+    r.cut.push_back(idxseek(r.idx, base, base + r.size, r.ecut.back()));
+  }
+  return true;
+}
+
+void unmaprun(Run &r){
+  soaclose(r.soa);
+  ngzclose(r.ngz);
+  skmclose(r.skm);
+  if (r.map != MAP_FAILED) munmap(r.map, r.size);
+  r.map = MAP_FAILED;
+}
+
+// Label histograms with the target name and save figures under img/<name>
+void settarget(string name){
+  targetname = name;
+  atom_name = name;
+  atom_name += ": "; // add whitespace
+  saveFigPath = "img/" + name;
+  if (mkdir(saveFigPath.c_str(), S_IRWXO | S_IRWXU | S_IRWXG) && errno != EEXIST){
+    std::cout << "Error; failed to make directory";
+  }
+}
+
+// Default output: hst/<data file name without extension>.root
+// (hst/<name>_skim.root for a skim, not to overwrite the hist file of its run)
+string defaulthst(string datFile){
+  int path_i = datFile.find_last_of("/")+1;
+  int ext_i  = datFile.find_last_of(".")  ;
+  bool skim  = ext_i >= 0 && datFile.compare(ext_i, string::npos, ".skm") == 0;
+  return "hst/" + datFile.substr(path_i,ext_i-path_i) + (skim ? "_skim" : "") + ".root";
+}
+
+// Batch mode: analyse all runs listed in a manifest in one process.
+// Each line is "[data file] [target name] [hist file]" (hist file optional,
+// '#' starts a comment).
+int batch(string manifest, int nthread, bool makecache, long long first, long long count,
+          string cmd, string json){
+  ifstream fin(manifest.c_str());
+  if (!fin) {
+    cerr << "cannot open manifest " << manifest << "\n";
+    return 2;
+  }
+  vector<Run*> runs;
+  string line;
+  profstart();
+  while (getline(fin, line)) {
+    line = line.substr(0, line.find('#'));
+    istringstream ss(line);
+    Run *r = new Run;
+    if (!(ss >> r->datFile >> r->target)) { delete r; continue; }
+    if (!(ss >> r->hstFileName)) r->hstFileName = defaulthst(r->datFile);
+    r->first = first;
+    r->count = count;
+    if (!maprun(*r, nthread, makecache)) {
+      cerr << "cannot map " << r->datFile << ", skipped\n";
+      delete r;
+      continue;
+    }
+    settarget(r->target);
+    anainit(r->hstFileName);
+    r->hfile = hfile;
+    r->h     = hget();
+    cout << r->target << " : " << r->datFile << " (" << r->size << " bytes) -> " << r->hstFileName << "\n";
+    runs.push_back(r);
+  }
+
+  cout << "Runs: " << runs.size() << ", Threads: " << nthread << "\n";
+  profl0 = nowsec();
+  runpool(runs, nthread);
+  profl1 = nowsec();
+
+  long long nevent = 0, nbyte = 0;
+  for (Run *r : runs) {
+    nevent += r->nevent;
+    nbyte  += r->size;
+    cout << r->target << " : Total event number = " << r->nevent << "\n";
+    framereport(r->frame);
+    settarget(r->target);
+    hfile = r->hfile;
+    hset(r->h);
+    anaend();
+    hfile->Close();
+    unmaprun(*r);
+    delete r;
+  }
+  if (!fitlines.empty()) fitall(nthread);
+  if (profon) profreport(nevent, nbyte, nthread, cmd, json);
+  return 0;
+}
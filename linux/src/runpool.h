@@ -0,0 +1,58 @@
+/*
+  Runs and the worker pool of offline
+  A Run is a data file (or its column cache, a compressed run, a skim)
+  mapped and split into chunks of events; runpool() analyses the chunks of
+  any number of runs with a pool of threads, batch() all runs of a
+  manifest (-b).
+*/
+
+#ifndef __RUNPOOL_H__
+#define __RUNPOOL_H__
+
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <TFile.h>
+
+#include "histo.h"
+#include "idxfile.h"
+#include "soacache.h"
+#include "ngzfile.h"
+#include "skimfile.h"
+#include "framing.h"
+
+/* A run being analysed: its mapped data file (or its column cache) split
+   into chunks, and the histograms (in its own output file) the chunks are
+   merged into. */
+struct Run {
+  std::string datFile, target, hstFileName;
+  long long size = 0;
+  void *map = MAP_FAILED;
+  SOA_CACHE soa = {};                /* column cache, used instead of map when open */
+  NGZ_FILE ngz = {};                 /* compressed run, used instead of map when open */
+  SKM_FILE skm = {};                 /* skim, used instead of map when open */
+  IDX idx;                           /* event index of the data file (map) */
+  long long first = 0, count = -1;   /* --first, --count: events analysed */
+  long long last = 0;                /* first + count, within the run */
+  std::vector<const unsigned char *> cut; /* chunk boundaries in map */
+  std::vector<long long> ecut;       /* chunk boundaries in events (of soa, or of cut) */
+  TFile *hfile = 0;
+  std::vector<HIST*> h;              /* histograms written to hfile */
+  long long nevent = 0;
+  FRAME_STATS frame = {};            /* corrupt framing skipped in it (framing.h) */
+  std::mutex lock;                   /* guards h and nevent */
+};
+
+bool maprun(Run &r, int nchunk, bool makecache);
+void unmaprun(Run &r);
+long long runchunk(Run &r, int c, bool counter);
+void runpool(std::vector<Run*> &runs, int nthread);
+
+void settarget(std::string name);
+std::string defaulthst(std::string datFile);
+int  batch(std::string manifest, int nthread, bool makecache, long long first, long long count,
+           std::string cmd, std::string json);
+
+#endif /* __RUNPOOL_H__ */
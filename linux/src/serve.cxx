@@ -0,0 +1,414 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: resident server (-D)       //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <vector>
+#include <list>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "dither.h"
+#include "analysis.h"
+#include "profrun.h"
+#include "skim.h"
+#include "evloop.h"
+#include "runpool.h"
+#include "serve.h"
+
+using namespace std;
+
+// ##### Resident server (-D) #####
+// offline -D socket loads the runs of a manifest (-b) or one data file once:
+// of every event the payload words the groups use, and per group ex and
+// ex_err as anagroup computes them (ex_err as float): 2 bytes per word and
+// 12 per group, 20 bytes per event with one group. Queries add the Philox
+// dithers to the words again and get tofr, tof from tdc, so every variable
+// but ex_err has the value anagroup had. It then answers queries on a Unix
+// socket, one per line:
+//   h1 var nb lo hi [sel] [key=value]
+//   h2 xvar nx xlo xhi yvar ny ylo yhi [sel] [key=value]
+// a histogram of var (tdc qdc qdct qdctc tofr tof ex ex_err) over the
+// events with qdc>0 that pass sel (the words of -x: neutron, gamma, gates,
+// var=lo:hi), binned as TH1F/TH2F with under/overflow. Keys:
+//   run=name    only runs of this atom name or data file (more than once: or)
+//   group=name  detector group (default the first)
+//   qthpsd= psdsl= psdof= qthex=   the cut constants, instead of the group's
+// e.g. hEx with another PSD threshold:  h1 ex 400 -10 30 neutron qthpsd=700
+// The reply is a line "ok h1 nb lo hi entries N cached 0|1 ms T" and the
+// nb+2 cells (h2: ny+2 lines of nx+2 cells), or "error message". Other
+// lines: runs, stats, quit (the connection), shutdown (the server).
+// Every connection has its own thread (joined at shutdown); a query is split
+// over -j workers, and the replies of recent queries are kept (servecachemax
+// bytes).
+struct ServeRun {
+  string datFile, target;
+  long long first = 0, nevent = 0;
+  vector<vector<unsigned short> > w;   // [word 0..chmapw-1]
+  vector<vector<double> > ex;          // [group]
+  vector<vector<float> >  ex_err;      // [group]
+};
+vector<ServeRun*> serveruns;
+ServeRun *servecur;                    // run being loaded
+int    servethreads = 1;
+size_t servecachemax = 256 << 20;
+
+// the event loops call this instead of anaexec while a run is loaded
+int serveload(int event_size, const unsigned short *anabuff){
+  ServeRun &r = *servecur;
+  size_t i = evindex - r.first;
+  for (int k=0; k<chmapw; k++) r.w[k][i] = anabuff[k];
+  for (size_t g=0; g<groups.size(); g++) {
+    const GROUP &G = groups[g];
+    Double_t tdc = anabuff[G.tdc] + dither(G.tdc);
+    Double_t tofr, tof, ex, ex_err;
+    if (uselut) kin_lut(*G.lut, G.kconst, 1, &tdc, &tofr, &tof, &ex, &ex_err);
+    else        anakin(G, tdc, tofr, tof, ex, ex_err);
+    r.ex[g][i] = ex;
+    r.ex_err[g][i] = ex_err;
+  }
+  return 0;
+}
+
+struct ServeQuery {
+  int    dim = 0;
+  int    var[2];
+  int    nb[2];
+  double lo[2], hi[2];
+  Sel    sel;
+  size_t g = 0;
+  GROUP  G;                        // the group g, with the constants of the query
+  double qthex;
+  vector<const ServeRun*> runs;
+};
+
+bool serveparse(const string &line, ServeQuery &q, string &err){
+  istringstream ss(line);
+  string cmd, t;
+  ss >> cmd;
+  q.dim = cmd == "h1" ? 1 : cmd == "h2" ? 2 : 0;
+  if (!q.dim) { err = "unknown query " + cmd;  return false; }
+  for (int a=0; a<q.dim; a++) {
+    string v;
+    if (!(ss >> v >> q.nb[a] >> q.lo[a] >> q.hi[a])) { err = "expected var nb lo hi";  return false; }
+    q.var[a] = -1;
+    for (int k=0; k<8; k++) if (v == skimvars[k]) q.var[a] = k;
+    if (q.var[a] < 0) { err = "unknown variable " + v;  return false; }
+    if (q.nb[a] < 1 || q.nb[a] > 100000 || !(q.lo[a] < q.hi[a])) { err = "bad binning";  return false; }
+  }
+  vector<string> kv, runname;
+  string sel;
+  while (ss >> t) {
+    if (t.compare(0, 6, "group=") == 0) {
+      while (q.g < groups.size() && groups[q.g].name != t.substr(6)) q.g++;
+      if (q.g == groups.size()) { err = "no group " + t.substr(6);  return false; }
+    } else if (t.compare(0, 4, "run=") == 0) {
+      runname.push_back(t.substr(4));
+    } else {
+      kv.push_back(t);
+    }
+  }
+  q.G = groups[q.g];
+  q.qthex = qthex;
+  for (const string &t : kv) {
+    size_t eq = t.find('=');
+    string k = t.substr(0, eq), v = eq == string::npos ? "" : t.substr(eq+1);
+    double *d = k == "qthpsd" ? &q.G.qthpsd : k == "psdsl" ? &q.G.psdsl : k == "psdof" ? &q.G.psdof :
+                k == "qthex" ? &q.qthex : 0;
+    char *e;
+    if (!d) sel += (sel.empty() ? "" : ",") + t;
+    else if (*d = strtod(v.c_str(), &e), v.empty() || *e) { err = "bad value " + t;  return false; }
+  }
+  if (!selparse(sel, q.sel)) { err = "bad selection " + sel;  return false; }
+  for (const ServeRun *r : serveruns) {
+    bool in = runname.empty();
+    for (const string &n : runname)
+      in |= n == r->target || n == r->datFile || n == r->datFile.substr(r->datFile.find_last_of('/')+1);
+    if (in) q.runs.push_back(r);
+  }
+  if (q.runs.empty()) { err = "no such run";  return false; }
+  return true;
+}
+
+// Fill q into cnt ((nb[1]+2) x (nb[0]+2) cells), blocks of events over the workers
+long long servefill(const ServeQuery &q, vector<unsigned long long> &cnt){
+  const int nx = q.nb[0] + 2, ny = q.dim > 1 ? q.nb[1] + 2 : 1;
+  const long long blk = 1 << 16;
+  vector<pair<const ServeRun*, long long> > task;
+  for (const ServeRun *r : q.runs)
+    for (long long i=0; i<r->nevent; i+=blk) task.push_back(make_pair(r, i));
+  atomic<size_t> next(0);
+  mutex lock;
+  long long entries = 0;
+  cnt.assign((size_t)nx*ny, 0);
+  const GROUP &G = q.G;
+  auto work = [&]{
+    const int nd = 1024;
+    vector<unsigned int> mine((size_t)nx*ny, 0);
+    vector<long long> ev(nd);
+    vector<double> d(8*nd);            // dithers of the events, [word][event]
+    long long n = 0;
+    size_t t;
+    while ((t = next++) < task.size()) {
+      const ServeRun &r = *task[t].first;
+      const unsigned short *wt = r.w[G.tdc].data(), *wq = r.w[G.qdc].data(), *wqt = r.w[G.qdct].data();
+      const double *ex = r.ex[q.g].data();
+      const float  *ex_err = r.ex_err[q.g].data();
+      long long i1 = std::min(r.nevent, task[t].second + blk);
+      for (long long i0=task[t].second; i0<i1; i0+=nd) {
+        int m = std::min<long long>(nd, i1-i0);
+        for (int j=0; j<m; j++) ev[j] = r.first + i0 + j;
+        for (int b=0; b<2; b++)
+          if (G.tdc/4 == b || G.qdc/4 == b || G.qdct/4 == b)
+            dither_batch(runseed, m, ev.data(), b, &d[(4*b)*nd], &d[(4*b+1)*nd], &d[(4*b+2)*nd], &d[(4*b+3)*nd]);
+        const double *dt = &d[G.tdc*nd], *dq = &d[G.qdc*nd], *dqt = &d[G.qdct*nd];
+        for (int j=0; j<m; j++) {
+          long long i = i0 + j;
+          Double_t qdc = wq[i] + dq[j];
+          if (!(qdc>0.0)) continue;
+          Double_t tdc = wt[i] + dt[j], qdct = wqt[i] + dqt[j];
+          Double_t tofr = G.tof0 - tdc*G.ch2ns;   // as anakin and kin_lut
+          Double_t qdctc;
+          uint32_t gbits;
+          Bool_t fline, fn, fg;
+          anacuts(G, tdc, qdc, qdct, qdctc, gbits, fline, fn, fg);
+          const double v[8] = { tdc, qdc, qdct, qdctc, tofr, tofr + trf, ex[i], ex_err[i] };
+          if (!selpass(q.sel, v, fn, fg, gbits, q.qthex)) continue;
+          int bx = hbin(v[q.var[0]], q.nb[0], q.lo[0], q.hi[0]);
+          int by = q.dim > 1 ? hbin(v[q.var[1]], q.nb[1], q.lo[1], q.hi[1]) : 0;
+          mine[(size_t)by*nx + bx]++;
+          n++;
+        }
+      }
+    }
+    lock_guard<mutex> l(lock);
+    for (size_t k=0; k<cnt.size(); k++) cnt[k] += mine[k];
+    entries += n;
+  };
+  int nw = std::max(1, std::min(servethreads, (int)task.size()));
+  vector<thread> workers;
+  for (int w=1; w<nw; w++) workers.emplace_back(work);
+  work();
+  for (auto &t : workers) t.join();
+  return entries;
+}
+
+// Recent replies (header without "cached"/"ms", and cells), least recently used first out
+struct ServeCache {
+  list<string> order;
+  map<string, pair<list<string>::iterator, pair<string, string> > > reply;
+  size_t bytes = 0;
+  long long queries = 0, hits = 0;
+  mutex lock;
+} servecache;
+
+bool servecacheget(const string &key, string &head, string &body){
+  lock_guard<mutex> l(servecache.lock);
+  servecache.queries++;
+  auto it = servecache.reply.find(key);
+  if (it == servecache.reply.end()) return false;
+  servecache.order.splice(servecache.order.end(), servecache.order, it->second.first);
+  head = it->second.second.first;
+  body = it->second.second.second;
+  servecache.hits++;
+  return true;
+}
+
+void servecacheput(const string &key, const string &head, const string &body){
+  lock_guard<mutex> l(servecache.lock);
+  if (servecache.reply.count(key) || body.size() > servecachemax) return;
+  servecache.order.push_back(key);
+  servecache.reply[key] = make_pair(prev(servecache.order.end()), make_pair(head, body));
+  servecache.bytes += key.size() + head.size() + body.size();
+  while (servecache.bytes > servecachemax) {
+    auto it = servecache.reply.find(servecache.order.front());
+    servecache.bytes -= it->first.size() + it->second.second.first.size() + it->second.second.second.size();
+    servecache.reply.erase(it);
+    servecache.order.pop_front();
+  }
+}
+
+// The reply to one line
+string servereply(const string &line){
+  double t0 = nowsec();
+  istringstream ss(line);
+  string cmd, key, t;
+  ss >> cmd;
+  if (cmd == "runs") {
+    ostringstream o;
+    o << "ok runs " << serveruns.size() << "\n";
+    for (const ServeRun *r : serveruns) o << r->target << " " << r->datFile << " " << r->nevent << "\n";
+    return o.str();
+  }
+  if (cmd == "stats") {
+    lock_guard<mutex> l(servecache.lock);
+    ostringstream o;
+    o << "ok stats queries " << servecache.queries << " hits " << servecache.hits << " cached "
+      << servecache.reply.size() << " bytes " << servecache.bytes << "\n";
+    return o.str();
+  }
+  // the key: the words of the query, single spaced
+  for (istringstream k(line); k >> t; ) key += (key.empty() ? "" : " ") + t;
+  string head, body;
+  bool hit = servecacheget(key, head, body);
+  if (!hit) {
+    ServeQuery q;
+    string err;
+    if (!serveparse(line, q, err)) return "error " + err + "\n";
+    vector<unsigned long long> cnt;
+    long long entries = servefill(q, cnt);
+    ostringstream h, b;
+    h << "ok h" << q.dim;
+    for (int a=0; a<q.dim; a++) h << " " << q.nb[a] << " " << q.lo[a] << " " << q.hi[a];
+    h << " entries " << entries;
+    const int nx = q.nb[0] + 2;
+    for (size_t k=0; k<cnt.size(); k++) b << cnt[k] << ((k+1) % nx ? " " : "\n");
+    head = h.str();
+    body = b.str();
+    servecacheput(key, head, body);
+  }
+  char ms[64];
+  snprintf(ms, sizeof(ms), " cached %d ms %.3f\n", hit, (nowsec() - t0)*1e3);
+  return head + ms + body;
+}
+
+bool servesend(int fd, const string &s){
+  for (size_t o=0; o<s.size(); ) {
+    ssize_t n = send(fd, s.data() + o, s.size() - o, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    o += n;
+  }
+  return true;
+}
+
+atomic<bool> servestop(false);
+
+// A connection: its thread reads and answers lines until the client goes
+// or the server stops (serve() shuts the socket down), then sets done;
+// serve() joins the thread and closes fd.
+struct ServeConn {
+  int fd;
+  atomic<bool> done{false};
+  thread t;
+};
+
+void serveconn(ServeConn *c){
+  int fd = c->fd;
+  string buf;
+  char b[4096];
+  ssize_t n;
+  bool open = true;
+  while (open && (n = read(fd, b, sizeof(b))) > 0) {
+    buf.append(b, n);
+    size_t nl;
+    while (open && (nl = buf.find('\n')) != string::npos) {
+      string line = buf.substr(0, nl);
+      buf.erase(0, nl+1);
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      istringstream ss(line);
+      string cmd;
+      if (!(ss >> cmd)) continue;
+      if (cmd == "quit") { open = false;  break; }
+      if (cmd == "shutdown") {
+        servesend(fd, "ok shutdown\n");
+        servestop = true;
+        open = false;
+        break;
+      }
+      open = servesend(fd, servereply(line));
+    }
+  }
+  c->done = true;
+}
+
+int serve(string sock, vector<Run*> &runs, int nthread){
+  // load: the event loops store the events of one run at a time, chunks in parallel
+  anaconst();
+  gateinit();
+  anafunc  = serveload;
+  anaflush = 0;
+  servethreads = nthread;
+  double t0 = nowsec();
+  size_t bytes = 0;
+  long long nevent = 0;
+  for (Run *r : runs) {
+    ServeRun *s = new ServeRun;
+    s->datFile = r->datFile;
+    s->target  = r->target;
+    s->first   = r->first;
+    s->nevent  = r->last - r->first;
+    s->w.assign(chmapw, vector<unsigned short>(s->nevent));
+    s->ex.assign(groups.size(), vector<double>(s->nevent));
+    s->ex_err.assign(groups.size(), vector<float>(s->nevent));
+    servecur = s;
+    vector<Run*> one(1, r);
+    runpool(one, nthread);
+    servecur = 0;
+    unmaprun(*r);
+    bytes  += s->nevent * (chmapw*sizeof(unsigned short) + groups.size()*(sizeof(double) + sizeof(float)));
+    nevent += s->nevent;
+    cout << r->target << " : " << r->datFile << " " << s->nevent << " events loaded\n";
+    framereport(r->frame);
+    serveruns.push_back(s);
+    delete r;
+  }
+  runs.clear();
+  printf("Loaded %zu runs, %lld events, %zu groups: %.1f MB in %.2f s\n",
+         serveruns.size(), nevent, groups.size(), bytes/1048576.0, nowsec() - t0);
+
+  int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un a = {};
+  a.sun_family = AF_UNIX;
+  if (ls == -1 || sock.size() >= sizeof(a.sun_path)) {
+    cerr << "cannot open socket " << sock << "\n";
+    return 2;
+  }
+  strcpy(a.sun_path, sock.c_str());
+  unlink(sock.c_str());
+  if (::bind(ls, (struct sockaddr *)&a, sizeof(a)) == -1 || listen(ls, 16) == -1) {
+    cerr << "cannot bind " << sock << ": " << strerror(errno) << "\n";
+    return 2;
+  }
+  printf("Serving on %s (%d threads per query)\n", sock.c_str(), nthread);
+  fflush(stdout);
+  list<ServeConn> conns;
+  auto reap = [&](bool all){
+    for (auto it = conns.begin(); it != conns.end(); ) {
+      if (!all && !it->done) { ++it;  continue; }
+      it->t.join();
+      close(it->fd);
+      it = conns.erase(it);
+    }
+  };
+  while (!servestop) {
+    reap(false);
+    struct pollfd p = { ls, POLLIN, 0 };
+    if (poll(&p, 1, 200) <= 0) continue;
+    int fd = accept(ls, 0, 0);
+    if (fd == -1) continue;
+    conns.emplace_back();
+    ServeConn &c = conns.back();
+    c.fd = fd;
+    c.t  = thread(serveconn, &c);
+  }
+  close(ls);
+  // end the connections still open (a reply being sent is cut short)
+  for (ServeConn &c : conns) shutdown(c.fd, SHUT_RDWR);
+  reap(true);
+  unlink(sock.c_str());
+  printf("Server stopped: %lld queries, %lld from the cache\n", servecache.queries, servecache.hits);
+  return 0;
+}
@@ -0,0 +1,17 @@
+/*
+  Resident server of offline (-D)
+  serve() loads the events of the runs once and answers histogram queries
+  on a Unix socket until a client sends shutdown.
+*/
+
+#ifndef __SERVE_H__
+#define __SERVE_H__
+
+#include <string>
+#include <vector>
+
+#include "runpool.h"
+
+int serve(std::string sock, std::vector<Run*> &runs, int nthread);
+
+#endif /* __SERVE_H__ */
@@ -0,0 +1,189 @@
+//////////////////////////////////////////////////
+// Offline Analyzer: skim output (-x)           //
+//////////////////////////////////////////////////
+
+/* headers for standard I/O */
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "analysis.h"
+#include "skim.h"
+
+using namespace std;
+
+// ##### Skim output (-x) #####
+// The events that pass a selection in any detector group are kept with
+// their payload words, their index in the run and the kinematics of every
+// group, in [hist file].skm (skimfile.h). offline reads a skim as it reads
+// a data file (any option but -r and -f), with the kinematics taken from it.
+// The selection is a comma separated list of
+//   neutron   : the events of hEx (qdc>qthex and fNeutron)
+//   gamma     : fGamma
+//   [gate]    : inside the gate of that name (-G)
+//   var=lo:hi : lo < var < hi (lo or hi may be left out), var one of
+//               tdc qdc qdct qdctc tofr tof ex ex_err
+// neutron, gamma and gates are or'ed (none: every event with qdc>0), the
+// ranges and'ed to that.
+// (the same selections are the cuts of the queries of -D)
+bool skimon = false;
+string skimsel;                    // -x as given
+thread_local const double *skimkin;   // tofr, tof, ex, ex_err of every group, from the skim being read
+thread_local int skimslot;            // event of those opened that is being analysed
+Sel skimcut;
+const char *skimvars[] = { "tdc", "qdc", "qdct", "qdctc", "tofr", "tof", "ex", "ex_err" };
+
+bool selparse(string sel, Sel &s){
+  istringstream ss(sel);
+  string t;
+  while (getline(ss, t, ',')) {
+    if (t == "neutron") { s.n = true; continue; }
+    if (t == "gamma")   { s.g = true; continue; }
+    bool gate = false;
+    for (size_t k=0; k<gates.size(); k++)
+      if (t == gates[k].name) { s.gates |= 1u << k;  gate = true; }
+    if (gate) continue;
+    size_t eq = t.find('='), co = t.find(':', eq);
+    if (eq == string::npos || co == string::npos) return false;
+    SkimCut c = { -1, -INFINITY, INFINITY };
+    for (int v=0; v<8; v++) if (t.substr(0, eq) == skimvars[v]) c.var = v;
+    string lo = t.substr(eq+1, co-eq-1), hi = t.substr(co+1);
+    char *e;
+    if (!lo.empty() && (c.lo = strtod(lo.c_str(), &e), *e)) return false;
+    if (!hi.empty() && (c.hi = strtod(hi.c_str(), &e), *e)) return false;
+    if (c.var < 0) return false;
+    s.cuts.push_back(c);
+  }
+  return true;
+}
+bool skimparse(string sel){ skimcut = Sel(); return selparse(sel, skimcut); }
+
+// Rows of the skim filled by one thread: the event loops open a row for
+// every event (skimopen), anafill marks the groups that select it and
+// stores their kinematics (skimmark), skimclose drops the rows of the
+// events no group selected. The rows of all threads go to skimwrite.
+struct SkimBuf {
+  vector<long long>      ev;
+  vector<unsigned short> w;     // SKM_NWORD per event
+  vector<unsigned int>   pass;
+  vector<double>         kin;   // SKM_NKIN per group per event
+  size_t base = 0;              // first row opened
+};
+vector<SkimBuf*> skimbufs;
+mutex skimlock;
+thread_local SkimBuf *skimbuf;
+
+// Rows for n events: event j has index ev[j] and words raw[j*stride...]
+void skimopen(int n, const long long *ev, const unsigned short *raw, int stride){
+  if (!skimbuf) {
+    skimbuf = new SkimBuf;
+    lock_guard<mutex> g(skimlock);
+    skimbufs.push_back(skimbuf);
+  }
+  SkimBuf &b = *skimbuf;
+  size_t ng = groups.size();
+  b.base = b.ev.size();
+  b.ev.insert(b.ev.end(), ev, ev + n);
+  b.w.resize((b.base + n)*SKM_NWORD, 0);
+  for (int j=0; j<n; j++) memcpy(&b.w[(b.base + j)*SKM_NWORD], raw + j*stride, chmapw*sizeof(unsigned short));
+  b.pass.resize(b.base + n, 0);
+  b.kin.resize((b.base + n)*ng*SKM_NKIN);
+  skimslot = 0;
+}
+
+void skimmark(Double_t tdc, Double_t qdc, Double_t qdct, Double_t qdctc,
+              Double_t tofr, Double_t tof, Double_t ex, Double_t ex_err, bool fn, bool fg, uint32_t gbits){
+  SkimBuf &b = *skimbuf;
+  size_t g = grp - &groups[0], i = b.base + skimslot;
+  double *k = &b.kin[(i*groups.size() + g)*SKM_NKIN];
+  k[0] = tofr;  k[1] = tof;  k[2] = ex;  k[3] = ex_err;
+  const double v[8] = { tdc, qdc, qdct, qdctc, tofr, tof, ex, ex_err };
+  if (selpass(skimcut, v, fn, fg, gbits, qthex)) b.pass[i] |= 1u << g;
+}
+
+void skimclose(){
+  SkimBuf &b = *skimbuf;
+  size_t ng = groups.size(), o = b.base;
+  for (size_t i=b.base; i<b.ev.size(); i++) {
+    if (!b.pass[i]) continue;
+    if (o != i) {
+      b.ev[o] = b.ev[i];  b.pass[o] = b.pass[i];
+      memcpy(&b.w[o*SKM_NWORD], &b.w[i*SKM_NWORD], SKM_NWORD*sizeof(unsigned short));
+      memcpy(&b.kin[o*ng*SKM_NKIN], &b.kin[i*ng*SKM_NKIN], ng*SKM_NKIN*sizeof(double));
+    }
+    o++;
+  }
+  b.ev.resize(o);  b.pass.resize(o);  b.w.resize(o*SKM_NWORD);  b.kin.resize(o*ng*SKM_NKIN);
+}
+
+// Header of a skim written now (or to compare one with, see skimmatch)
+void skimheader(SKM_HEADER &h, vector<SKM_GROUP> &sg){
+  memset(&h, 0, sizeof(h));
+  h.magic  = SKM_MAGIC;
+  h.ngroup = groups.size();
+  h.seed   = runseed;
+  h.philox = dithphilox;
+  h.lut    = uselut;
+  strncpy(h.sel, skimsel.c_str(), sizeof(h.sel)-1);
+  sg.assign(groups.size(), SKM_GROUP());
+  for (size_t g=0; g<groups.size(); g++) {
+    memset(&sg[g], 0, sizeof(SKM_GROUP));
+    sg[g].tdc = groups[g].tdc;  sg[g].qdc = groups[g].qdc;  sg[g].qdct = groups[g].qdct;
+    sg[g].kconst = groups[g].kconst;
+  }
+}
+
+// The kinematics of skim s hold for this pass: same groups and constants,
+// same -l, philox dithering with the same seed
+bool skimmatch(const SKM_FILE &s){
+  SKM_HEADER h;
+  vector<SKM_GROUP> sg;
+  skimheader(h, sg);
+  return s.h.ngroup == h.ngroup && s.h.philox && h.philox && s.h.seed == h.seed && s.h.lut == h.lut &&
+    !memcmp(s.grp, sg.data(), sg.size()*sizeof(SKM_GROUP));
+}
+
+// Write the rows of all threads in event order into path; nsrc events were analysed
+bool skimwrite(string path, long long nsrc, long long nbyte){
+  size_t ng = groups.size(), n = 0;
+  for (SkimBuf *b : skimbufs) n += b->ev.size();
+  vector<pair<long long, pair<SkimBuf*, size_t> > > order;
+  order.reserve(n);
+  for (SkimBuf *b : skimbufs)
+    for (size_t i=0; i<b->ev.size(); i++) order.push_back(make_pair(b->ev[i], make_pair(b, i)));
+  sort(order.begin(), order.end());
+  vector<long long> ev(n);
+  vector<unsigned short> w(n*SKM_NWORD);
+  vector<unsigned int> pass(n);
+  vector<double> kin(n*ng*SKM_NKIN);
+  for (size_t o=0; o<n; o++) {
+    const SkimBuf &b = *order[o].second.first;
+    size_t i = order[o].second.second;
+    ev[o] = b.ev[i];  pass[o] = b.pass[i];
+    memcpy(&w[o*SKM_NWORD], &b.w[i*SKM_NWORD], SKM_NWORD*sizeof(unsigned short));
+    memcpy(&kin[o*ng*SKM_NKIN], &b.kin[i*ng*SKM_NKIN], ng*SKM_NKIN*sizeof(double));
+  }
+  for (SkimBuf *b : skimbufs) delete b;
+  skimbufs.clear();
+  skimbuf = 0;
+
+  SKM_HEADER h;
+  vector<SKM_GROUP> sg;
+  skimheader(h, sg);
+  h.nevent = n;
+  h.nsrc   = nsrc;
+  if (!skmwrite(path, h, sg.data(), ev.data(), w.data(), pass.data(), kin.data())) {
+    cerr << "cannot write " << path << "\n";
+    return false;
+  }
+  struct stat st;
+  stat(path.c_str(), &st);
+  printf("Skim (%s): %zu of %lld events (%.2f%%) -> %s, %lld bytes (%.2f%% of %lld)\n",
+         skimsel.c_str(), n, nsrc, nsrc ? 100.0*n/nsrc : 0.0, path.c_str(),
+         (long long)st.st_size, nbyte ? 100.0*st.st_size/nbyte : 0.0, nbyte);
+  return true;
+}
@@ -0,0 +1,51 @@
+/*
+  Skim output of offline (-x)
+  The events a selection passes in any detector group, written with their
+  words and kinematics to [hist file].skm (skimfile.h). The selections
+  (Sel) are also the cuts of the queries of -D.
+*/
+
+#ifndef __SKIM_H__
+#define __SKIM_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "skimfile.h"
+
+struct SkimCut {
+  int    var;
+  double lo, hi;
+};
+struct Sel {
+  bool n = false, g = false;
+  uint32_t gates = 0;              /* bits of the gates selected */
+  std::vector<SkimCut> cuts;
+};
+extern const char *skimvars[];     /* tdc qdc qdct qdctc tofr tof ex ex_err */
+
+bool selparse(std::string sel, Sel &s);
+
+/* Does an event pass s? v: the variables of skimvars, fn/fg/gbits as anafill
+   has them; neutron takes qdc>qth too (the events of hEx) */
+inline bool selpass(const Sel &s, const double v[8], bool fn, bool fg, uint32_t gbits, double qth){
+  bool pass = s.n || s.g || s.gates ? (s.n && v[1]>qth && fn) || (s.g && fg) || (gbits & s.gates) : v[1]>0.0;
+  for (const SkimCut &c : s.cuts) pass = pass && v[c.var] > c.lo && v[c.var] < c.hi;
+  return pass;
+}
+
+extern bool        skimon;
+extern std::string skimsel;                  /* -x as given */
+extern thread_local const double *skimkin;   /* tofr, tof, ex, ex_err of every group, from the skim being read */
+extern thread_local int skimslot;            /* event of those opened that is being analysed */
+
+bool skimparse(std::string sel);
+void skimopen(int n, const long long *ev, const unsigned short *raw, int stride);
+void skimmark(Double_t tdc, Double_t qdc, Double_t qdct, Double_t qdctc,
+              Double_t tofr, Double_t tof, Double_t ex, Double_t ex_err, bool fn, bool fg, uint32_t gbits);
+void skimclose();
+bool skimmatch(const SKM_FILE &s);
+bool skimwrite(std::string path, long long nsrc, long long nbyte);
+
+#endif /* __SKIM_H__ */
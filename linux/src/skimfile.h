@@ -0,0 +1,150 @@
+/*
+  Skim of a run: the events that passed a selection of offline (-x)
+    SKM_HEADER
+    SKM_GROUP [ngroup]                        (words and constants of the groups)
+    unsigned long long [nevent]               (index of each event in the run)
+    SKM_NWORD columns of unsigned short [nevent]  (payload words 0..SKM_NWORD-1)
+    unsigned int [nevent]                     (bit g: group g passed the selection)
+    ngroup x SKM_NKIN columns of double [nevent]  (tofr, tof, ex, ex_err of the group)
+  Every column is padded to 8 bytes. The index keeps the dithering of an
+  event what it was in the run (dither.h), so the skim analyses to the
+  same histograms as the selected events of the run. The kinematics are
+  those of the pass that wrote the skim (-l, -k as it was run); offline
+  uses them instead of computing them again as long as the groups, their
+  constants and the dithering are the same.
+*/
+
+#ifndef __SKIMFILE_H__
+#define __SKIMFILE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+
+#include "kinematics.h"
+
+#define SKM_MAGIC   0x314d4b53  /* "SKM1" */
+#define SKM_NWORD   6           /* payload words kept (those of the column cache) */
+#define SKM_NKIN    4           /* tofr, tof, ex, ex_err */
+#define SKM_MAXGRP  32          /* groups (bits of the pass column) */
+
+typedef struct SKM_GROUP {
+  int       tdc, qdc, qdct, pad;
+  KIN_CONST kconst;
+} SKM_GROUP;
+
+typedef struct SKM_HEADER {
+  unsigned int       magic;
+  unsigned int       ngroup;
+  unsigned long long nevent;    /* events in the skim */
+  unsigned long long nsrc;      /* events of the pass that wrote it */
+  unsigned long long seed;      /* dithering: philox seed */
+  int                philox;    /* dithering: 1 philox, 0 trandom3 */
+  int                lut;       /* kinematics from the tables (-l use) */
+  char               sel[128];  /* selection (-x) */
+} SKM_HEADER;
+
+typedef struct SKM_FILE {
+  void                     *map;
+  size_t                    size;
+  SKM_HEADER                h;
+  const SKM_GROUP          *grp;
+  const unsigned long long *ev;
+  const unsigned short     *col[SKM_NWORD];
+  const unsigned int       *pass;
+  const double             *kin[SKM_MAXGRP][SKM_NKIN];
+} SKM_FILE;
+
+/* offsets of the parts of a skim of nevent events of ngroup groups: off[0]
+   the groups, off[1] the index, off[2+k] word k, off[2+SKM_NWORD] pass,
+   then the kinematics; the last is the size */
+inline void skmlayout(unsigned long long nevent, unsigned ngroup, size_t *off){
+  size_t w = (nevent*2 + 7) & ~7ULL, p = (nevent*4 + 7) & ~7ULL;
+  int k = 0;
+  off[k] = sizeof(SKM_HEADER);                       k++;
+  off[k] = off[k-1] + ngroup*sizeof(SKM_GROUP);      k++;
+  for (int c=0; c<SKM_NWORD; c++, k++) off[k] = off[k-1] + (c ? w : nevent*8);
+  off[k] = off[k-1] + w;                             k++;
+  for (unsigned c=0; c<=ngroup*SKM_NKIN; c++, k++) off[k] = off[k-1] + (c ? nevent*8 : p);
+}
+inline int skmnoff(unsigned ngroup){ return 3 + SKM_NWORD + ngroup*SKM_NKIN + 1; }
+
+inline bool skmis(int fd){
+  unsigned int m;
+  return pread(fd, &m, 4, 0) == 4 && m == SKM_MAGIC;
+}
+
+/* Map the skim fd; false if it is not one or is cut short */
+inline bool skmopen(SKM_FILE &s, int fd){
+  memset(&s, 0, sizeof(s));
+  struct stat st;
+  fstat(fd, &st);
+  SKM_HEADER h;
+  if (st.st_size < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      h.magic != SKM_MAGIC || h.ngroup < 1 || h.ngroup > SKM_MAXGRP)
+    return false;
+  size_t off[3 + SKM_NWORD + SKM_MAXGRP*SKM_NKIN + 1];
+  skmlayout(h.nevent, h.ngroup, off);
+  if ((size_t)st.st_size != off[skmnoff(h.ngroup) - 1]) return false;
+  s.size = st.st_size;
+  s.map  = mmap(NULL, s.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (s.map == MAP_FAILED) { s.map = NULL; return false; }
+  madvise(s.map, s.size, MADV_SEQUENTIAL);
+  const char *b = (const char *)s.map;
+  s.h    = h;
+  s.grp  = (const SKM_GROUP *)(b + off[0]);
+  s.ev   = (const unsigned long long *)(b + off[1]);
+  for (int k=0; k<SKM_NWORD; k++) s.col[k] = (const unsigned short *)(b + off[2+k]);
+  s.pass = (const unsigned int *)(b + off[2+SKM_NWORD]);
+  for (unsigned g=0; g<h.ngroup; g++)
+    for (int j=0; j<SKM_NKIN; j++) s.kin[g][j] = (const double *)(b + off[3+SKM_NWORD + g*SKM_NKIN + j]);
+  return true;
+}
+
+inline void skmclose(SKM_FILE &s){
+  if (s.map) munmap(s.map, s.size);
+  s.map = NULL;
+}
+
+/* Write a skim of h.nevent events (h.ngroup groups grp) from rows: ev[i],
+   words w[i*SKM_NWORD + k], pass[i], kinematics kin[(i*ngroup + g)*SKM_NKIN + j].
+   Written to path.tmp and renamed, so a reader never sees a partial skim. */
+inline bool skmwrite(std::string path, const SKM_HEADER &h, const SKM_GROUP *grp,
+                     const long long *ev, const unsigned short *w, const unsigned int *pass,
+                     const double *kin){
+  size_t off[3 + SKM_NWORD + SKM_MAXGRP*SKM_NKIN + 1];
+  unsigned long long n = h.nevent;
+  unsigned ng = h.ngroup;
+  skmlayout(n, ng, off);
+  size_t size = off[skmnoff(ng) - 1];
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+  if (ftruncate(fd, size) != 0) { close(fd); unlink(tmp.c_str()); return false; }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { unlink(tmp.c_str()); return false; }
+  char *b = (char *)map;
+  memcpy(b, &h, sizeof(h));
+  memcpy(b + off[0], grp, ng*sizeof(SKM_GROUP));
+  memcpy(b + off[1], ev, n*8);
+  for (int k=0; k<SKM_NWORD; k++) {
+    unsigned short *c = (unsigned short *)(b + off[2+k]);
+    for (unsigned long long i=0; i<n; i++) c[i] = w[i*SKM_NWORD + k];
+  }
+  memcpy(b + off[2+SKM_NWORD], pass, n*4);
+  for (unsigned g=0; g<ng; g++)
+    for (int j=0; j<SKM_NKIN; j++) {
+      double *c = (double *)(b + off[3+SKM_NWORD + g*SKM_NKIN + j]);
+      for (unsigned long long i=0; i<n; i++) c[i] = kin[(i*ng + g)*SKM_NKIN + j];
+    }
+  bool ok = msync(map, size, MS_SYNC) == 0;
+  munmap(map, size);
+  return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+#endif /* __SKIMFILE_H__ */
@@ -0,0 +1,127 @@
+/*
+  Gaussian smearing of events into a fixed-binning 1D spectrum
+  An event at x with resolution s puts into bin b the probability
+      w_b = Phi((hi_b - x)/s) - Phi((lo_b - x)/s)
+  of N(x, s) over the bin edges (no bin-centre approximation), for every
+  bin overlapping x +- nsigma*s. The weights are added straight into the
+  bin arrays (contents and sum of squares of weights).
+  SMEAR_CACHE keeps the weights for x quantised to 1/SMEAR_NPOS of a bin
+  and s quantised to steps of at most 1/SMEAR_NSIG relative, computed
+  exactly once each, for s below 2^SMEAR_EMAX bins; wider ones are
+  computed exactly every time.
+*/
+
+#ifndef __SMEAR_H__
+#define __SMEAR_H__
+
+#include <math.h>
+#include <vector>
+
+#define SMEAR_NPOS  64   /* positions per bin      */
+#define SMEAR_NSIG  64   /* resolutions per octave */
+
+typedef struct SMEAR_AXIS {
+  int    nb;             /* number of bins (1..nb; 0 and nb+1 are under/overflow) */
+  double xmin, bw;       /* lower edge and bin width */
+  double nsigma;         /* range of the kernel */
+} SMEAR_AXIS;
+
+/* Exact weights of N(x, s) for bins b0, b0+1, ... (relative to an axis
+   starting at xmin), only bins 1..nb with clip; returns the number of
+   weights written to w */
+inline int smear_weights(const SMEAR_AXIS &a, double x, double s, int &b0, std::vector<double> &w,
+                         bool clip = true){
+  w.clear();
+  double u  = (x - a.xmin) / a.bw;
+  double us = s / a.bw;
+  double flo = floor(u - a.nsigma*us) + 1, fhi = floor(u + a.nsigma*us) + 1;
+  if (clip) {
+    if (flo > a.nb || fhi < 1) { b0 = 1; return 0; }
+    flo = flo < 1 ? 1 : flo;
+    fhi = fhi > a.nb ? a.nb : fhi;
+  }
+  int lo = (int)flo, hi = (int)fhi;
+  b0 = lo;
+  double c0 = 0.5*erfc(-((lo-1) - u)/(us*M_SQRT2));
+  for (int b=lo; b<=hi; b++) {
+    double c1 = 0.5*erfc(-(b - u)/(us*M_SQRT2));
+    w.push_back(c1 - c0);
+    c0 = c1;
+  }
+  return w.size();
+}
+
+/* Add weights w of bins b0.. into a spectrum, skipping under/overflow */
+template <typename T>
+inline void smear_add(const SMEAR_AXIS &a, T *arr, double *sumw2, int b0, const std::vector<double> &w){
+  int n = w.size();
+  int k0 = b0 < 1 ? 1 - b0 : 0;
+  int k1 = b0 + n - 1 > a.nb ? a.nb - b0 : n - 1;
+  for (int k=k0; k<=k1; k++) {
+    arr[b0+k] += w[k];
+    if (sumw2) sumw2[b0+k] += w[k]*w[k];
+  }
+}
+
+/* Smear one event exactly; a vanishing resolution fills the bin of x */
+template <typename T>
+inline void smear_exact(const SMEAR_AXIS &a, T *arr, double *sumw2, double x, double s){
+  static thread_local std::vector<double> w;
+  int b0;
+  if (!isfinite(x) || isnan(s)) return;
+  if (!(s > 0.0)) {
+    double u = floor((x - a.xmin)/a.bw) + 1;
+    if (u >= 1 && u <= a.nb) arr[(int)u] += 1.0;
+    if (u >= 1 && u <= a.nb && sumw2) sumw2[(int)u] += 1.0;
+    return;
+  }
+  smear_weights(a, x, s, b0, w);
+  smear_add(a, arr, sumw2, b0, w);
+}
+
+/* Weights for quantised (x, s), relative to the bin of x */
+typedef struct SMEAR_KERNEL {
+  int off;               /* first bin relative to the bin of x */
+  std::vector<double> w;
+} SMEAR_KERNEL;
+
+/* s/bw from 2^SMEAR_EMIN to 2^SMEAR_EMAX; cells filled on first use.
+   An octave has SMEAR_NSIG*SMEAR_NPOS = 4096 kernels of at most
+   2*nsigma*2^e + 2 weights, so a full cache (nsigma 6) takes at most
+   about 15 MB: 1.5 MB of table and 4096 * 8 B * (12*2^5 + 2*12) of
+   weights over the 12 octaves. */
+#define SMEAR_EMIN  -8
+#define SMEAR_EMAX   4
+typedef struct SMEAR_CACHE {
+  std::vector<SMEAR_KERNEL> kernel;
+} SMEAR_CACHE;
+
+template <typename T>
+inline void smear_cached(SMEAR_CACHE &c, const SMEAR_AXIS &a, T *arr, double *sumw2, double x, double s){
+  double u  = (x - a.xmin) / a.bw;
+  int e;
+  double m = frexp(s / a.bw, &e);  // s/bw = m 2^e, m in [0.5, 1)
+  if (!(s > 0.0) || e <= SMEAR_EMIN || e > SMEAR_EMAX || !(u > -a.nb && u < 2*a.nb)) {
+    smear_exact(a, arr, sumw2, x, s);  // degenerate, out of the table or far outside
+    return;
+  }
+  double fb = floor(u);
+  int ipos = (int)((u - fb) * SMEAR_NPOS);
+  int isig = (int)((m - 0.5) * 2 * SMEAR_NSIG);
+  size_t cell = ((size_t)(e - SMEAR_EMIN - 1) * SMEAR_NSIG + isig) * SMEAR_NPOS + ipos;
+
+  if (c.kernel.empty()) c.kernel.resize((SMEAR_EMAX - SMEAR_EMIN) * SMEAR_NSIG * SMEAR_NPOS);
+  SMEAR_KERNEL &k = c.kernel[cell];
+  if (k.w.empty()) {
+    // kernel at the cell centre, on an axis whose bin 1 is the bin of x
+    SMEAR_AXIS r = a;
+    r.xmin = 0.0;
+    r.bw   = 1.0;
+    smear_weights(r, (ipos + 0.5) / SMEAR_NPOS, ldexp(0.5 + (isig + 0.5) / (2 * SMEAR_NSIG), e),
+                  k.off, k.w, false);
+    k.off -= 1;
+  }
+  smear_add(a, arr, sumw2, (int)fb + 1 + k.off, k.w);
+}
+
+#endif /* __SMEAR_H__ */
@@ -0,0 +1,145 @@
+/*
+  Columnar (structure-of-arrays) cache of decoded NGDRV events
+  A run is decoded once into <data file>.soa, next to the data file:
+    SOA_HEADER
+    SOA_NCOL columns of unsigned short [nevent]  (payload words 0..SOA_NCOL-1)
+    unsigned long long [noff]                    (byte offset of events 0, stride, 2 stride, ...)
+  so 12 bytes per event; the offsets only show the progress through the
+  data file. The cache is valid as long as size and mtime of the data file
+  match.
+*/
+
+#ifndef __SOACACHE_H__
+#define __SOACACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+
+#include "ngdrvcommon.h"
+#include "framing.h"
+
+#define SOA_MAGIC  0x32414f53  /* "SOA2" */
+#define SOA_NCOL   6           /* TDC A, TDC B, QDC A, QDCt A, QDC B, QDCt B */
+#define SOA_STRIDE 1024        /* events per offset */
+
+typedef struct SOA_HEADER {
+  unsigned int       magic;
+  unsigned int       ncol;
+  unsigned long long nevent;
+  unsigned long long stride;
+  long long          srcsize;   /* size  of the data file */
+  long long          srcmtime;  /* mtime of the data file */
+} SOA_HEADER;
+
+typedef struct SOA_CACHE {
+  void                     *map;
+  size_t                    size;
+  unsigned long long        nevent;
+  unsigned long long        stride;
+  const unsigned short     *col[SOA_NCOL];
+  const unsigned long long *off;         /* [i/stride]: offset of event i rounded down to the stride */
+} SOA_CACHE;
+
+inline std::string soapath(std::string datFile){ return datFile + ".soa"; }
+
+/* column k starts here; every column is padded to 8 bytes */
+inline size_t soacoloff(unsigned long long nevent, int k){
+  return sizeof(SOA_HEADER) + k * ((nevent*2 + 7) & ~7ULL);
+}
+inline unsigned long long soanoff(unsigned long long nevent, unsigned long long stride){
+  return (nevent + stride - 1) / stride;
+}
+inline size_t soasize(unsigned long long nevent, unsigned long long stride){
+  return soacoloff(nevent, SOA_NCOL) + soanoff(nevent, stride)*8;
+}
+
+/* Map the cache of datFile; false if missing or stale */
+inline bool soaopen(SOA_CACHE &c, std::string datFile, const struct stat &src){
+  memset(&c, 0, sizeof(c));
+  int fd = open(soapath(datFile).c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  fstat(fd, &st);
+  SOA_HEADER h;
+  if (st.st_size < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      h.magic != SOA_MAGIC || h.ncol != SOA_NCOL || h.stride == 0 ||
+      h.srcsize != (long long)src.st_size || h.srcmtime != (long long)src.st_mtime ||
+      (size_t)st.st_size != soasize(h.nevent, h.stride)) {
+    close(fd);
+    return false;
+  }
+  c.size = st.st_size;
+  c.map  = mmap(NULL, c.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (c.map == MAP_FAILED) { c.map = NULL; return false; }
+  madvise(c.map, c.size, MADV_SEQUENTIAL);
+  c.nevent = h.nevent;
+  c.stride = h.stride;
+  for (int k=0; k<SOA_NCOL; k++)
+    c.col[k] = (const unsigned short *)((const char *)c.map + soacoloff(c.nevent, k));
+  c.off = (const unsigned long long *)((const char *)c.map + soacoloff(c.nevent, SOA_NCOL));
+  return true;
+}
+
+inline void soaclose(SOA_CACHE &c){
+  if (c.map) munmap(c.map, c.size);
+  c.map = NULL;
+}
+
+/* Decode the events in [base, end) of datFile into its cache.
+   The framing is walked the same way as the event loop of offline:
+   over corrupt bytes (framesync), stop at NGDRV_EOF, and a truncated last
+   event keeps the words of the previous event where its own are missing. */
+inline bool soabuild(std::string datFile, const unsigned char *base, const unsigned char *end,
+                     const struct stat &src){
+  const unsigned char *p;
+  unsigned short nbyte;
+  unsigned long long nevent = 0;
+  for (p = base; ; nevent++) {
+    p = framesync(p, end, true, NULL);
+    if (end - p < 2) break;
+    memcpy(&nbyte, p, 2);
+    if (nbyte == NGDRV_EOF) break;
+    if (end - p < nbyte) { nevent++; break; }
+    p += nbyte;
+  }
+
+  std::string tmp = soapath(datFile) + ".tmp";
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return false;
+  size_t size = soasize(nevent, SOA_STRIDE);
+  if (ftruncate(fd, size) != 0) { close(fd); unlink(tmp.c_str()); return false; }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { unlink(tmp.c_str()); return false; }
+
+  SOA_HEADER *h = (SOA_HEADER *)map;
+  h->magic = SOA_MAGIC;  h->ncol = SOA_NCOL;  h->nevent = nevent;  h->stride = SOA_STRIDE;
+  h->srcsize = src.st_size;  h->srcmtime = src.st_mtime;
+  unsigned short *col[SOA_NCOL];
+  for (int k=0; k<SOA_NCOL; k++) col[k] = (unsigned short *)((char *)map + soacoloff(nevent, k));
+  unsigned long long *off = (unsigned long long *)((char *)map + soacoloff(nevent, SOA_NCOL));
+
+  unsigned short w[SOA_NCOL] = {0};
+  p = base;
+  for (unsigned long long i=0; i<nevent; i++) {
+    p = framesync(p, end, true, NULL);
+    memcpy(&nbyte, p, 2);
+    long long paylen = nbyte-2;
+    long long have   = end - (p+2) < paylen ? end - (p+2) : paylen;
+    int nw = have/2 < SOA_NCOL ? have/2 : SOA_NCOL;
+    memcpy(w, p+2, nw*2);
+    for (int k=0; k<SOA_NCOL; k++) col[k][i] = w[k];
+    if (i % SOA_STRIDE == 0) off[i / SOA_STRIDE] = p - base;
+    p += 2 + paylen;
+  }
+  munmap(map, size);
+  return rename(tmp.c_str(), soapath(datFile).c_str()) == 0;
+}
+
+#endif /* __SOACACHE_H__ */